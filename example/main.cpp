@@ -1,24 +1,42 @@
 
 #include <fmt/core.h>
 #include <cstdint>
-#include <set>
 #include <unordered_map>
 #include <vector>
 #include <chrono>
 #include <iostream>
 #include <functional>
+#include <memory>
+#include <thread>
 #include "smart_ref.hpp"
+#include "smart_ref/intern_table.hpp"
+#include "smart_ref/ref_cast.hpp"
+#include "smart_ref/ref_queue.hpp"
+#include "smart_ref/ref_vector.hpp"
+#include "smart_ref/small_ref_vector.hpp"
+#include "smart_ref/relocatable_heap.hpp"
 
 using namespace smart_ref;
 
+// Make the compiler assume `value` is read, so benchmark loops producing it are not optimized away.
+template <typename V>
+inline void do_not_optimize(const V &value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
 struct Node;
+struct Graph;
 
-struct Graph
+// Graph keeps its nodes in an intrusive list threaded through their control blocks.
+template <typename T>
+struct smart_ref::ref_traits<T, Graph> : smart_ref::default_ref_traits<T, Graph>
 {
-    std::set<weak_ref<Node, Graph>> nodes;
+    static constexpr bool intrusive_holder = true;
+};
 
-    static void hold_ref(void *self, const weak_ref<Node, Graph> &x) { static_cast<Graph *>(self)->nodes.insert(x); }
-    static void unhold_ref(void *self, const weak_ref<Node, Graph> &w) { static_cast<Graph *>(self)->nodes.erase(w); }
+struct Graph : intrusive_ref_holder<Node, Graph>
+{
 };
 
 struct Node : public enable_shared_ref_from_this<Node, Graph>, enable_ref_holder
@@ -49,7 +67,7 @@ struct Concept : enable_ref_holder
         }
         this->id = (int)(hashInts(comp_ids) % std::numeric_limits<int>::max());
     }
-    std::vector<wpConcept> components;
+    small_ref_vector<wpConcept, 4> components; // most concepts have 2-4 components
 
 public:
     static uint64_t hashInts(const std::vector<int> &arr)
@@ -78,10 +96,10 @@ struct ConceptHolder
         self.holder_map_rev[(size_t)(x.handler)] = x->id;
     }
 
-    static void unhold_ref(void *self_, const wpConcept &w)
+    static void unhold_ref(void *self_, void *handler)
     {
         auto &self = *static_cast<ConceptHolder *>(self_);
-        auto it = self.holder_map_rev.find((size_t)(w.handler));
+        auto it = self.holder_map_rev.find((size_t)(handler));
         if (it == self.holder_map_rev.end())
             throw std::runtime_error("ConceptHolder::unhold_ref: concept not found in holder");
         auto id_it = self.holder_map.find(it->second);
@@ -93,7 +111,7 @@ struct ConceptHolder
     ~ConceptHolder()
     {
         for (auto &[_, wp] : holder_map)
-            wp.handler->holder = nullptr;
+            wp.handler->remove_holder(this);
     }
 };
 struct ConceptNetwork
@@ -121,7 +139,7 @@ struct ConceptNetwork
         {
             auto c = new Concept(comps);
             auto wp = holder.holder_map[id];
-            return shared_ref<Concept, ConceptHolder>::revive(c, wp);
+            return shared_ref<Concept, ConceptHolder>::revive(c, wp.handler);
         }
         auto c = pConcept(new Concept(comps));
         c.set_holder(&holder);
@@ -176,6 +194,33 @@ void performance()
         auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
         fmt::print("smart_ref::shared_ref time: {} ms, sum: {}\n", duration, sum);
     }
+    {
+        // Iteration alone: both containers point at the same objects, built before the clock starts.
+        ref_vector<int> refs;
+        std::vector<int *> raw;
+        refs.reserve(N);
+        raw.reserve(N);
+        for (auto i = 0; i < N; ++i)
+        {
+            refs.push_back(shared_ref<int>(new int(i)));
+            raw.push_back(refs[i]);
+        }
+        auto sum_all = [&](auto &data)
+        {
+            uint64_t sum = 0;
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int round = 0; round < 10; ++round)
+                for (size_t i = 0; i < data.size(); ++i)
+                    sum += *data[i];
+            auto end = std::chrono::high_resolution_clock::now();
+            return std::make_pair(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0,
+                                  sum);
+        };
+        auto [raw_ms, raw_sum] = sum_all(raw);
+        auto [refs_ms, refs_sum] = sum_all(refs);
+        fmt::print("iteration over {} elements x10: std::vector<int *> {} ms, smart_ref::ref_vector {} ms ({} / {})\n", N,
+                   raw_ms, refs_ms, raw_sum, refs_sum);
+    }
     {
         uint64_t sum = 0;
         std::vector<std::shared_ptr<int>> data;
@@ -198,6 +243,675 @@ void performance()
     }
 }
 
+// Concepts shared between ingestion threads: atomic counters, interned by id in a sharded table.
+struct Atom;
+
+template <typename H>
+struct smart_ref::ref_traits<Atom, H> : smart_ref::default_ref_traits<Atom, H>
+{
+    static constexpr bool atomic_counts = true;
+};
+
+struct Atom : enable_ref_holder
+{
+    uint64_t id;
+    Atom(uint64_t id) : id(id) {}
+};
+
+void concurrent_ingestion()
+{
+    const size_t ops_per_thread = 200000;
+    const uint64_t key_space = 1 << 16;
+
+    for (int threads : {1, 2, 4, 8, 16, 32})
+    {
+        intern_table<uint64_t, Atom> table;
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; ++t)
+            pool.emplace_back(
+                [&, t]
+                {
+                    // Keep a window of recent concepts alive, and weak refs to older ones: those die and are
+                    // later revived in place.
+                    std::vector<shared_ref<Atom>> recent(64);
+                    std::vector<weak_ref<Atom>> seen(1024);
+                    uint64_t x = 0x9E3779B97F4A7C15ull * (t + 1);
+                    for (size_t i = 0; i < ops_per_thread; ++i)
+                    {
+                        x ^= x << 13;
+                        x ^= x >> 7;
+                        x ^= x << 17;
+                        auto id = x % key_space;
+                        auto c = table.intern(id, [id] { return new Atom(id); });
+                        seen[id % seen.size()] = c;
+                        recent[i % recent.size()] = c;
+                    }
+                });
+        for (auto &th : pool)
+            th.join();
+        auto end = std::chrono::high_resolution_clock::now();
+        auto ms = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+        fmt::print("intern_table ingestion, {:2} threads: {:8.1f} ms, {:6.2f} Mops/s, {} entries\n", threads, ms,
+                   threads * ops_per_thread / ms / 1000.0, table.size());
+    }
+}
+
+// The same hot object with one shared counter and with per-thread counter shards.
+struct HotAtom : enable_ref_holder
+{
+};
+struct ShardedAtom : enable_ref_holder
+{
+};
+
+template <typename H>
+struct smart_ref::ref_traits<HotAtom, H> : smart_ref::default_ref_traits<HotAtom, H>
+{
+    static constexpr bool atomic_counts = true;
+};
+
+template <typename H>
+struct smart_ref::ref_traits<ShardedAtom, H> : smart_ref::default_ref_traits<ShardedAtom, H>
+{
+    static constexpr bool atomic_counts = true;
+    static constexpr unsigned count_shards = 32;
+};
+
+template <typename T>
+double retain_release_mops(int threads, size_t ops_per_thread)
+{
+    shared_ref<T> root(new T());
+    ref_pin<T> pin;
+    if constexpr (shared_ref<T>::block_type::count_shards > 0)
+        pin = root.pin();
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; ++t)
+        pool.emplace_back(
+            [&]
+            {
+                for (size_t i = 0; i < ops_per_thread; ++i)
+                {
+                    auto copy = root;
+                    (void)copy;
+                }
+            });
+    for (auto &th : pool)
+        th.join();
+    auto end = std::chrono::high_resolution_clock::now();
+    auto ms = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+    return threads * ops_per_thread / ms / 1000.0;
+}
+
+void contended_retain()
+{
+    const size_t ops_per_thread = 2000000;
+    for (int threads : {1, 2, 4, 8, 16, 32})
+        fmt::print("hot object retain/release, {:2} threads: single counter {:7.2f} Mops/s, sharded {:7.2f} Mops/s\n",
+                   threads, retain_release_mops<HotAtom>(threads, ops_per_thread),
+                   retain_release_mops<ShardedAtom>(threads, ops_per_thread));
+}
+
+// Fan-out copies of a hot object from per-thread refs: every shared_ref copy writes the block, a weighted_ref copy
+// only splits its local weight (the release still returns weight to the block).
+template <typename Ref>
+double fanout_mops(int threads, size_t ops_per_thread)
+{
+    Ref root(shared_ref<HotAtom>(new HotAtom()));
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; ++t)
+        pool.emplace_back(
+            [local = root, ops_per_thread]
+            {
+                for (size_t i = 0; i < ops_per_thread; ++i)
+                {
+                    auto copy = local;
+                    (void)copy;
+                }
+            });
+    for (auto &th : pool)
+        th.join();
+    auto end = std::chrono::high_resolution_clock::now();
+    auto ms = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+    return threads * ops_per_thread / ms / 1000.0;
+}
+
+void weighted_fanout()
+{
+    fmt::print("Size of shared_ref<HotAtom>: {}; of weighted_ref<HotAtom>: {}\n", sizeof(shared_ref<HotAtom>),
+               sizeof(weighted_ref<HotAtom>));
+    const size_t ops_per_thread = 2000000;
+    for (int threads : {1, 2, 4, 8})
+        fmt::print("fan-out copies, {:2} threads: shared_ref {:7.2f} Mops/s, weighted_ref {:7.2f} Mops/s\n", threads,
+                   fanout_mops<shared_ref<HotAtom>>(threads, ops_per_thread),
+                   fanout_mops<weighted_ref<HotAtom>>(threads, ops_per_thread));
+}
+
+// Bulk unload of a large tree, inline on one thread and through parallel_teardown_scope.
+struct ReclaimNode
+{
+    std::vector<shared_ref<ReclaimNode>> children;
+};
+
+template <typename H>
+struct smart_ref::ref_traits<ReclaimNode, H> : smart_ref::default_ref_traits<ReclaimNode, H>
+{
+    static constexpr bool atomic_counts = true;
+    static constexpr bool parallel_teardown = true;
+};
+
+shared_ref<ReclaimNode> build_reclaim_tree(int depth)
+{
+    shared_ref<ReclaimNode> node(new ReclaimNode());
+    if (depth > 0)
+        for (int i = 0; i < 4; ++i)
+            node->children.push_back(build_reclaim_tree(depth - 1));
+    return node;
+}
+
+// One reclaimer shows the queueing overhead against inline release; more only help up to the number of cores.
+void bulk_unload()
+{
+    const int depth = 10; // 1.4M nodes
+    fmt::print("bulk unload on {} hardware threads\n", std::thread::hardware_concurrency());
+    for (unsigned threads : {0u, 1u, 2u, 4u, 8u})
+    {
+        auto root = build_reclaim_tree(depth);
+        auto start = std::chrono::high_resolution_clock::now();
+        if (threads == 0)
+            root = nullptr;
+        else
+        {
+            parallel_teardown_scope scope(threads);
+            root = nullptr;
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        auto ms = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+        if (threads == 0)
+            fmt::print("bulk unload, inline:             {:8.1f} ms\n", ms);
+        else
+            fmt::print("bulk unload, {} reclaimer threads: {:8.1f} ms\n", threads, ms);
+    }
+}
+
+// A per-request graph (a binary tree of parent links) built and dropped as heap objects and as one ref_region.
+struct RequestNode;
+
+template <typename H>
+struct smart_ref::ref_traits<RequestNode, H> : smart_ref::default_ref_traits<RequestNode, H>
+{
+    static constexpr bool region_refs = true;
+};
+
+struct RequestNode
+{
+    int value = 0;
+    shared_ref<RequestNode> parent;
+};
+
+template <typename Make>
+long request_graph(size_t nodes, Make make)
+{
+    std::vector<shared_ref<RequestNode>> all;
+    all.reserve(nodes);
+    for (size_t i = 0; i < nodes; ++i)
+    {
+        auto node = make();
+        node->value = int(i);
+        if (i > 0)
+            node->parent = all[i / 2];
+        all.push_back(node);
+    }
+    long sum = 0;
+    for (auto &node : all)
+        sum += node->value + (node->parent ? node->parent->value : 0);
+    return sum;
+}
+
+void region_graphs()
+{
+    const size_t nodes = 1000000;
+    auto start = std::chrono::high_resolution_clock::now();
+    auto sum = request_graph(nodes, [] { return shared_ref<RequestNode>(new RequestNode()); });
+    auto mid = std::chrono::high_resolution_clock::now();
+    auto region = ref_region::create();
+    auto region_sum = request_graph(nodes, [region] { return region->make<RequestNode>(); });
+    region->release();
+    auto end = std::chrono::high_resolution_clock::now();
+    auto ms = [](auto a, auto b) { return std::chrono::duration_cast<std::chrono::microseconds>(b - a).count() / 1000.0; };
+    fmt::print("request graph, heap objects: {:7.1f} ms, ref_region: {:7.1f} ms (sums {} / {})\n", ms(start, mid),
+               ms(mid, end), sum, region_sum);
+}
+
+// Owner-thread retain/release of a partition object with plain, domain and atomic counters.
+struct PlainPart
+{
+};
+struct DomainPart
+{
+};
+struct AtomicPart
+{
+};
+
+template <>
+struct smart_ref::ref_traits<DomainPart, nullptr_t> : smart_ref::default_ref_traits<DomainPart, nullptr_t>
+{
+    static constexpr bool weak_refs = false;
+    static constexpr bool domain_counts = true;
+};
+
+template <>
+struct smart_ref::ref_traits<AtomicPart, nullptr_t> : smart_ref::default_ref_traits<AtomicPart, nullptr_t>
+{
+    static constexpr bool atomic_counts = true;
+};
+
+template <typename T>
+double local_retain_mops(size_t ops)
+{
+    shared_ref<T> root(new T());
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < ops; ++i)
+    {
+        auto copy = root;
+        do_not_optimize(copy.handler);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto ms = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+    return ops / ms / 1000.0;
+}
+
+void domain_partitions()
+{
+    const size_t ops = 20000000;
+    ref_domain partition;
+    ref_domain::scope scope(partition);
+    fmt::print("owner retain/release: plain {:7.1f} Mops/s, domain {:7.1f} Mops/s, atomic {:7.1f} Mops/s\n",
+               local_retain_mops<PlainPart>(ops), local_retain_mops<DomainPart>(ops), local_retain_mops<AtomicPart>(ops));
+}
+
+// A fragmented relocatable heap, traversed before and after compact().
+struct Cell;
+
+template <typename H>
+struct smart_ref::ref_traits<Cell, H> : smart_ref::default_ref_traits<Cell, H>
+{
+    static constexpr bool relocatable = true;
+};
+
+struct Cell
+{
+    long value = 0;
+    char payload[40] = {};
+    Cell(long v) : value(v) {}
+};
+
+#if defined(__linux__)
+#include <fstream>
+#include <unistd.h>
+#endif
+
+// Resident set size in MiB, or 0 where the platform does not report it.
+double resident_mib()
+{
+#if defined(__linux__)
+    size_t total = 0, resident = 0;
+    std::ifstream("/proc/self/statm") >> total >> resident;
+    return resident * double(sysconf(_SC_PAGESIZE)) / (1 << 20);
+#else
+    return 0;
+#endif
+}
+
+void heap_compaction()
+{
+    relocatable_heap<Cell> heap;
+    std::vector<shared_ref<Cell>> survivors;
+    {
+        std::vector<shared_ref<Cell>> all;
+        for (long i = 0; i < 2000000; ++i)
+            all.push_back(heap.make(i));
+        for (size_t i = 0; i < all.size(); i += 16)
+            survivors.push_back(all[i]);
+    }
+    auto traverse = [&]
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        long sum = 0;
+        for (int round = 0; round < 20; ++round)
+            for (auto &c : survivors)
+                sum += c->value;
+        auto end = std::chrono::high_resolution_clock::now();
+        return std::make_pair(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0, sum);
+    };
+    auto slabs_before = heap.slab_count();
+    auto [before_ms, before_sum] = traverse();
+    auto rss_before = resident_mib();
+    auto moved = heap.compact();
+    auto rss_after = resident_mib();
+    auto [after_ms, after_sum] = traverse();
+    fmt::print("relocatable heap: {} slabs -> {} after moving {} objects; RSS {:.1f} MiB -> {:.1f} MiB; traversal {:.1f} "
+               "ms -> {:.1f} ms ({} / {})\n",
+               slabs_before, heap.slab_count(), moved, rss_before, rss_after, before_ms, after_ms, before_sum, after_sum);
+}
+
+// Steady create/drop churn over a window of live messages, with heap allocation vs slab_store slots.
+struct HeapMsg
+{
+    long id;
+    char payload[48] = {};
+    HeapMsg(long i) : id(i) {}
+};
+struct SlabMsg
+{
+    long id;
+    char payload[48] = {};
+    SlabMsg(long i) : id(i) {}
+};
+
+template <>
+struct smart_ref::ref_traits<HeapMsg, nullptr_t> : smart_ref::default_ref_traits<HeapMsg, nullptr_t>
+{
+    static constexpr bool atomic_counts = true;
+};
+
+template <>
+struct smart_ref::ref_traits<SlabMsg, nullptr_t> : smart_ref::default_ref_traits<SlabMsg, nullptr_t>
+{
+    static constexpr bool atomic_counts = true;
+    static constexpr bool slab_storage = true;
+};
+
+template <typename T, typename Make>
+double churn_mops(size_t ops, Make make)
+{
+    std::vector<shared_ref<T>> window(4096);
+    auto start = std::chrono::high_resolution_clock::now();
+    uint32_t seed = 1;
+    for (size_t i = 0; i < ops; ++i)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        window[seed >> 20] = make(long(i));
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto ms = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+    return ops / ms / 1000.0;
+}
+
+void slab_churn()
+{
+    const size_t ops = 10000000;
+    auto heap = churn_mops<HeapMsg>(ops, [](long i) { return shared_ref<HeapMsg>(new HeapMsg(i)); });
+    auto slab = churn_mops<SlabMsg>(ops, [](long i) { return slab_store<SlabMsg>::make(i); });
+    fmt::print("create/drop churn: new/delete {:6.1f} Mops/s, slab_store {:6.1f} Mops/s ({} slab)\n", heap, slab,
+               slab_store<SlabMsg>::slab_count());
+}
+
+// Retain/release of slab objects from a thread pinned to the objects' node and from one pinned to another node,
+// then again after migrating the objects' pages to the second node.
+struct NumaMsg
+{
+    long id;
+    NumaMsg(long i) : id(i) {}
+};
+
+template <>
+struct smart_ref::ref_traits<NumaMsg, nullptr_t> : smart_ref::default_ref_traits<NumaMsg, nullptr_t>
+{
+    static constexpr bool atomic_counts = true;
+    static constexpr bool slab_storage = true;
+};
+
+#if defined(__linux__)
+#include <sched.h>
+
+// Run `f` on a thread pinned to `cpu`.
+template <typename F>
+void on_cpu(int cpu, F f)
+{
+    std::thread t(
+        [&]
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            sched_setaffinity(0, sizeof(set), &set);
+            f();
+        });
+    t.join();
+}
+
+void numa_placement()
+{
+    // One CPU per node.
+    std::vector<int> node_cpu;
+    for (int cpu = 0; cpu < int(std::thread::hardware_concurrency()); ++cpu)
+        on_cpu(cpu,
+               [&]
+               {
+                   auto node = size_t(current_numa_node());
+                   if (node >= node_cpu.size())
+                       node_cpu.resize(node + 1, -1);
+                   if (node_cpu[node] < 0)
+                       node_cpu[node] = cpu;
+               });
+    std::erase(node_cpu, -1);
+
+    std::vector<shared_ref<NumaMsg>> objects;
+    on_cpu(node_cpu.front(),
+           [&]
+           {
+               for (long i = 0; i < 200000; ++i)
+                   objects.push_back(slab_store<NumaMsg>::make(i));
+           });
+    auto touch_ns = [&](int cpu)
+    {
+        double ns = 0;
+        on_cpu(cpu,
+               [&]
+               {
+                   auto start = std::chrono::high_resolution_clock::now();
+                   for (int round = 0; round < 20; ++round)
+                       for (auto &o : objects)
+                       {
+                           auto copy = o;
+                           do_not_optimize(copy.get());
+                       }
+                   auto end = std::chrono::high_resolution_clock::now();
+                   ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 20.0 /
+                        objects.size();
+               });
+        return ns;
+    };
+    if (node_cpu.size() < 2)
+    {
+        fmt::print("numa placement: single node, local retain/release {:.1f} ns\n", touch_ns(node_cpu.front()));
+        return;
+    }
+    auto local = touch_ns(node_cpu[0]);
+    auto remote = touch_ns(node_cpu[1]);
+    size_t moved = 0;
+    for (auto &o : objects)
+        moved += slab_store<NumaMsg>::migrate(o, 1);
+    auto migrated = touch_ns(node_cpu[1]);
+    fmt::print("numa placement: retain/release local {:.1f} ns, remote {:.1f} ns, "
+               "after migrating {} to node 1 {:.1f} ns\n",
+               local, remote, moved, migrated);
+}
+#else
+void numa_placement() {}
+#endif
+
+// A visitor pass over a heterogeneous tree that downcasts every node, with dynamic_pointer_cast and dyn_ref_cast.
+struct Syntax : ref_typed<Syntax>
+{
+    long value = 1;
+    virtual ~Syntax() = default;
+};
+struct Operand : ref_typed<Operand, Syntax>
+{
+};
+struct Operation : ref_typed<Operation, Syntax>
+{
+};
+struct Invoke : ref_typed<Invoke, Operation>
+{
+};
+
+template <typename Cast>
+double visit_ms(const std::vector<shared_ref<Syntax>> &nodes, Cast cast, long &calls)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int round = 0; round < 10; ++round)
+        for (auto &n : nodes)
+            if (auto op = cast(n))
+                calls += op->value;
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+}
+
+void typed_visitor()
+{
+    std::vector<shared_ref<Syntax>> nodes;
+    for (int i = 0; i < 1000000; ++i)
+        nodes.push_back(i % 3 == 0 ? shared_ref<Syntax>(new Operand()) :
+                        i % 3 == 1 ? shared_ref<Syntax>(new Operation()) : shared_ref<Syntax>(new Invoke()));
+    long rtti_calls = 0, tag_calls = 0;
+    auto rtti = visit_ms(nodes, [](auto &n) { return std::dynamic_pointer_cast<Operation>(n); }, rtti_calls);
+    auto tags = visit_ms(nodes, [](auto &n) { return dyn_ref_cast<Operation>(n); }, tag_calls);
+    fmt::print("visitor downcasts: dynamic_pointer_cast {:6.1f} ms, dyn_ref_cast {:6.1f} ms ({} / {} hits)\n", rtti,
+               tags, rtti_calls, tag_calls);
+}
+
+// Dropping the dead half of a large weak edge list: std::erase_if over weak_refs vs weak_ref_vector.
+void weak_compaction()
+{
+    const int n = 2000000;
+    std::vector<shared_ref<int>> live;
+    std::vector<weak_ref<int>> plain;
+    weak_ref_vector<int> dense;
+    for (int i = 0; i < n; ++i)
+    {
+        shared_ref<int> a(new int(i)), b(new int(i));
+        plain.push_back(a);
+        dense.push_back(b);
+        if (i % 2 == 0)
+        {
+            live.push_back(a);
+            live.push_back(b);
+        }
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    auto plain_removed = std::erase_if(plain, [](auto &w) { return w.expired(); });
+    auto mid = std::chrono::high_resolution_clock::now();
+    auto dense_removed = dense.compact_expired();
+    auto end = std::chrono::high_resolution_clock::now();
+    auto ms = [](auto a, auto b) { return std::chrono::duration_cast<std::chrono::microseconds>(b - a).count() / 1000.0; };
+    fmt::print("expired weak compaction: std::erase_if {:6.1f} ms, weak_ref_vector {:6.1f} ms ({} / {} removed)\n",
+               ms(start, mid), ms(mid, end), plain_removed, dense_removed);
+}
+
+// Nodes with three component edges each, kept in a std::vector vs inline in a small_ref_vector.
+template <template <typename> typename Edges>
+struct AdjacencyNode
+{
+    long id;
+    Edges<weak_ref<AdjacencyNode>> components;
+    AdjacencyNode(long i) : id(i) {}
+};
+
+template <typename Ref>
+using heap_edges = std::vector<Ref>;
+template <typename Ref>
+using inline_edges = small_ref_vector<Ref, 4>;
+
+template <template <typename> typename Edges>
+std::pair<double, double> adjacency_ms(long n, long &sum)
+{
+    using Node = AdjacencyNode<Edges>;
+    std::vector<shared_ref<Node>> nodes;
+    nodes.reserve(n);
+    auto start = std::chrono::high_resolution_clock::now();
+    for (long i = 0; i < n; ++i)
+    {
+        shared_ref<Node> node(new Node(i));
+        for (long k = 1; k <= 3 && k * k <= i; ++k)
+            node->components.push_back(nodes[i - k * k]);
+        nodes.push_back(std::move(node));
+    }
+    auto mid = std::chrono::high_resolution_clock::now();
+    for (auto &node : nodes)
+        for (auto &c : node->components)
+            sum += c.lock()->id;
+    auto end = std::chrono::high_resolution_clock::now();
+    auto ms = [](auto a, auto b) { return std::chrono::duration_cast<std::chrono::microseconds>(b - a).count() / 1000.0; };
+    return {ms(start, mid), ms(mid, end)};
+}
+
+void concept_adjacency()
+{
+    const long n = 1000000;
+    long heap_sum = 0, inline_sum = 0;
+    auto [heap_build, heap_walk] = adjacency_ms<heap_edges>(n, heap_sum);
+    auto [inline_build, inline_walk] = adjacency_ms<inline_edges>(n, inline_sum);
+    fmt::print("component edges: std::vector build {:6.1f} ms walk {:6.1f} ms, small_ref_vector build {:6.1f} ms walk "
+               "{:6.1f} ms ({} / {})\n",
+               heap_build, heap_walk, inline_build, inline_walk, heap_sum, inline_sum);
+}
+
+// Producer -> relay -> consumer through two ref_queues. The relay either forwards by copy (retain + release of the
+// shared object per hop) or by move (no counter traffic).
+template <bool Move>
+double relay_handoff_mops(size_t items)
+{
+    shared_ref<HotAtom> root(new HotAtom());
+    ref_queue<HotAtom> first(1024), second(1024);
+    auto start = std::chrono::high_resolution_clock::now();
+    std::thread producer(
+        [&]
+        {
+            for (size_t i = 0; i < items; ++i)
+            {
+                auto ref = root;
+                while (!first.try_push(std::move(ref)))
+                    std::this_thread::yield();
+            }
+        });
+    std::thread relay(
+        [&]
+        {
+            shared_ref<HotAtom> ref;
+            for (size_t i = 0; i < items; ++i)
+            {
+                while (!first.try_pop(ref))
+                    std::this_thread::yield();
+                auto forwarded = Move ? std::move(ref) : ref;
+                while (!second.try_push(std::move(forwarded)))
+                    std::this_thread::yield();
+                ref = nullptr;
+            }
+        });
+    shared_ref<HotAtom> ref;
+    for (size_t i = 0; i < items; ++i)
+        while (!second.try_pop(ref))
+            std::this_thread::yield();
+    producer.join();
+    relay.join();
+    auto end = std::chrono::high_resolution_clock::now();
+    auto ms = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
+    return items / ms / 1000.0;
+}
+
+void relay_handoff()
+{
+    const size_t items = 2000000;
+    fmt::print("ref_queue relay: forward by copy {:6.2f} Mrefs/s, by move {:6.2f} Mrefs/s\n",
+               relay_handoff_mops<false>(items), relay_handoff_mops<true>(items));
+}
+
 void concept_network_example()
 {
 
@@ -232,6 +946,8 @@ int main()
 
     fmt::print("Size of SharedRef<int>: {}; size of std::shared_ptr<int>: {}\n", sizeof(shared_ref<int>),
                sizeof(std::shared_ptr<int>));
+    fmt::print("Size of control block of SharedRef<int>: {}; of pConcept: {}\n", sizeof(shared_ref<int>::handler_type),
+               sizeof(pConcept::handler_type));
     auto a = std::shared_ptr<int>(new int(42));
 
     fmt::print("strong count: {}\n", a.use_count());
@@ -248,12 +964,25 @@ int main()
     n1 = shared_ref(new Node(20));
     auto n1w = weak_ref<Node>(n1);
     n1 = n2;
-    auto n1r = shared_ref<Node>::revive(new Node(30), n1w);
+    auto n1r = shared_ref<Node>::revive(new Node(30), n1w.handler);
     if (bool(n1w.lock()))
         fmt::print("Locked node value: {}\n", n1w.lock()->value);
 
     concept_network_example();
     performance();
+    concurrent_ingestion();
+    contended_retain();
+    weighted_fanout();
+    relay_handoff();
+    bulk_unload();
+    region_graphs();
+    domain_partitions();
+    heap_compaction();
+    slab_churn();
+    numa_placement();
+    typed_visitor();
+    weak_compaction();
+    concept_adjacency();
 
     std::string s = "hello";
     std::hash<std::string> hasher;
@@ -27,11 +27,38 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
 #include <stdexcept>
 #include <type_traits>
 #include <cassert>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+#include <utility>
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// ref_view keeps a weak unit on its block and asserts the object is still alive whenever it is used.
+#ifndef SMART_REF_DEBUG_VIEWS
+#ifdef NDEBUG
+#define SMART_REF_DEBUG_VIEWS 0
+#else
+#define SMART_REF_DEBUG_VIEWS 1
+#endif
+#endif
 
 /* Forward Declarations */
 namespace smart_ref
@@ -47,6 +74,49 @@ namespace smart_ref
     template <typename T, typename HolderPolicy = nullptr_t>
     struct enable_shared_ref_from_this;
 
+    template <typename T, typename HolderPolicy = nullptr_t>
+    struct ref_view;
+
+    template <typename T, typename HolderPolicy = nullptr_t>
+    struct static_ref_block;
+
+    template <typename T, typename HolderPolicy = nullptr_t>
+    struct ref_token;
+
+    template <typename T, typename HolderPolicy = nullptr_t>
+    struct weighted_ref;
+
+    template <typename T, typename HolderPolicy = nullptr_t>
+    struct ref_pin;
+
+    template <typename T, typename HolderPolicy = nullptr_t>
+    struct tagged_ref;
+
+    template <typename T, typename HolderPolicy = nullptr_t>
+    struct tagged_weak_ref;
+
+    template <typename T, typename HolderPolicy = nullptr_t>
+    struct ref_vector;
+
+    struct ref_region;
+
+    struct ref_domain;
+
+    template <typename T, typename HolderPolicy = nullptr_t>
+    struct relocatable_heap;
+
+    template <typename T, typename HolderPolicy = nullptr_t>
+    struct slab_store;
+
+    template <typename T, typename HolderPolicy>
+    struct default_ref_traits;
+
+    template <typename T, typename HolderPolicy>
+    struct ref_traits;
+
+    template <typename T, typename HolderPolicy>
+    struct intrusive_ref_holder;
+
 } // namespace smart_ref
 
 /* Implementation of Smart Reference */
@@ -62,342 +132,3210 @@ namespace smart_ref
     {
     };
 
+    // Per-(type, policy) knobs that select the control-block layout. To opt in, specialize ref_traits (a partial
+    // specialization on the policy covers every type it holds) and derive it from default_ref_traits.
+    // Only T and HolderPolicy's identity may be inspected here: both are usually incomplete at that point.
+    template <typename T, typename HolderPolicy>
+    struct default_ref_traits
+    {
+        // Blocks carry prev/next links into the holder's member list (see intrusive_ref_holder).
+        static constexpr bool intrusive_holder = false;
+        // Width of the strong/weak counters; uint16_t suits small-fanout types. The top bit of each counter is a flag,
+        // so an object holds at most 2^15 - 2 strong and as many weak refs with uint16_t (2^31 - 2 with uint32_t);
+        // going past that aborts the process, in release builds too.
+        using count_type = uint32_t;
+        // False for types that never use weak_ref: the block then keeps only the strong counter (and holders).
+        static constexpr bool weak_refs = true;
+        // The strong count lives in the object (T derives from enable_lazy_ref_block) and the control block becomes
+        // a side block, allocated the first time a weak_ref or a holder needs it.
+        static constexpr bool lazy_block = false;
+        // Counters are std::atomic, so copies, releases, lock() and revive of one object may race across threads.
+        // Holder registration is not synchronized: holders serialize set_holder/remove_holder themselves.
+        static constexpr bool atomic_counts = false;
+        // Split the strong counter over this many cache-line shards, for objects that many threads retain and release
+        // at once. Requires atomic_counts; the shards are only used while a shared_ref::pin() token is alive (see
+        // _::sharded_counts).
+        static constexpr unsigned count_shards = 0;
+        // Copies and releases log +1/-1 into a thread-local buffer, coalesced per block and applied by
+        // flush_deferred() (or when the buffer fills); objects reaching zero are destroyed there. For objects used by
+        // one thread only; cannot be combined with atomic_counts or lazy_block.
+        static constexpr bool deferred_counts = false;
+        // Objects whose last release happens inside a parallel_teardown_scope are destroyed by the scope's reclaimer
+        // threads, so the cascade through a large dead graph runs on all of them. Requires atomic_counts.
+        static constexpr bool parallel_teardown = false;
+        // Objects can be allocated into a ref_region; blocks gain a pointer to their region. Cannot be combined with
+        // lazy_block or count_shards.
+        static constexpr bool region_refs = false;
+        // Each block records the ref_domain that was current on the thread creating it. Retains and releases on that
+        // domain's thread are plain increments; other threads retain with one atomic add and send their releases to
+        // the owner's inbox, applied in batches by ref_domain::drain(). Strong counts only (weak_refs = false); cannot
+        // be combined with atomic_counts, deferred_counts, lazy_block or region_refs.
+        static constexpr bool domain_counts = false;
+        // Objects live in a relocatable_heap, which may move them (compact()): refs dereference through the block's
+        // object pointer instead of their cached `ptr`. Needs weak_refs; cannot be combined with lazy_block or
+        // region_refs.
+        static constexpr bool relocatable = false;
+        // An object and its block share one slot of slab_store<T, HolderPolicy>, which creates and revives them;
+        // freed slots are reused. Cannot be combined with lazy_block, region_refs or relocatable.
+        static constexpr bool slab_storage = false;
+    };
+
+    template <typename T, typename HolderPolicy>
+    struct ref_traits : default_ref_traits<T, HolderPolicy>
+    {
+    };
+
     namespace _
     {
         struct holder_base
+        {
+            // The first holder lives inline. `extra` is either a second inline holder or, when its low bit is set,
+            // a heap spill list carrying every holder after the first one.
+            void *holder = nullptr;
+            uintptr_t extra = 0;
+
+            holder_base() = default;
+            holder_base(const holder_base &) = delete;
+            holder_base &operator=(const holder_base &) = delete;
+            ~holder_base() { clear_holders(); }
+
+            bool has_holder(void *h) const
+            {
+                if (h == nullptr)
+                    return false;
+                if (holder == h)
+                    return true;
+                if (auto spill = _spill())
+                    return std::find(spill->begin(), spill->end(), h) != spill->end();
+                return reinterpret_cast<void *>(extra) == h;
+            }
+
+            // Returns false if `h` was already registered.
+            bool add_holder(void *h)
+            {
+                assert(h != nullptr && (reinterpret_cast<uintptr_t>(h) & 1) == 0);
+                if (has_holder(h))
+                    return false;
+                if (holder == nullptr)
+                    holder = h;
+                else if (extra == 0)
+                    extra = reinterpret_cast<uintptr_t>(h);
+                else if (auto spill = _spill())
+                    spill->push_back(h);
+                else
+                {
+                    auto list = new std::vector<void *>{reinterpret_cast<void *>(extra), h};
+                    extra = reinterpret_cast<uintptr_t>(list) | 1;
+                }
+                return true;
+            }
+
+            // Returns false if `h` was not registered. Remaining holders keep their order.
+            bool remove_holder(void *h)
+            {
+                if (h == nullptr)
+                    return false;
+                if (holder == h)
+                {
+                    holder = _pop_front_extra();
+                    return true;
+                }
+                if (auto spill = _spill())
+                {
+                    auto it = std::find(spill->begin(), spill->end(), h);
+                    if (it == spill->end())
+                        return false;
+                    spill->erase(it);
+                    if (spill->size() == 1)
+                    {
+                        extra = reinterpret_cast<uintptr_t>(spill->front());
+                        delete spill;
+                    }
+                    return true;
+                }
+                if (reinterpret_cast<void *>(extra) != h)
+                    return false;
+                extra = 0;
+                return true;
+            }
+
+            template <typename F>
+            void for_each_holder(F &&f) const
+            {
+                if (holder == nullptr)
+                    return;
+                f(holder);
+                if (auto spill = _spill())
+                {
+                    for (auto h : *spill)
+                        f(h);
+                }
+                else if (extra != 0)
+                    f(reinterpret_cast<void *>(extra));
+            }
+
+            // Detach every holder first, then hand each one to `f`, so callbacks observe a block without holders.
+            template <typename F>
+            void release_holders(F &&f)
+            {
+                if (holder == nullptr)
+                    return;
+                auto first = holder;
+                auto rest = extra;
+                holder = nullptr;
+                extra = 0;
+                f(first);
+                if (rest & 1)
+                {
+                    auto spill = reinterpret_cast<std::vector<void *> *>(rest & ~uintptr_t(1));
+                    for (auto h : *spill)
+                        f(h);
+                    delete spill;
+                }
+                else if (rest != 0)
+                    f(reinterpret_cast<void *>(rest));
+            }
+
+            void clear_holders()
+            {
+                if (auto spill = _spill())
+                    delete spill;
+                holder = nullptr;
+                extra = 0;
+            }
+
+        private:
+            std::vector<void *> *_spill() const
+            {
+                return (extra & 1) ? reinterpret_cast<std::vector<void *> *>(extra & ~uintptr_t(1)) : nullptr;
+            }
+
+            void *_pop_front_extra()
+            {
+                if (auto spill = _spill())
+                {
+                    auto h = spill->front();
+                    spill->erase(spill->begin());
+                    if (spill->size() == 1)
+                    {
+                        extra = reinterpret_cast<uintptr_t>(spill->front());
+                        delete spill;
+                    }
+                    return h;
+                }
+                auto h = reinterpret_cast<void *>(extra);
+                extra = 0;
+                return h;
+            }
+        };
+        // Node of a circular doubly-linked list; an unlinked node has null links.
+        struct ref_link
+        {
+            ref_link *prev = nullptr;
+            ref_link *next = nullptr;
+
+            bool linked() const { return next != nullptr; }
+
+            void link_before(ref_link *pos)
+            {
+                prev = pos->prev;
+                next = pos;
+                pos->prev->next = this;
+                pos->prev = this;
+            }
+
+            void unlink()
+            {
+                if (!linked())
+                    return;
+                prev->next = next;
+                next->prev = prev;
+                prev = next = nullptr;
+            }
+        };
+
+        // Holder storage for intrusive mode: a single holder whose member list this block is spliced into.
+        struct linked_holder_base : ref_link
         {
             void *holder = nullptr;
+
+            linked_holder_base() = default;
+            linked_holder_base(const linked_holder_base &) = delete;
+            linked_holder_base &operator=(const linked_holder_base &) = delete;
+            ~linked_holder_base() { clear_holders(); }
+
+            bool has_holder(void *h) const { return h != nullptr && holder == h; }
+
+            // Splice into `members`; the block must not be held by another holder.
+            void link_holder(void *h, ref_link *members)
+            {
+                assert(holder == nullptr && !linked());
+                holder = h;
+                link_before(members);
+            }
+
+            bool remove_holder(void *h)
+            {
+                if (!has_holder(h))
+                    return false;
+                clear_holders();
+                return true;
+            }
+
+            template <typename F>
+            void for_each_holder(F &&f) const
+            {
+                if (holder)
+                    f(holder);
+            }
+
+            template <typename F>
+            void release_holders(F &&f)
+            {
+                if (holder == nullptr)
+                    return;
+                auto h = holder;
+                clear_holders();
+                f(h);
+            }
+
+            void clear_holders()
+            {
+                unlink();
+                holder = nullptr;
+            }
+        };
+
+        // List head embedded in intrusive holders.
+        struct intrusive_holder_base
+        {
+            ref_link members;
+
+            intrusive_holder_base() { members.prev = members.next = &members; }
+            intrusive_holder_base(const intrusive_holder_base &) = delete;
+            intrusive_holder_base &operator=(const intrusive_holder_base &) = delete;
+            ~intrusive_holder_base() { detach_all(); }
+
+            bool empty() const { return members.next == &members; }
+
+            // Forget every member without notification, e.g. when the holder dies before the objects it tracks.
+            void detach_all()
+            {
+                while (!empty())
+                    static_cast<linked_holder_base *>(members.next)->clear_holders();
+            }
         };
+
         struct empty_base
         {
         };
 
-        template <bool enable_holder = true>
-        struct ref_block : std::conditional_t<enable_holder, holder_base, empty_base>
+        // Which parts a control block is made of; see block_for.
+        struct block_layout
+        {
+            bool holder = true;            // holder slots, dropped when HolderPolicy is nullptr_t
+            bool intrusive_holder = false; // one holder plus member-list links instead of holder slots
+            bool weak = true;              // object pointer and weak counter, dropped for strong-only types
+            uint8_t count_bits = 32;       // width of the counters: 32 or 16
+            bool atomic_counts = false;    // std::atomic counters with a claim protocol for revive
+            uint8_t count_shards = 0;      // per-thread strong counter shards, 0 for a single counter
+            bool deferred_counts = false;  // strong count changes go through the thread's deferred_log
+            bool region = false;           // blocks can belong to a ref_region
+            bool domain = false;           // owner-thread counter plus an atomic counter for other threads
+        };
+
+        // A counter would carry into its flag bit. Checked in release builds too: wrapping would free a live object.
+        [[noreturn]] inline void count_overflow()
+        {
+            std::fputs("smart_ref: reference count overflow\n", stderr);
+            std::abort();
+        }
+
+        // Tag for the constexpr constructors of immortal blocks (see static_ref_block).
+        struct immortal_init
+        {
+        };
+
+        template <typename Count>
+        struct weak_counts
         {
-            // Shared control block: stored object pointer plus strong/weak counters.
+            // Top bit of `weak`: the object keeps an uncounted reference to this block (enable_shared_ref_from_this).
+            // It is cleared when the object dies, so it never keeps the block alive.
+            static constexpr Count self_bit = Count(1) << (std::numeric_limits<Count>::digits - 1);
+            // Top bit of `strong`: the object is never destroyed and strong refs stop counting.
+            static constexpr Count immortal_bit = Count(1) << (std::numeric_limits<Count>::digits - 1);
+
             void *ptr = nullptr;
-            uint32_t strong = 0;
-            uint32_t weak = 0;
-            ref_block() = default;
-            ~ref_block() = default;
+            Count strong = 0;
+            Count weak = 0;
+
+            weak_counts() = default;
+            constexpr weak_counts(immortal_init, void *p) : ptr(p), strong(immortal_bit) {}
+
+            bool empty() const { return ptr == nullptr; }
+            bool expired() const { return ptr == nullptr; }
+            void *object() const { return ptr; }
+
+            bool immortal() const { return (strong & immortal_bit) != 0; }
+            void make_immortal() { strong |= immortal_bit; }
+
+            // `n` > 1 only for weighted_ref, which takes and returns weight in bulk.
+            void add_strong(Count n = 1)
+            {
+                if (immortal())
+                    return;
+                if (strong >= immortal_bit - n) [[unlikely]]
+                    count_overflow();
+                strong += n;
+            }
+            // Bulk weight for weighted_ref: only taken while the counter stays in the lower half of its range, so
+            // plain refs always have the upper half. Immortal blocks do not count and always have room.
+            bool add_strong_if_room(Count n)
+            {
+                if (immortal())
+                    return true;
+                if (strong >= immortal_bit / 2 - n)
+                    return false;
+                strong += n;
+                return true;
+            }
+            // Returns false, without touching the counter, if the object is already gone.
+            bool try_add_strong()
+            {
+                if (strong == 0)
+                    return false;
+                add_strong();
+                return true;
+            }
+            // Returns true when the last strong reference is gone.
+            bool drop_strong(Count n = 1) { return !immortal() && (strong -= n) == 0; }
+
+            void add_weak()
+            {
+                if (weak_count() == self_bit - 1) [[unlikely]]
+                    count_overflow();
+                ++weak;
+            }
+            // Returns true when the last weak reference is gone.
+            bool drop_weak() { return --weak == 0; }
+
+            Count weak_count() const { return weak & ~self_bit; }
+            bool has_self() const { return (weak & self_bit) != 0; }
+            void set_self() { weak |= self_bit; }
+            void clear_self() { weak &= ~self_bit; }
+        };
+
+        template <typename Count>
+        struct strong_counts
+        {
+            static constexpr Count immortal_bit = Count(1) << (std::numeric_limits<Count>::digits - 1);
+
+            Count strong = 0;
+
+            strong_counts() = default;
+            constexpr strong_counts(immortal_init, void *) : strong(immortal_bit) {}
+
+            bool immortal() const { return (strong & immortal_bit) != 0; }
+            void make_immortal() { strong |= immortal_bit; }
+
+            void add_strong(Count n = 1)
+            {
+                if (immortal())
+                    return;
+                if (strong >= immortal_bit - n) [[unlikely]]
+                    count_overflow();
+                strong += n;
+            }
+            // Bulk weight for weighted_ref: only taken while the counter stays in the lower half of its range, so
+            // plain refs always have the upper half. Immortal blocks do not count and always have room.
+            bool add_strong_if_room(Count n)
+            {
+                if (immortal())
+                    return true;
+                if (strong >= immortal_bit / 2 - n)
+                    return false;
+                strong += n;
+                return true;
+            }
+            bool try_add_strong()
+            {
+                if (strong == 0)
+                    return false;
+                add_strong();
+                return true;
+            }
+            bool drop_strong(Count n = 1) { return !immortal() && (strong -= n) == 0; }
+        };
+
+        // weak_counts for atomic_counts blocks. The strong counter doubles as the claim state of the object slot:
+        // 0 is dead (revivable), `busy` is being torn down or revived, values with immortal_bit are immortal, anything
+        // else is alive. Strong owners collectively hold one weak unit, so the block is freed by whichever drop_weak
+        // reaches zero.
+        template <typename Count>
+        struct atomic_weak_counts
+        {
+            static constexpr Count self_bit = Count(1) << (std::numeric_limits<Count>::digits - 1);
+            static constexpr Count immortal_bit = Count(1) << (std::numeric_limits<Count>::digits - 1);
+            static constexpr Count busy = immortal_bit - 1;
+
+            std::atomic<void *> ptr{nullptr};
+            std::atomic<Count> strong{0};
+            std::atomic<Count> weak{0};
+
+            atomic_weak_counts() = default;
+            // The owners' weak unit is never returned, so the block is never freed.
+            constexpr atomic_weak_counts(immortal_init, void *p) : ptr(p), strong(immortal_bit), weak(1) {}
+
+            bool expired() const
+            {
+                auto s = strong.load(std::memory_order_acquire);
+                return s == 0 || s == busy;
+            }
+            // Only meaningful while holding a strong reference: the acquire in try_add_strong/try_claim orders it.
+            void *object() const { return ptr.load(std::memory_order_relaxed); }
+
+            bool immortal() const { return (strong.load(std::memory_order_relaxed) & immortal_bit) != 0; }
+            void make_immortal() { strong.fetch_or(immortal_bit, std::memory_order_relaxed); }
+
+            // Immortal blocks are only read, so refs on many threads share the cache line without bouncing it.
+            void add_strong(Count n = 1)
+            {
+                if (immortal())
+                    return;
+                auto old = strong.fetch_add(n, std::memory_order_relaxed);
+                assert(old != 0);
+                if (!(old & immortal_bit) && old >= busy - n) [[unlikely]]
+                    count_overflow();
+            }
+            // See weak_counts::add_strong_if_room.
+            bool add_strong_if_room(Count n)
+            {
+                auto s = strong.load(std::memory_order_relaxed);
+                do
+                {
+                    if (s & immortal_bit)
+                        return true;
+                    if (s >= immortal_bit / 2 - n)
+                        return false;
+                } while (!strong.compare_exchange_weak(s, s + n, std::memory_order_relaxed));
+                return true;
+            }
+            // Increment-if-alive; never succeeds on a dead block or one that is mid-teardown or mid-revive.
+            bool try_add_strong()
+            {
+                auto s = strong.load(std::memory_order_relaxed);
+                do
+                {
+                    if (s & immortal_bit)
+                        return true;
+                    if (s == 0 || s == busy)
+                        return false;
+                    if (s >= busy - 1) [[unlikely]]
+                        count_overflow();
+                } while (!strong.compare_exchange_weak(s, s + 1, std::memory_order_acquire, std::memory_order_relaxed));
+                return true;
+            }
+            // The last owner moves the block to `busy` instead of 0, so nobody revives it before finish_release.
+            bool drop_strong(Count n = 1)
+            {
+                auto s = strong.load(std::memory_order_relaxed);
+                for (;;)
+                {
+                    if (s & immortal_bit)
+                        return false;
+                    assert(s >= n && s != busy);
+                    if (s == n)
+                    {
+                        if (strong.compare_exchange_weak(s, busy, std::memory_order_acq_rel, std::memory_order_relaxed))
+                            return true;
+                    }
+                    else if (strong.compare_exchange_weak(s, s - n, std::memory_order_release,
+                                                          std::memory_order_relaxed))
+                        return false;
+                }
+            }
+            // Called by the last owner once the object is gone: the block becomes revivable, then the owners' weak
+            // unit is returned. Returns true if that was the last weak unit and the block must be freed.
+            bool finish_release()
+            {
+                ptr.store(nullptr, std::memory_order_relaxed);
+                clear_self();
+                strong.store(0, std::memory_order_release);
+                return drop_weak();
+            }
+
+            // dead -> busy. Exactly one of several racing revivers wins; it must then publish or abandon_claim.
+            bool try_claim()
+            {
+                Count expected = 0;
+                return strong.compare_exchange_strong(expected, busy, std::memory_order_acquire,
+                                                      std::memory_order_relaxed);
+            }
+            void abandon_claim() { strong.store(0, std::memory_order_release); }
+            // busy -> alive with one strong owner; lock() observes `p` fully constructed from here on.
+            void publish(void *p)
+            {
+                weak.fetch_add(1, std::memory_order_relaxed);
+                ptr.store(p, std::memory_order_relaxed);
+                strong.store(1, std::memory_order_release);
+            }
+
+            void add_weak()
+            {
+                auto old = weak.fetch_add(1, std::memory_order_relaxed);
+                if ((old & ~self_bit) == self_bit - 1) [[unlikely]]
+                    count_overflow();
+            }
+            bool drop_weak() { return (weak.fetch_sub(1, std::memory_order_acq_rel) & ~self_bit) == 1; }
+
+            // Includes the strong owners' unit while the object is alive.
+            Count weak_count() const { return weak.load(std::memory_order_relaxed) & ~self_bit; }
+            bool has_self() const { return (weak.load(std::memory_order_relaxed) & self_bit) != 0; }
+            void set_self() { weak.fetch_or(self_bit, std::memory_order_relaxed); }
+            void clear_self() { weak.fetch_and(Count(~self_bit), std::memory_order_relaxed); }
+        };
+
+        template <typename Count>
+        struct atomic_strong_counts
+        {
+            static constexpr Count immortal_bit = Count(1) << (std::numeric_limits<Count>::digits - 1);
+
+            std::atomic<Count> strong{0};
+
+            atomic_strong_counts() = default;
+            constexpr atomic_strong_counts(immortal_init, void *) : strong(immortal_bit) {}
+
+            bool immortal() const { return (strong.load(std::memory_order_relaxed) & immortal_bit) != 0; }
+            void make_immortal() { strong.fetch_or(immortal_bit, std::memory_order_relaxed); }
+
+            void add_strong(Count n = 1)
+            {
+                if (immortal())
+                    return;
+                auto old = strong.fetch_add(n, std::memory_order_relaxed);
+                if (!(old & immortal_bit) && old >= immortal_bit - n) [[unlikely]]
+                    count_overflow();
+            }
+            // See weak_counts::add_strong_if_room.
+            bool add_strong_if_room(Count n)
+            {
+                auto s = strong.load(std::memory_order_relaxed);
+                do
+                {
+                    if (s & immortal_bit)
+                        return true;
+                    if (s >= immortal_bit / 2 - n)
+                        return false;
+                } while (!strong.compare_exchange_weak(s, s + n, std::memory_order_relaxed));
+                return true;
+            }
+            bool try_add_strong()
+            {
+                auto s = strong.load(std::memory_order_relaxed);
+                do
+                {
+                    if (s & immortal_bit)
+                        return true;
+                    if (s == 0)
+                        return false;
+                    if (s >= immortal_bit - 1) [[unlikely]]
+                        count_overflow();
+                } while (!strong.compare_exchange_weak(s, s + 1, std::memory_order_acquire, std::memory_order_relaxed));
+                return true;
+            }
+            // A concurrent make_immortal leaves the bit set, so the old value is never 1 once it has happened.
+            bool drop_strong(Count n = 1) { return !immortal() && strong.fetch_sub(n, std::memory_order_acq_rel) == n; }
+        };
+
+        // Counts for domain_counts blocks. The owner's counter is plain and may wrap below zero once the owner applies
+        // releases of refs that other threads retained; the object is alive while `strong + remote` is non-zero.
+        // Only the owner decrements or tests that sum, so a zero it sees is final: every live ref was counted by a
+        // retain that happened before the release that reached the owner.
+        template <typename Count>
+        struct domain_counts
+        {
+            ref_domain *domain = nullptr;
+            Count strong = 0;
+            std::atomic<Count> remote{0};
+
+            bool immortal() const { return false; }
+
+            // Owner thread only.
+            void add_strong(Count n = 1) { strong += n; }
+            bool drop_strong(Count n = 1)
+            {
+                strong -= n;
+                return Count(strong + remote.load(std::memory_order_acquire)) == 0;
+            }
+
+            // Any other thread that already holds a ref.
+            void add_remote() { remote.fetch_add(1, std::memory_order_relaxed); }
+        };
+
+        // Shard of the calling thread; threads are spread round-robin.
+        inline unsigned thread_shard()
+        {
+            static std::atomic<unsigned> next{0};
+            thread_local unsigned index = next.fetch_add(1, std::memory_order_relaxed);
+            return index;
+        }
+
+        // Strong counter split over N cache lines (count_shards). The block starts unpinned and counts like Base.
+        // pin() parks a pin on the central counter and opens the shards: from then on every retain and release only
+        // touches the calling thread's shard, which may go negative, and no zero check can happen. unpin() folds the
+        // shards back into the central counter and drops the pin. The caller of both holds a ref (see ref_pin), and
+        // `state` keeps a pin from reopening shards that a fold has not read yet.
+        template <typename Base, unsigned N>
+        struct sharded_counts : Base
+        {
+            using count_type = typename decltype(Base::strong)::value_type;
+            // Parked on the central counter while shards are opened or folded one by one, so releases that still see
+            // a closed shard cannot take it to zero while units of the same refs sit in open shards. The pin weighs
+            // as much for the same reason.
+            static constexpr count_type fold_bias = count_type(1) << (std::numeric_limits<count_type>::digits - 3);
+
+            struct alignas(64) shard
+            {
+                std::atomic<intptr_t> word{1}; // (delta << 1) | closed
+            };
+            // Opening and folding the shards exclude each other: each moves through its own transient state.
+            enum pin_state : uint8_t
+            {
+                unpinned,
+                pinning,
+                pinned_state,
+                folding,
+            };
+            std::atomic<pin_state> state{unpinned};
+            shard shards[N];
+
+            using Base::Base;
+
+            bool pinned() const { return state.load(std::memory_order_acquire) == pinned_state; }
+
+            void add_strong(count_type n = 1)
+            {
+                if (!_shard_add(n))
+                    Base::add_strong(n);
+            }
+            bool add_strong_if_room(count_type n) { return _shard_add(n) || Base::add_strong_if_room(n); }
+            bool try_add_strong() { return _shard_add(1) || Base::try_add_strong(); }
+            bool drop_strong(count_type n = 1) { return !_shard_add(-intptr_t(n)) && Base::drop_strong(n); }
+
+            // Returns false, and changes nothing, if the block is already pinned (or being pinned). Waits for a fold
+            // in progress, whose shards must all be closed before they can reopen.
+            bool pin()
+            {
+                auto s = state.load(std::memory_order_acquire);
+                for (;;)
+                {
+                    if (s == pinning || s == pinned_state)
+                        return false;
+                    if (s == folding)
+                    {
+                        std::this_thread::yield();
+                        s = state.load(std::memory_order_acquire);
+                    }
+                    else if (state.compare_exchange_weak(s, pinning, std::memory_order_acquire,
+                                                         std::memory_order_acquire))
+                        break;
+                }
+                // Every shard is closed and its total already folded, so the stale words can be reset.
+                this->strong.fetch_add(fold_bias, std::memory_order_relaxed);
+                for (unsigned i = 0; i < N; ++i)
+                    shards[i].word.store(0, std::memory_order_release);
+                state.store(pinned_state, std::memory_order_release);
+                return true;
+            }
+
+            // Called once per successful pin(), by the pin's owner.
+            void unpin()
+            {
+                auto s = pinned_state;
+                [[maybe_unused]] bool owned =
+                    state.compare_exchange_strong(s, folding, std::memory_order_acquire, std::memory_order_relaxed);
+                assert(owned && "unpin() without a matching pin()");
+                _fold();
+                [[maybe_unused]] bool last = Base::drop_strong(fold_bias);
+                assert(!last && "the unpinning ref keeps the object alive");
+                state.store(unpinned, std::memory_order_release);
+            }
+
+        private:
+            void _fold()
+            {
+                this->strong.fetch_add(fold_bias, std::memory_order_relaxed);
+                intptr_t total = 0;
+                for (unsigned i = 0; i < N; ++i)
+                {
+                    auto word = shards[i].word.fetch_or(1, std::memory_order_acq_rel);
+                    assert((word & 1) == 0);
+                    total += word >> 1;
+                }
+                this->strong.fetch_add(static_cast<count_type>(total - intptr_t(fold_bias)), std::memory_order_acq_rel);
+            }
+
+            bool _shard_add(intptr_t delta)
+            {
+                auto &word = shards[thread_shard() % N].word;
+                auto w = word.load(std::memory_order_relaxed);
+                while ((w & 1) == 0)
+                {
+                    if (word.compare_exchange_weak(w, w + delta * 2, std::memory_order_acq_rel,
+                                                   std::memory_order_relaxed))
+                        return true;
+                }
+                return false;
+            }
+        };
+
+        template <block_layout L>
+        using count_t = std::conditional_t<L.count_bits == 16, uint16_t, uint32_t>;
+
+        template <block_layout L>
+        using holders_t =
+            std::conditional_t<L.holder, std::conditional_t<L.intrusive_holder, linked_holder_base, holder_base>,
+                               empty_base>;
+
+        template <block_layout L>
+        using plain_counts_t = std::conditional_t<
+            L.domain, domain_counts<count_t<L>>,
+            std::conditional_t<L.atomic_counts,
+                               std::conditional_t<L.weak, atomic_weak_counts<count_t<L>>, atomic_strong_counts<count_t<L>>>,
+                               std::conditional_t<L.weak, weak_counts<count_t<L>>, strong_counts<count_t<L>>>>>;
+
+        template <block_layout L>
+        using counts_t = std::conditional_t<L.count_shards == 0, plain_counts_t<L>,
+                                            sharded_counts<plain_counts_t<L>, (L.count_shards ? L.count_shards : 1)>>;
+
+        // Region of a block: set on a region's immortal blocks and on the blocks of refs escaping it (see ref_region),
+        // null for ordinary heap objects.
+        template <bool>
+        struct region_link
+        {
+        };
+        template <>
+        struct region_link<true>
+        {
+            ref_region *region = nullptr;
+        };
+
+        template <block_layout L = block_layout{}>
+        struct ref_block : holders_t<L>, counts_t<L>, region_link<L.region>
+        {
+            // Shared control block: stored object pointer plus strong/weak counters, each part optional.
+            using count_type = count_t<L>;
+            static constexpr bool intrusive_holder = L.holder && L.intrusive_holder;
+            static constexpr bool weak_refs = L.weak;
+            static constexpr bool atomic_counts = L.atomic_counts;
+            static constexpr unsigned count_shards = L.count_shards;
+            static constexpr bool deferred_counts = L.deferred_counts;
+            static constexpr bool region_refs = L.region;
+            static constexpr bool domain_counts = L.domain;
+            static_assert(!L.domain || (!L.weak && !L.atomic_counts && !L.deferred_counts && !L.region),
+                          "domain_counts needs weak_refs = false and no atomic_counts, deferred_counts or region_refs");
+            static_assert(L.count_shards == 0 || L.atomic_counts, "count_shards requires atomic_counts");
+            static_assert(L.count_shards == 0 || !L.region, "region_refs cannot be combined with count_shards");
+            static_assert(!L.deferred_counts || !L.atomic_counts, "deferred_counts cannot be combined with atomic_counts");
+
+            ref_block() = default;
+            constexpr ref_block(immortal_init tag, void *p) : counts_t<L>(tag, p) {}
+            ~ref_block() = default;
+
+            void reset_holder()
+            {
+                if constexpr (L.holder)
+                    this->clear_holders();
+                else
+                    static_assert(false, "T must inherit from enable_ref_holder to use reset_holder");
+            }
+        };
+
+        // Guard the layouts: a change here costs (or saves) one word per managed object.
+        static_assert(sizeof(ref_block<block_layout{.holder = false}>) == sizeof(void *) + 2 * sizeof(uint32_t));
+        static_assert(sizeof(ref_block<block_layout{}>) == 3 * sizeof(void *) + 2 * sizeof(uint32_t));
+        static_assert(sizeof(ref_block<block_layout{.intrusive_holder = true}>) ==
+                      4 * sizeof(void *) + 2 * sizeof(uint32_t));
+        static_assert(sizeof(ref_block<block_layout{.holder = false, .weak = false}>) == sizeof(uint32_t));
+        static_assert(sizeof(ref_block<block_layout{.holder = false, .weak = false, .count_bits = 16}>) ==
+                      sizeof(uint16_t));
+        static_assert(sizeof(ref_block<block_layout{.weak = false}>) == 3 * sizeof(void *));
+        static_assert(sizeof(ref_block<block_layout{.atomic_counts = true}>) == sizeof(ref_block<block_layout{}>));
+
+        // Control block used by shared_ref<T, HolderPolicy> and weak_ref<T, HolderPolicy>. Aliasing casts require
+        // both types to map to the same block.
+        template <typename T, typename HolderPolicy>
+        using block_for = ref_block<block_layout{
+            .holder = !std::is_same_v<HolderPolicy, nullptr_t>,
+            .intrusive_holder = ref_traits<T, HolderPolicy>::intrusive_holder,
+            .weak = ref_traits<T, HolderPolicy>::weak_refs,
+            .count_bits = sizeof(typename ref_traits<T, HolderPolicy>::count_type) * 8,
+            .atomic_counts = ref_traits<T, HolderPolicy>::atomic_counts,
+            .count_shards = ref_traits<T, HolderPolicy>::count_shards,
+            .deferred_counts = ref_traits<T, HolderPolicy>::deferred_counts,
+            .region = ref_traits<T, HolderPolicy>::region_refs,
+            .domain = ref_traits<T, HolderPolicy>::domain_counts,
+        }>;
+
+        // Strong count embedded in objects of lazy_block types. The word holds (count << 1) | 1 until a side block
+        // is needed; from then on it points to the side block, which carries the strong count as well.
+        template <typename Block>
+        struct lazy_header
+        {
+            static_assert(Block::weak_refs, "lazy_block needs weak_refs: the side block exists for weak tracking");
+            static_assert(!Block::atomic_counts, "lazy_block keeps a plain counter word and cannot use atomic_counts");
+            static_assert(!Block::deferred_counts, "lazy_block cannot be combined with deferred_counts");
+            static_assert(!Block::region_refs, "lazy_block cannot be combined with region_refs");
+            static_assert(!Block::domain_counts, "lazy_block cannot be combined with domain_counts");
+            using block_type = Block;
+
+            mutable uintptr_t ref_word = 1;
+
+            lazy_header() = default;
+            lazy_header(const lazy_header &) {} // a copied object starts unowned
+            lazy_header &operator=(const lazy_header &) { return *this; }
+
+            Block *side() const { return (ref_word & 1) ? nullptr : reinterpret_cast<Block *>(ref_word); }
+
+            uintptr_t strong_count() const
+            {
+                if (auto block = side())
+                    return block->strong;
+                return ref_word >> 1;
+            }
+
+            void add_strong() const
+            {
+                if (ref_word & 1)
+                    ref_word += 2;
+                else
+                    side()->add_strong();
+            }
+
+            bool drop_strong() const
+            {
+                if (ref_word & 1)
+                {
+                    ref_word -= 2;
+                    return ref_word == 1;
+                }
+                return side()->drop_strong();
+            }
+
+            // Move the strong count out to a side block, allocating it on first use. `obj` is the managed object.
+            Block *make_side(void *obj) const
+            {
+                if (auto block = side())
+                    return block;
+                auto block = new Block();
+                if ((ref_word >> 1) >= Block::immortal_bit) [[unlikely]]
+                    count_overflow();
+                block->strong = static_cast<typename Block::count_type>(ref_word >> 1);
+                block->ptr = obj;
+                ref_word = reinterpret_cast<uintptr_t>(block);
+                return block;
+            }
+
+            // Bind a fresh object to an existing side block, as revive does.
+            void attach_side(Block *block) const
+            {
+                assert(ref_word == 1);
+                ref_word = reinterpret_cast<uintptr_t>(block);
+            }
+        };
+
+        // Thread-local log of pending strong count changes for deferred_counts blocks, coalesced per block. Each entry
+        // keeps the pointer and finisher of the first ref that logged it, so a zero count is released exactly as
+        // that ref's own release would have done.
+        struct deferred_log
+        {
+            using apply_fn = void (*)(void *block, intptr_t delta, void *ptr);
+            struct entry
+            {
+                void *block;
+                intptr_t delta;
+                void *ptr;
+                apply_fn apply;
+            };
+            static constexpr size_t capacity = 256;
+
+            entry entries[capacity] = {};
+            size_t size = 0;
+
+            static deferred_log &local()
+            {
+                thread_local deferred_log log;
+                return log;
+            }
+
+            deferred_log() = default;
+            deferred_log(const deferred_log &) = delete;
+            deferred_log &operator=(const deferred_log &) = delete;
+            ~deferred_log() { flush(); }
+
+            void add(void *block, intptr_t delta, void *ptr, apply_fn apply)
+            {
+                auto i = (reinterpret_cast<uintptr_t>(block) >> 4) & (capacity - 1);
+                while (entries[i].block != nullptr && entries[i].block != block)
+                    i = (i + 1) & (capacity - 1);
+                if (entries[i].block == nullptr)
+                {
+                    entries[i] = {block, 0, ptr, apply};
+                    size++;
+                }
+                entries[i].delta += delta;
+                if (size * 4 >= capacity * 3)
+                    flush();
+            }
+
+            // Apply every pending change. Destructors run from here may log again, so repeat until nothing is left.
+            void flush()
+            {
+                entry batch[capacity];
+                while (size != 0)
+                {
+                    size_t n = 0;
+                    for (auto &e : entries)
+                    {
+                        if (e.block != nullptr)
+                        {
+                            batch[n++] = e;
+                            e = {};
+                        }
+                    }
+                    size = 0;
+                    for (size_t i = 0; i < n; ++i)
+                        batch[i].apply(batch[i].block, batch[i].delta, batch[i].ptr);
+                }
+            }
+        };
+
+        // Header in front of every object of a relocatable_heap: the slab that owns the slot (null while the slot is
+        // free) and the object's block, so compaction can repoint the block after moving the object.
+        struct relocation_header
+        {
+            void *slab;
+            void *block;
+            void (*free)(void *slab, relocation_header *slot);
+        };
+
+        template <typename T>
+        struct relocation_slot
+        {
+            relocation_header header;
+            alignas(T) std::byte storage[sizeof(T)];
+
+            T *object() { return reinterpret_cast<T *>(storage); }
+            static relocation_slot *of(T *p)
+            {
+                return reinterpret_cast<relocation_slot *>(reinterpret_cast<std::byte *>(p) -
+                                                           offsetof(relocation_slot, storage));
+            }
+        };
+
+        // Drop one external ref of a region (defined with ref_region below).
+        inline void region_release(ref_region *region);
+
+        // Reclaimer pool of a parallel_teardown_scope. Each worker owns a deque of dead objects: it pushes and pops at
+        // the back (depth first, so the deques stay short) and idle workers steal from the front of the others.
+        // `pending` counts pushed tasks that have not finished; a running task keeps it above zero until the tasks
+        // it pushes are counted, so the pool is drained exactly when it reaches zero.
+        struct teardown_pool
+        {
+            using task_fn = void (*)(void *block, void *ptr);
+            struct task
+            {
+                void *block;
+                void *ptr;
+                task_fn run;
+            };
+            struct alignas(64) worker
+            {
+                std::mutex lock;
+                std::deque<task> tasks;
+            };
+
+            std::vector<std::unique_ptr<worker>> workers;
+            std::atomic<size_t> pending{0};
+            // Serializes what reclaimers may not do concurrently: holder notifications (holders are not synchronized
+            // themselves) and count changes of non-atomic blocks. Recursive, since an unhold_ref hook or a destructor
+            // run under it may release further refs on the same thread.
+            std::recursive_mutex serial_lock;
+
+            explicit teardown_pool(unsigned threads)
+            {
+                for (unsigned i = 0; i < (threads ? threads : 1); ++i)
+                    workers.push_back(std::make_unique<worker>());
+            }
+
+            // Pool and worker index of the calling thread, if it is inside a scope or a reclaimer.
+            static teardown_pool *&current()
+            {
+                thread_local teardown_pool *pool = nullptr;
+                return pool;
+            }
+            static unsigned &current_worker()
+            {
+                thread_local unsigned index = 0;
+                return index;
+            }
+
+            void push(task t)
+            {
+                pending.fetch_add(1, std::memory_order_relaxed);
+                auto &w = *workers[current_worker()];
+                std::lock_guard guard(w.lock);
+                w.tasks.push_back(t);
+            }
+
+            bool pop(unsigned self, task &t)
+            {
+                for (unsigned k = 0; k < workers.size(); ++k)
+                {
+                    auto &w = *workers[(self + k) % workers.size()];
+                    std::lock_guard guard(w.lock);
+                    if (w.tasks.empty())
+                        continue;
+                    if (k == 0)
+                    {
+                        t = w.tasks.back();
+                        w.tasks.pop_back();
+                    }
+                    else
+                    {
+                        t = w.tasks.front();
+                        w.tasks.pop_front();
+                    }
+                    return true;
+                }
+                return false;
+            }
+
+            void work(unsigned self)
+            {
+                auto saved_pool = current();
+                auto saved_worker = current_worker();
+                current() = this;
+                current_worker() = self;
+                task t;
+                while (pending.load(std::memory_order_acquire) != 0)
+                {
+                    if (pop(self, t))
+                    {
+                        t.run(t.block, t.ptr);
+                        pending.fetch_sub(1, std::memory_order_acq_rel);
+                    }
+                    else
+                        std::this_thread::yield();
+                }
+                current() = saved_pool;
+                current_worker() = saved_worker;
+            }
+
+            // Run the task queued for `block` here and now, if there is one. For threads that would otherwise wait on a
+            // teardown that only runs when their own scope ends (a revive of the dead object).
+            bool run_queued(void *block)
+            {
+                for (auto &w : workers)
+                {
+                    task t;
+                    {
+                        std::lock_guard guard(w->lock);
+                        auto it = std::find_if(w->tasks.begin(), w->tasks.end(),
+                                               [block](const task &q) { return q.block == block; });
+                        if (it == w->tasks.end())
+                            continue;
+                        t = *it;
+                        w->tasks.erase(it);
+                    }
+                    t.run(t.block, t.ptr);
+                    pending.fetch_sub(1, std::memory_order_acq_rel);
+                    return true;
+                }
+                return false;
+            }
+
+            // Run every queued task and everything it releases, on the calling thread plus `workers.size() - 1`
+            // helpers.
+            void drain()
+            {
+                if (pending.load(std::memory_order_acquire) == 0)
+                    return;
+                draining.fetch_add(1, std::memory_order_relaxed);
+                std::vector<std::thread> helpers;
+                for (unsigned i = 1; i < workers.size(); ++i)
+                    helpers.emplace_back([this, i] { work(i); });
+                work(0);
+                for (auto &h : helpers)
+                    h.join();
+                draining.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+            // Pools whose reclaimers are running, process-wide; see reclaimers_running().
+            inline static std::atomic<unsigned> draining{0};
+        };
+
+        // Whether any pool's reclaimers are running. Count changes of non-atomic blocks test this first and only then
+        // take a reclaimer_guard, out of line, so the common path costs one relaxed load.
+        inline bool reclaimers_running() { return teardown_pool::draining.load(std::memory_order_relaxed) != 0; }
+
+        // Holds the pool's serial lock while on a reclaimer thread: reclaimers run destructors, and so release blocks
+        // of any kind, concurrently.
+        struct reclaimer_guard
+        {
+            teardown_pool *pool = reclaimers_running() ? teardown_pool::current() : nullptr;
+
+            reclaimer_guard()
+            {
+                if (pool)
+                    pool->serial_lock.lock();
+            }
+            reclaimer_guard(const reclaimer_guard &) = delete;
+            ~reclaimer_guard()
+            {
+                if (pool)
+                    pool->serial_lock.unlock();
+            }
+        };
+
+        // NUMA placement through raw Linux syscalls (no libnuma). Everywhere else, and on kernels or sandboxes that
+        // refuse the calls, there is a single node 0 and placement requests are no-ops.
+        inline constexpr int max_numa_nodes = 64;
+
+        // Node of the CPU the calling thread runs on.
+        inline int numa_current_node()
+        {
+#if defined(__linux__) && defined(SYS_getcpu)
+            unsigned cpu = 0, node = 0;
+            if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0 && node < unsigned(max_numa_nodes))
+                return int(node);
+#endif
+            return 0;
+        }
+
+        // Prefer `node` for the not yet touched pages of [p, p + bytes); p must be page aligned.
+        inline bool numa_prefer(void *p, size_t bytes, int node)
+        {
+#if defined(__linux__) && defined(SYS_mbind)
+            unsigned long mask = 1ul << node;
+            // MPOL_PREFERRED; the kernel reads one bit less than maxnode.
+            return syscall(SYS_mbind, p, bytes, 1, &mask, sizeof(mask) * 8 + 1, 0) == 0;
+#else
+            return node == 0;
+#endif
+        }
+
+#if defined(__linux__)
+        inline void *numa_page(const void *p)
+        {
+            auto mask = ~uintptr_t(sysconf(_SC_PAGESIZE) - 1);
+            return reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(p) & mask);
+        }
+#endif
+
+        // Node of the page holding `p`, or -1 if unknown.
+        inline int numa_node_of(const void *p)
+        {
+#if defined(__linux__) && defined(SYS_move_pages)
+            void *page = numa_page(p);
+            int status = -1;
+            if (syscall(SYS_move_pages, 0, 1ul, &page, nullptr, &status, 0) == 0 && status >= 0)
+                return status;
+            return -1;
+#else
+            (void)p;
+            return 0;
+#endif
+        }
+
+        // Migrate the page holding `p` to `node`.
+        inline bool numa_move(const void *p, int node)
+        {
+#if defined(__linux__) && defined(SYS_move_pages)
+            void *page = numa_page(p);
+            int status = -1;
+            // MPOL_MF_MOVE: only pages mapped by this process alone.
+            return syscall(SYS_move_pages, 0, 1ul, &page, &node, &status, 2) == 0 && status == node;
+#else
+            (void)p;
+            return node == 0;
+#endif
+        }
+    } // namespace _
+
+    // Safepoint for deferred_counts types: apply the calling thread's pending count changes, destroying objects whose
+    // count reached zero.
+    inline void flush_deferred() { _::deferred_log::local().flush(); }
+
+    // Scope for tearing down large graphs of parallel_teardown types: last releases on this thread only queue the
+    // object, and the destructor destroys everything queued on `threads` threads (this one included), cascading
+    // through the objects their destructors release. Until then queued objects count as expired.
+    //     {
+    //         parallel_teardown_scope scope;
+    //         network = nullptr;
+    //     }
+    struct parallel_teardown_scope
+    {
+        explicit parallel_teardown_scope(unsigned threads = std::thread::hardware_concurrency())
+            : pool(threads), saved_pool(_::teardown_pool::current()), saved_worker(_::teardown_pool::current_worker())
+        {
+            _::teardown_pool::current() = &pool;
+            _::teardown_pool::current_worker() = 0;
+        }
+        parallel_teardown_scope(const parallel_teardown_scope &) = delete;
+        parallel_teardown_scope &operator=(const parallel_teardown_scope &) = delete;
+
+        ~parallel_teardown_scope()
+        {
+            pool.drain();
+            _::teardown_pool::current() = saved_pool;
+            _::teardown_pool::current_worker() = saved_worker;
+        }
+
+    private:
+        _::teardown_pool pool;
+        _::teardown_pool *saved_pool;
+        unsigned saved_worker;
+    };
+
+    // Owner of domain_counts blocks (see ref_traits), typically one per graph partition. A thread adopts a domain
+    // with ref_domain::scope; blocks created while it is current record it, and only that thread may drain() it.
+    // Releases on other threads are buffered per thread and handed over in batches (when a batch fills, on
+    // flush_outbox() and at thread exit); until the owner drains them, their objects stay alive. The domain must
+    // outlive every ref to its objects and every batch sent to it.
+    struct ref_domain
+    {
+        ref_domain() = default;
+        ref_domain(const ref_domain &) = delete;
+        ref_domain &operator=(const ref_domain &) = delete;
+        ~ref_domain() { drain(); }
+
+        // Makes `domain` the calling thread's domain until the scope ends.
+        struct scope
+        {
+            explicit scope(ref_domain &domain) : saved(current()) { current() = &domain; }
+            scope(const scope &) = delete;
+            scope &operator=(const scope &) = delete;
+            ~scope() { current() = saved; }
+
+        private:
+            ref_domain *saved;
+        };
+
+        static ref_domain *&current()
+        {
+            thread_local ref_domain *domain = nullptr;
+            return domain;
+        }
+
+        // Apply the releases sent by other threads, destroying objects whose count reached zero. Owner thread only;
+        // returns the number of releases applied.
+        size_t drain()
+        {
+            size_t applied = 0;
+            auto list = inbox.exchange(nullptr, std::memory_order_acquire);
+            while (list != nullptr)
+            {
+                auto b = list;
+                list = list->next;
+                for (size_t i = 0; i < b->size; ++i)
+                    b->messages[i].apply(b->messages[i].block, -1, b->messages[i].ptr);
+                applied += b->size;
+                delete b;
+            }
+            return applied;
+        }
+
+        // Hand the calling thread's buffered releases to their domains.
+        static void flush_outbox() { outbox::local().flush(); }
+
+    private:
+        template <typename T, typename HolderPolicy>
+        friend struct shared_ref;
+
+        using apply_fn = void (*)(void *block, intptr_t delta, void *ptr);
+        struct message
+        {
+            void *block;
+            void *ptr;
+            apply_fn apply;
+        };
+        static constexpr size_t batch_capacity = 128;
+        struct batch
+        {
+            batch *next = nullptr;
+            size_t size = 0;
+            message messages[batch_capacity];
+        };
+
+        // Per-thread batches under construction, one per destination domain.
+        struct outbox
+        {
+            std::vector<std::pair<ref_domain *, batch *>> open;
+
+            static outbox &local()
+            {
+                thread_local outbox box;
+                return box;
+            }
+
+            ~outbox() { flush(); }
+
+            void add(ref_domain *domain, message m)
+            {
+                auto it = std::find_if(open.begin(), open.end(), [domain](auto &e) { return e.first == domain; });
+                if (it == open.end())
+                    it = open.insert(open.end(), {domain, new batch()});
+                auto b = it->second;
+                b->messages[b->size++] = m;
+                if (b->size == batch_capacity)
+                {
+                    open.erase(it);
+                    domain->_push(b);
+                }
+            }
+
+            void flush()
+            {
+                for (auto [domain, b] : open)
+                    domain->_push(b);
+                open.clear();
+            }
+        };
+
+        std::atomic<batch *> inbox{nullptr};
+
+        void _post(void *block, void *ptr, apply_fn apply) { outbox::local().add(this, {block, ptr, apply}); }
+
+        void _push(batch *b)
+        {
+            b->next = inbox.load(std::memory_order_relaxed);
+            while (!inbox.compare_exchange_weak(b->next, b, std::memory_order_release, std::memory_order_relaxed))
+            {
+            }
+        }
+    };
+
+    // Base for lazy_block types (see ref_traits): one counter word in the object instead of a separate block.
+    // shared_ref(T *) on an object that is already owned adds a reference instead of creating a second owner.
+    template <typename T, typename HolderPolicy = nullptr_t>
+    using enable_lazy_ref_block = _::lazy_header<_::block_for<T, HolderPolicy>>;
+
+    template <typename T, typename HolderPolicy>
+    struct shared_ref
+    {
+    public:
+        using element_type = T;
+        // Block shared with weak_ref; in lazy_block mode the side block, which may not exist yet.
+        using block_type = _::block_for<T, HolderPolicy>;
+        static constexpr bool lazy_block = ref_traits<T, HolderPolicy>::lazy_block;
+        // What `handler` points to: the block itself, or the object's inline header in lazy_block mode.
+        using handler_type = std::conditional_t<lazy_block, _::lazy_header<block_type>, block_type>;
+        using holder_type = HolderPolicy;
+        static constexpr bool parallel_teardown = ref_traits<T, HolderPolicy>::parallel_teardown;
+        static_assert(!parallel_teardown || block_type::atomic_counts, "parallel_teardown requires atomic_counts");
+        static constexpr bool relocatable = ref_traits<T, HolderPolicy>::relocatable;
+        static_assert(!relocatable || (block_type::weak_refs && !lazy_block && !block_type::region_refs),
+                      "relocatable needs weak_refs and cannot be combined with lazy_block or region_refs");
+        static constexpr bool slab_storage = ref_traits<T, HolderPolicy>::slab_storage;
+        static_assert(!slab_storage || (!lazy_block && !block_type::region_refs && !relocatable),
+                      "slab_storage cannot be combined with lazy_block, region_refs or relocatable");
+
+        T *ptr;                // Raw pointer to managed object and pointer to the shared control block.
+        handler_type *handler; // Shared control block.
+
+        shared_ref() : handler(nullptr), ptr(nullptr) {}
+        shared_ref(nullptr_t) : handler(nullptr), ptr(nullptr) {}
+        shared_ref(const shared_ref &other) : shared_ref() { this->_copy_shared(other); }
+        shared_ref(shared_ref &&other) noexcept : ptr(other.ptr), handler(other.handler)
+        {
+            other.ptr = nullptr;
+            other.handler = nullptr;
+        }
+        shared_ref(T *p)
+        {
+            if (p == nullptr)
+            {
+                handler = nullptr;
+                ptr = nullptr;
+                return;
+            }
+            ptr = p;
+            if constexpr (lazy_block)
+            {
+                static_assert(std::is_base_of_v<handler_type, T>, "lazy_block requires T to derive from "
+                                                                  "enable_lazy_ref_block<T, HolderPolicy>");
+                handler = static_cast<handler_type *>(p);
+                handler->add_strong();
+            }
+            else
+            {
+                static_assert(!relocatable, "relocatable objects are created by relocatable_heap::make");
+                static_assert(!slab_storage, "slab_storage objects are created by slab_store::make");
+                handler = new handler_type();
+                _init_block(handler, p);
+            }
+        }
+
+        // Ref to an object in static storage through its immortal static_ref_block; usable with constinit.
+        constexpr shared_ref(T *p, static_ref_block<T, HolderPolicy> &block)
+            requires(!lazy_block)
+            : ptr(p), handler(&block)
+        {
+        }
+
+        ~shared_ref() { this->_destroy_ref(); }
+
+    public:
+        template <typename U>
+            requires(((std::is_base_of_v<enable_ref_holder, T> && std::is_base_of_v<enable_ref_holder, U>) ||
+                      (!std::is_base_of_v<enable_ref_holder, T> && !std::is_base_of_v<enable_ref_holder, U>)) &&
+                     std::is_same_v<typename shared_ref<U, HolderPolicy>::handler_type, handler_type>)
+        // Aliasing constructor used by pointer-cast helpers; keeps same control block.
+        shared_ref(const shared_ref<U, HolderPolicy> &other, T *p) noexcept
+            : ptr(p), handler(other.handler) /* only called by std::static_pointer_cast, std::dynamic_pointer_cast,
+                                              * std::reinterpret_pointer_cast, std::const_pointer_cast */
+        {
+            /* Note: this method should be set public, so that pybind11 can use it to cast derived types. */
+            // assume ptr==nullptr && handler==nullptr, or handler!=nullptr && ptr==handler->ptr
+            if (handler && ptr)
+                _retain(handler, ptr);
+        }
+
+    private:
+        // Set up a fresh block owning the new object `p` with one strong reference.
+        static void _init_block(block_type *h, T *p)
+        {
+            h->strong = 1;
+            if constexpr (block_type::weak_refs)
+                h->ptr = p;
+            if constexpr (block_type::atomic_counts && block_type::weak_refs)
+                h->weak = 1; // the strong owners' weak unit
+            if constexpr (block_type::domain_counts)
+                h->domain = ref_domain::current();
+
+            // Populate weak_from_this only if the type opted in.
+            if constexpr (std::is_base_of_v<enable_shared_ref_from_this<T, HolderPolicy>, T>)
+                _bind_self(p, h);
+        }
+
+        // Construct from control block when promoted from weak_ref::lock.
+        shared_ref(block_type *h) /* only called by weak_ref::lock() */
+        {
+            if (h && h->try_add_strong())
+                _attach_counted(h);
+            else
+            {
+                this->ptr = nullptr;
+                this->handler = nullptr;
+            }
+        }
+
+        shared_ref(T *p, block_type *h) : ptr(p) /* only called by shared_ref::revive */
+        {
+            static_assert(!relocatable, "relocatable objects cannot be revived from a raw pointer");
+            if constexpr (block_type::atomic_counts)
+            {
+                // h was claimed by the caller; publish() is what lets lock() in, so bind the object first.
+                this->handler = h;
+                if constexpr (std::is_base_of_v<enable_shared_ref_from_this<T, HolderPolicy>, T>)
+                    _bind_self(p, h);
+                h->publish(p);
+                return;
+            }
+            // assume h != nullptr && h->stong == 0 && h->ptr == nullptr
+            h->strong = 1;
+            h->ptr = p;
+            if constexpr (lazy_block)
+            {
+                this->handler = static_cast<handler_type *>(p);
+                this->handler->attach_side(h);
+            }
+            else
+            {
+                this->handler = h;
+                // A revived object must be able to find its block just like a freshly owned one.
+                if constexpr (std::is_base_of_v<enable_shared_ref_from_this<T, HolderPolicy>, T>)
+                    _bind_self(p, h);
+            }
+        }
+
+    public:
+        shared_ref &operator=(const shared_ref &other)
+        {
+            this->_copy_shared(other);
+            return *this;
+        }
+
+        shared_ref &operator=(shared_ref &&other) noexcept
+        {
+            if (this != &other)
+            {
+                auto old_handler = this->handler;
+                auto old_ptr = this->ptr;
+                this->ptr = other.ptr;
+                this->handler = other.handler;
+                other.ptr = nullptr;
+                other.handler = nullptr;
+                _release_handler(old_handler, old_ptr);
+            }
+            return *this;
+        }
+
+        shared_ref &operator=(nullptr_t)
+        {
+            this->reset();
+            return *this;
+        }
+
+    private:
+        static void _retain(handler_type *handler, T *ptr)
+        {
+            if constexpr (block_type::deferred_counts)
+            {
+                if (!handler->immortal())
+                    _::deferred_log::local().add(handler, 1, ptr, &_apply_deferred);
+            }
+            else if constexpr (block_type::domain_counts)
+            {
+                if (_is_remote(handler))
+                    handler->add_remote();
+                else
+                    handler->add_strong();
+            }
+            else
+            {
+                if constexpr (!block_type::atomic_counts)
+                    if (_::reclaimers_running()) [[unlikely]]
+                        return _retain_serialized(handler);
+                handler->add_strong();
+            }
+        }
+
+        // Drop one strong reference; with deferred_counts only logged, and applied by _apply_deferred at flush time.
+        static void _release_handler(handler_type *&handler, T *ptr)
+        {
+            if constexpr (block_type::deferred_counts)
+            {
+                if (handler && !handler->immortal())
+                    _::deferred_log::local().add(handler, -1, ptr, &_apply_deferred);
+                handler = nullptr;
+            }
+            else if constexpr (block_type::domain_counts)
+            {
+                // Only the owner may test for zero; other threads send the release to it.
+                if (handler && _is_remote(handler))
+                {
+                    handler->domain->_post(handler, ptr, &_apply_deferred);
+                    handler = nullptr;
+                }
+                else
+                    _release_now(handler, ptr);
+            }
+            else
+            {
+                if constexpr (!block_type::atomic_counts)
+                    if (handler && _::reclaimers_running()) [[unlikely]]
+                        return _release_serialized(handler, ptr);
+                _release_now(handler, ptr);
+            }
+        }
+
+        // _retain and _release_handler of a non-atomic block while reclaimers run; see _::reclaimer_guard.
+        [[gnu::noinline]] static void _retain_serialized(handler_type *handler)
+        {
+            _::reclaimer_guard guard;
+            handler->add_strong();
+        }
+        [[gnu::noinline]] static void _release_serialized(handler_type *&handler, T *ptr)
+        {
+            _::reclaimer_guard guard;
+            _release_now(handler, ptr);
+        }
+
+        // Whether a domain_counts block belongs to a domain other than the calling thread's. Blocks created outside
+        // any domain count like plain blocks.
+        static bool _is_remote(handler_type *handler)
+        {
+            return handler->domain != nullptr && handler->domain != ref_domain::current();
+        }
+
+        static void _apply_deferred(void *block, intptr_t delta, void *ptr)
+        {
+            auto handler = static_cast<handler_type *>(block);
+            if (delta > 0)
+            {
+                // Domain counters may wrap by design (see _::domain_counts).
+                if constexpr (!block_type::domain_counts)
+                    if (intptr_t(handler->strong) + delta >= intptr_t(block_type::immortal_bit)) [[unlikely]]
+                        _::count_overflow();
+                handler->strong += static_cast<typename block_type::count_type>(delta);
+            }
+            else if (delta < 0)
+            {
+                // Net decrements: all but the last are plain, the last one may destroy the object.
+                handler->strong -= static_cast<typename block_type::count_type>(-delta - 1);
+                _release_now(handler, static_cast<T *>(ptr));
+            }
+        }
+
+        // `ptr` is the releasing ref's own pointer: deleting through it stays correct after an aliasing cast to a
+        // base at a non-zero offset, and strong-only blocks do not store the object pointer at all.
+        static void _release_now(handler_type *&handler, T *ptr)
+        {
+            if (handler && handler->drop_strong())
+                _release_last(handler, ptr);
+        }
+
+        // Tear down after the last strong reference was dropped from `handler`; inside a parallel_teardown_scope,
+        // queue that for the reclaimers instead.
+        static void _release_last(handler_type *&handler, T *ptr)
+        {
+            if constexpr (parallel_teardown)
+            {
+                if (auto pool = _::teardown_pool::current())
+                {
+                    pool->push({handler, ptr, &_teardown_task});
+                    handler = nullptr;
+                    return;
+                }
+            }
+            _teardown(handler, ptr);
+        }
+
+        static void _teardown_task(void *block, void *ptr)
+        {
+            auto handler = static_cast<handler_type *>(block);
+            _teardown(handler, static_cast<T *>(ptr));
+        }
+
+        static void _teardown(handler_type *&handler, T *ptr)
+        {
+            if constexpr (block_type::region_refs)
+            {
+                if (auto region = handler->region)
+                {
+                    _release_escaped(handler);
+                    _::region_release(region);
+                    return;
+                }
+            }
+            if constexpr (relocatable)
+                ptr = static_cast<T *>(handler->object()); // the cached pointer may predate a compaction
+            // Object is about to be destroyed; keep control block if weak refs remain.
+            if constexpr (block_type::atomic_counts && block_type::weak_refs)
+            {
+                // The block stays busy until the object is gone, so a racing revive waits for teardown.
+                auto block = handler;
+                handler = nullptr;
+                _delete_object(ptr);
+                if (block->finish_release())
+                {
+                    _unhold_all(block);
+                    _delete_block(block);
+                }
+            }
+            else if constexpr (lazy_block)
+            {
+                // The header dies with the object; only a side block, if any, may outlive it.
+                auto block = handler->side();
+                handler = nullptr;
+                if (block == nullptr)
+                    _delete_object(ptr);
+                else if (block->weak_count() == 0)
+                {
+                    _unhold_all(block);
+                    _delete_object(ptr);
+                    _delete_block(block);
+                }
+                else
+                {
+                    block->ptr = nullptr;
+                    _delete_object(ptr);
+                }
+            }
+            else if constexpr (!handler_type::weak_refs)
+            {
+                _unhold_all(handler);
+                _delete_object(ptr);
+                _delete_block(handler);
+                handler = nullptr;
+            }
+            else
+            {
+                /* Note: handler->ptr is set to nullptr before deleting the managed object, so weak_refs that
+                 * check expiration (possibly from the object's destructor) never see a dangling pointer.
+                 * The self flag is dropped as well: the object no longer refers to the block.
+                 */
+                handler->ptr = nullptr;
+                handler->clear_self();
+                // The destructor may take weak refs of its own or drop the last ones (a child's back pointer), so a
+                // weak unit held across it decides who frees the block.
+                handler->add_weak();
+                _delete_object(ptr);
+                if (handler->drop_weak())
+                {
+                    _unhold_all(handler);
+                    _delete_block(handler);
+                }
+                handler = nullptr;
+            }
+        }
+
+        // Relocatable objects go back to their heap slot.
+        static void _delete_object(T *ptr)
+        {
+            if constexpr (relocatable)
+            {
+                auto slot = _::relocation_slot<T>::of(ptr);
+                ptr->~T();
+                slot->header.free(slot->header.slab, &slot->header);
+            }
+            else if constexpr (slab_storage)
+                ptr->~T(); // the slot goes back with the block
+            else
+                delete ptr;
+        }
+
+        static void _delete_block(block_type *block)
+        {
+            if constexpr (slab_storage)
+                slab_store<T, HolderPolicy>::_release_slot(block);
+            else
+                delete block;
+        }
+
+        // Last escaped ref of a region object is gone: the object stays with its region, and the block lives on like
+        // the block of a dead object while weak refs remain (a revive then makes it an ordinary heap block).
+        static void _release_escaped(handler_type *&handler)
+        {
+            auto block = handler;
+            handler = nullptr;
+            block->region = nullptr;
+            if constexpr (block_type::atomic_counts && block_type::weak_refs)
+            {
+                if (!block->finish_release())
+                    return;
+            }
+            else if constexpr (block_type::weak_refs)
+            {
+                if (block->weak_count() != 0)
+                {
+                    block->ptr = nullptr;
+                    return;
+                }
+            }
+            _unhold_all(block);
+            _delete_block(block);
+        }
+
+        // Notify every registered holder that the control block is going away. Intrusive holders are unlinked
+        // first, and their unhold_ref hook is optional.
+        static void _unhold_all(block_type *handler)
+        {
+            if constexpr (!std::is_same_v<HolderPolicy, nullptr_t>)
+            {
+                auto unhold = [handler](void *holder)
+                {
+                    if constexpr (!block_type::intrusive_holder ||
+                                  requires { HolderPolicy::unhold_ref(holder, static_cast<void *>(handler)); })
+                        HolderPolicy::unhold_ref(holder, static_cast<void *>(handler));
+                };
+                // Reclaimer threads may tear down objects of any type, not only parallel_teardown ones.
+                _::reclaimer_guard guard;
+                handler->release_holders(unhold);
+            }
+        }
+
+        void _destroy_ref() { _release_handler(this->handler, this->ptr); }
+
+        // Point at `h`, whose strong count was already bumped for this ref.
+        void _attach_counted(block_type *h)
+        {
+            this->ptr = static_cast<T *>(h->object());
+            if constexpr (lazy_block)
+                this->handler = static_cast<handler_type *>(this->ptr);
+            else
+                this->handler = h;
+        }
+
+        // Whether this ref currently owns the object of block `h`.
+        bool _owns_block(block_type *h) const
+        {
+            if constexpr (lazy_block)
+                return handler && handler->side() == h;
+            else
+                return handler && handler == h;
+        }
+
+        // Give an enable_shared_ref_from_this object its uncounted self reference.
+        static void _bind_self(T *p, block_type *h)
+        {
+            static_assert(block_type::weak_refs, "enable_shared_ref_from_this needs a block with weak_refs");
+            p->enable_shared_ref_from_this<T, HolderPolicy>::_self_block = h;
+            h->set_self();
+        }
+
+        // The block weak refs and holders attach to; allocates the side block in lazy_block mode.
+        block_type *_block() const
+        {
+            if constexpr (lazy_block)
+                return handler ? handler->make_side(ptr) : nullptr;
+            else
+                return handler;
+        }
+
+        void _copy_shared(const shared_ref<T, HolderPolicy> &other)
+        {
+            if (this->handler == other.handler)
+                return;
+            auto old_handler = this->handler;
+            auto old_ptr = this->ptr;
+
+            // Point at the same control block and bump strong count before releasing previous one.
+            this->handler = other.handler;
+            this->ptr = other.ptr;
+            if (this->handler)
+                _retain(this->handler, this->ptr);
+
+            _release_handler(old_handler, old_ptr);
+        }
+
+    public:
+        static shared_ref revive(T *p, block_type *other)
+        {
+            /* Make sure
+             * 1. p != nullptr
+             * 2. other != nullptr
+             * 3. other->ptr == nullptr
+             */
+            static_assert(!slab_storage, "slab_storage objects are revived by slab_store::revive");
+            if (p == nullptr || other == nullptr)
+                throw std::runtime_error("Cannot revive due to invalid parameters");
+            if constexpr (block_type::atomic_counts)
+            {
+                // Losing the race is not an error: the caller gets the winner's object and `p` is discarded.
+                auto r = _revive_with(other, [p] { return p; });
+                if (r.ptr != p)
+                    delete p;
+                return r;
+            }
+            else
+            {
+                if (other->ptr != nullptr || other->strong > 0)
+                    throw std::runtime_error("Cannot revive due to invalid parameters");
+                return shared_ref{p, other};
+            }
+        }
+
+        static shared_ref revive(T *p, const weak_ref<T, HolderPolicy> &other) { return revive(p, other.handler); }
+
+        // Return the block's live object, or revive the block with `make()` if the object is dead. In atomic_counts
+        // mode racing callers agree on one object and only the winner calls `make`.
+        template <typename F>
+        static shared_ref revive_with(block_type *other, F &&make)
+        {
+            static_assert(!slab_storage, "slab_storage objects are revived by slab_store::revive");
+            return _revive_with(other, std::forward<F>(make));
+        }
+
+        template <typename F>
+        static shared_ref revive_with(const weak_ref<T, HolderPolicy> &other, F &&make)
+        {
+            return revive_with(other.handler, std::forward<F>(make));
+        }
+
+    private:
+        template <typename F>
+        static shared_ref _revive_with(block_type *other, F &&make)
+        {
+            if (other == nullptr)
+                throw std::runtime_error("Cannot revive due to invalid parameters");
+            if constexpr (!block_type::atomic_counts)
+            {
+                if (auto r = shared_ref(other))
+                    return r;
+                if (other->ptr != nullptr || other->strong > 0)
+                    throw std::runtime_error("Cannot revive due to invalid parameters");
+                auto p = make();
+                if (p == nullptr)
+                    throw std::runtime_error("Cannot revive due to invalid parameters");
+                return shared_ref{p, other};
+            }
+            else
+            {
+                for (;;)
+                {
+                    if (auto r = shared_ref(other))
+                        return r;
+                    if (other->try_claim())
+                    {
+                        T *p = nullptr;
+                        try
+                        {
+                            p = make();
+                        }
+                        catch (...)
+                        {
+                            other->abandon_claim();
+                            throw;
+                        }
+                        if (p == nullptr)
+                        {
+                            other->abandon_claim();
+                            throw std::runtime_error("Cannot revive due to invalid parameters");
+                        }
+                        return shared_ref{p, other};
+                    }
+                    // Another thread is tearing the old object down or publishing a new one, or the teardown is
+                    // queued in this thread's parallel_teardown_scope and would only run when the scope ends.
+                    auto pool = _::teardown_pool::current();
+                    if (pool == nullptr || !pool->run_queued(other))
+                        std::this_thread::yield();
+                }
+            }
+        }
+
+    public:
+        // Detach the reference into an owning token without touching the counters; this ref becomes empty.
+        [[nodiscard]] ref_token<T, HolderPolicy> release_raw() noexcept
+        {
+            ref_token<T, HolderPolicy> token;
+            token.ptr = ptr;
+            token.handler = handler;
+            ptr = nullptr;
+            handler = nullptr;
+            return token;
+        }
+
+        // Resume ownership of a token from release_raw(), again without touching the counters.
+        static shared_ref adopt(ref_token<T, HolderPolicy> token) noexcept
+        {
+            shared_ref r;
+            r.ptr = token.ptr;
+            r.handler = token.handler;
+            return r;
+        }
+
+        void reset()
+        {
+            this->_destroy_ref();
+            this->handler = nullptr;
+            this->ptr = nullptr;
+        }
+
+        // Switch a sharded block (count_shards) to per-thread shards for as long as the returned token lives; the
+        // token also keeps the object alive. Destroying it folds the shards back into one counter, after which the
+        // object dies with its last ref as usual. Returns an empty token if another token already pins the block.
+        ref_pin<T, HolderPolicy> pin() const
+        {
+            static_assert(block_type::count_shards > 0, "pin() needs ref_traits<T, HolderPolicy>::count_shards");
+            if (!handler)
+                throw std::runtime_error("Cannot pin an empty shared_ref");
+            if (!handler->pin())
+                return {};
+            return ref_pin<T, HolderPolicy>(*this);
+        }
+
+        // Keep the object alive for good: from now on copying and releasing refs to it, on any thread, only reads the
+        // block. The object and its block are never freed.
+        void make_immortal()
+        {
+            static_assert(!lazy_block, "lazy_block objects cannot be made immortal");
+            if (!handler)
+                throw std::runtime_error("Cannot make an empty shared_ref immortal");
+            handler->make_immortal();
+        }
+
+        bool immortal() const
+        {
+            if constexpr (lazy_block)
+                return false;
+            else
+                return handler && handler->immortal();
+        }
+
+        // Register an additional external holder that mirrors ref-counting events. Registering a holder twice is a
+        // no-op; passing nullptr detaches every holder without notifying them.
+        auto set_holder(void *holder)
+        {
+            if constexpr (!std::is_same_v<HolderPolicy, nullptr_t>)
+            {
+                if (!handler)
+                    throw std::runtime_error("Cannot set holder on empty shared_ref");
+                auto block = _block();
+                if (holder == nullptr)
+                    block->reset_holder();
+                else if constexpr (block_type::intrusive_holder)
+                {
+                    static_assert(std::is_base_of_v<_::intrusive_holder_base, HolderPolicy>,
+                                  "intrusive_holder requires HolderPolicy to derive from intrusive_ref_holder");
+                    if (block->holder == holder)
+                        return;
+                    if (block->holder != nullptr)
+                        throw std::runtime_error("Intrusive holder mode allows only one holder per shared_ref");
+                    auto list = static_cast<_::intrusive_holder_base *>(static_cast<HolderPolicy *>(holder));
+                    block->link_holder(holder, &list->members);
+                    if constexpr (requires { HolderPolicy::hold_ref(holder, *this); })
+                        HolderPolicy::hold_ref(holder, *this);
+                }
+                else if (block->add_holder(holder))
+                    HolderPolicy::hold_ref(holder, *this);
+            }
+            else
+            {
+                static_assert(false, "T must inherit from enable_ref_holder to use set_holder");
+            }
+        }
+
+        // Detach one holder without notifying it (the caller is the one letting go). Returns whether it was held.
+        bool remove_holder(void *holder)
+        {
+            if constexpr (!std::is_same_v<HolderPolicy, nullptr_t>)
+            {
+                if (!handler)
+                    throw std::runtime_error("Cannot remove holder from empty shared_ref");
+                if constexpr (lazy_block)
+                    return handler->side() && handler->side()->remove_holder(holder);
+                else
+                    return handler->remove_holder(holder);
+            }
+            else
+            {
+                static_assert(false, "T must inherit from enable_ref_holder to use remove_holder");
+            }
+        }
+        T *get() const
+        {
+            if constexpr (relocatable)
+                return handler ? static_cast<T *>(handler->object()) : nullptr;
+            else
+                return static_cast<T *>(ptr);
+        }
+        T *operator->() const { return get(); }
+
+        T &operator*() const { return *get(); }
+
+        operator bool() const { return ptr != nullptr; }
+
+        friend class weak_ref<T, HolderPolicy>;
+        friend struct enable_shared_ref_from_this<T, HolderPolicy>;
+        friend struct weighted_ref<T, HolderPolicy>;
+        friend struct ref_view<T, HolderPolicy>;
+        friend struct ref_region;
+        friend struct relocatable_heap<T, HolderPolicy>;
+        friend struct slab_store<T, HolderPolicy>;
+        friend struct tagged_ref<T, HolderPolicy>;
+        friend struct ref_vector<T, HolderPolicy>;
+    };
+
+    template <typename T, typename HolderPolicy>
+    struct weak_ref
+    {
+        // Non-owning counterpart to shared_ref; keeps control block alive.
+        using element_type = T;
+        using handler_type = typename shared_ref<T, HolderPolicy>::block_type;
+        static_assert(handler_type::weak_refs, "weak_ref is disabled by ref_traits<T, HolderPolicy>::weak_refs");
+
+        handler_type *handler;
+
+        weak_ref() : handler(nullptr) {}
+        weak_ref(nullptr_t) : weak_ref() {}
+        weak_ref(const shared_ref<T, HolderPolicy> &other) : weak_ref() { this->_copy_ref(other._block()); }
+        weak_ref(const weak_ref<T, HolderPolicy> &other) : weak_ref() { this->_copy_ref(other.handler); }
+
+        weak_ref &operator=(nullptr_t)
+        {
+            _destroy_ref();
+            handler = nullptr;
+            return *this;
+        }
+        weak_ref &operator=(const shared_ref<T, HolderPolicy> &other)
+        {
+            auto block = other._block();
+            if (this->handler == block)
+                return *this;
+            this->_copy_ref(block);
+            return *this;
+        }
+        weak_ref &operator=(const weak_ref<T, HolderPolicy> &other)
+        {
+            if (this->handler == other.handler)
+                return *this;
+            this->_copy_ref(other.handler);
+            return *this;
+        }
+        // Moves hand the weak unit over without touching the block.
+        weak_ref(weak_ref<T, HolderPolicy> &&other) noexcept : handler(std::exchange(other.handler, nullptr)) {}
+        weak_ref &operator=(weak_ref<T, HolderPolicy> &&other)
+        {
+            if (this != &other)
+            {
+                _destroy_ref();
+                handler = std::exchange(other.handler, nullptr);
+            }
+            return *this;
+        }
+
+        ~weak_ref() { _destroy_ref(); }
+
+        void _destroy_ref()
+        {
+            if (this->handler)
+            {
+                if constexpr (!handler_type::atomic_counts)
+                    if (_::reclaimers_running()) [[unlikely]]
+                        return _destroy_serialized();
+                _drop_weak();
+            }
+        }
+
+        // One increment-if-alive on the strong counter (a single CAS loop with atomic_counts); a failed lock writes
+        // nothing to the block.
+        shared_ref<T, HolderPolicy> lock() const { return shared_ref<T, HolderPolicy>(handler); }
+
+        // lock() into an existing ref: on success `out` now owns the object (its previous object is released), on
+        // failure `out` is left untouched. A ref that already owns this object costs no counter traffic at all.
+        bool try_lock_into(shared_ref<T, HolderPolicy> &out) const
+        {
+            if (out._owns_block(handler))
+                return true;
+            if (handler == nullptr || !handler->try_add_strong())
+                return false;
+            auto old_handler = out.handler;
+            auto old_ptr = out.ptr;
+            out._attach_counted(handler);
+            shared_ref<T, HolderPolicy>::_release_handler(old_handler, old_ptr);
+            return true;
+        }
+
+        bool expired() const { return handler == nullptr || handler->expired(); }
+
+    private:
+        friend struct enable_shared_ref_from_this<T, HolderPolicy>;
+        friend struct ref_view<T, HolderPolicy>;
+
+        // Attach to another control block: bump its weak counter, then release the one held so far.
+        void _copy_ref(handler_type *h)
+        {
+            if (h)
+            {
+                if constexpr (!handler_type::atomic_counts)
+                    if (_::reclaimers_running()) [[unlikely]]
+                        return _copy_serialized(h);
+                h->add_weak();
+            }
+            _destroy_ref();
+            handler = h;
+        }
+
+        // Give back this ref's weak unit, and the block with it once no strong refs are left.
+        void _drop_weak()
+        {
+            if (this->handler->drop_weak() && this->handler->strong == 0)
+            {
+                shared_ref<T, HolderPolicy>::_unhold_all(this->handler);
+                shared_ref<T, HolderPolicy>::_delete_block(this->handler);
+                this->handler = nullptr;
+            }
+        }
+
+        // _copy_ref and _destroy_ref of a non-atomic block while reclaimers run; see _::reclaimer_guard.
+        [[gnu::noinline]] void _copy_serialized(handler_type *h)
+        {
+            {
+                _::reclaimer_guard guard;
+                h->add_weak();
+            }
+            _destroy_ref();
+            handler = h;
+        }
+        [[gnu::noinline]] void _destroy_serialized()
+        {
+            _::reclaimer_guard guard;
+            _drop_weak();
+        }
+    };
+
+    // Owning handle produced by shared_ref::release_raw(): the reference it carries is still counted and must be handed
+    // to exactly one shared_ref::adopt(); dropping a token leaks the reference. Trivially copyable, so tokens can move
+    // through lock-free queues (see ref_queue) without touching the control block.
+    template <typename T, typename HolderPolicy>
+    struct ref_token
+    {
+        explicit operator bool() const { return handler != nullptr; }
+
+    private:
+        friend struct shared_ref<T, HolderPolicy>;
+
+        T *ptr = nullptr;
+        typename shared_ref<T, HolderPolicy>::handler_type *handler = nullptr;
+    };
+
+    // Immortal control block for an object with static storage duration: no allocation, and refs to it never count.
+    //     static Vocabulary vocab;
+    //     constinit static_ref_block<Vocabulary> vocab_block{&vocab};
+    //     constinit shared_ref<Vocabulary> vocab_ref{&vocab, vocab_block};
+    template <typename T, typename HolderPolicy>
+    struct static_ref_block : shared_ref<T, HolderPolicy>::block_type
+    {
+        constexpr explicit static_ref_block(T *p) : shared_ref<T, HolderPolicy>::block_type(_::immortal_init{}, p) {}
+    };
+
+    // Borrowed reference: the same pointers as a shared_ref but no counter traffic, for parameters and traversals
+    // where someone else keeps the object alive. promote() turns it into an owning shared_ref.
+    // With SMART_REF_DEBUG_VIEWS a view also holds a weak unit, so using it after the object died asserts instead
+    // of reading freed memory (types without weak_refs, and lazy_block types, are not checked).
+    template <typename T, typename HolderPolicy>
+    struct ref_view
+    {
+        using element_type = T;
+        using handler_type = typename shared_ref<T, HolderPolicy>::handler_type;
+        static constexpr bool checked = SMART_REF_DEBUG_VIEWS && shared_ref<T, HolderPolicy>::block_type::weak_refs &&
+                                        !shared_ref<T, HolderPolicy>::lazy_block;
+
+        T *ptr;
+        handler_type *handler;
+
+        ref_view() : ptr(nullptr), handler(nullptr) {}
+        ref_view(nullptr_t) : ref_view() {}
+        ref_view(const shared_ref<T, HolderPolicy> &other) : ptr(other.ptr), handler(other.handler)
+        {
+            if constexpr (checked)
+                _guard = other;
+        }
+        // A view of a temporary would dangle at the end of the full expression.
+        ref_view(shared_ref<T, HolderPolicy> &&) = delete;
+
+        T *get() const
+        {
+            _check();
+            if constexpr (shared_ref<T, HolderPolicy>::relocatable)
+                return handler ? static_cast<T *>(handler->object()) : nullptr; // as for shared_ref
+            else
+                return ptr;
+        }
+        T *operator->() const { return get(); }
+        T &operator*() const { return *get(); }
+
+        operator bool() const { return ptr != nullptr; }
+
+        // Take a counted reference, for callees that retain the object beyond the call.
+        shared_ref<T, HolderPolicy> promote() const
+        {
+            _check();
+            shared_ref<T, HolderPolicy> r;
+            if (handler)
+            {
+                shared_ref<T, HolderPolicy>::_retain(handler, ptr);
+                r.ptr = ptr;
+                r.handler = handler;
+            }
+            return r;
+        }
+
+    private:
+        friend struct enable_shared_ref_from_this<T, HolderPolicy>;
+
+        [[no_unique_address]] std::conditional_t<checked, weak_ref<T, HolderPolicy>, _::empty_base> _guard;
+
+        ref_view(T *p, handler_type *h) : ptr(p), handler(h) /* only called by view_from_this */
+        {
+            if constexpr (checked)
+                _guard._copy_ref(h);
+        }
+
+        void _check() const
+        {
+            if constexpr (checked)
+                assert((handler == nullptr || !_guard.expired()) && "ref_view used after its object died");
+        }
+    };
+
+    // Owning reference with weighted counting: the block's strong count is the sum of the weights of all refs (a
+    // plain shared_ref weighs 1). Copying splits the source's weight in half without writing to the block, so fanning
+    // a ref out to many workers keeps the shared cache line clean; only a copy from a ref of weight 1 refills it with
+    // one add, and destruction returns the whole weight with one subtraction. Weight is only drawn while the block's
+    // counter is in the lower half of its range; past that, refs carry plain units and each copy adds one, so narrow
+    // count_types degrade instead of overflowing. The split writes to the source, so a weighted_ref must not be
+    // copied from two threads at once: copy on one thread, then move the copies out.
+    template <typename T, typename HolderPolicy>
+    struct weighted_ref
+    {
+        using element_type = T;
+        using ref_type = shared_ref<T, HolderPolicy>;
+        using block_type = typename ref_type::block_type;
+        using count_type = typename block_type::count_type;
+        static_assert(!ref_type::lazy_block, "weighted_ref needs a separate control block (no lazy_block)");
+        static_assert(!block_type::deferred_counts, "weighted_ref cannot be combined with deferred_counts");
+        static_assert(!block_type::domain_counts, "weighted_ref cannot be combined with domain_counts");
+
+        // Weight taken from the block when a ref is created or refilled: 2^16 for 32-bit counters, 2^8 for 16-bit.
+        static constexpr count_type full_weight = count_type(1) << (std::numeric_limits<count_type>::digits / 2);
+
+        T *ptr = nullptr;
+        block_type *handler = nullptr;
+        mutable count_type weight = 0;
+
+        weighted_ref() = default;
+        weighted_ref(nullptr_t) {}
+        explicit weighted_ref(T *p) : weighted_ref(ref_type(p)) {}
+        // Takes over r's unit and tops it up to full_weight with a single add, if the block has room.
+        weighted_ref(ref_type &&r) : ptr(r.ptr), handler(r.handler)
+        {
+            r.ptr = nullptr;
+            r.handler = nullptr;
+            if (handler)
+                weight = handler->add_strong_if_room(full_weight - 1) ? full_weight : 1;
+        }
+        weighted_ref(const ref_type &r) : weighted_ref(ref_type(r)) {}
+        weighted_ref(const weighted_ref &other) : ptr(other.ptr), handler(other.handler)
+        {
+            if (handler)
+                weight = other._split();
+        }
+        weighted_ref(weighted_ref &&other) noexcept : ptr(other.ptr), handler(other.handler), weight(other.weight)
+        {
+            other.ptr = nullptr;
+            other.handler = nullptr;
+            other.weight = 0;
+        }
+        ~weighted_ref() { _drop(); }
+
+        weighted_ref &operator=(const weighted_ref &other)
+        {
+            if (this != &other)
+                *this = weighted_ref(other);
+            return *this;
+        }
+        weighted_ref &operator=(weighted_ref &&other) noexcept
+        {
+            if (this != &other)
+            {
+                _drop();
+                ptr = std::exchange(other.ptr, nullptr);
+                handler = std::exchange(other.handler, nullptr);
+                weight = std::exchange(other.weight, 0);
+            }
+            return *this;
+        }
+        weighted_ref &operator=(nullptr_t)
+        {
+            reset();
+            return *this;
+        }
+
+        void reset()
+        {
+            _drop();
+            ptr = nullptr;
+            handler = nullptr;
+            weight = 0;
+        }
+
+        // Plain shared_ref to the same object; splits a unit off this ref's weight when it has more than one.
+        ref_type share() const
+        {
+            ref_type r;
+            if (handler)
+            {
+                if (weight > 1)
+                    --weight;
+                else
+                    handler->add_strong();
+                r.ptr = ptr;
+                r.handler = handler;
+            }
+            return r;
+        }
+
+        T *get() const
+        {
+            if constexpr (ref_type::relocatable)
+                return handler ? static_cast<T *>(handler->object()) : nullptr; // as for shared_ref
+            else
+                return ptr;
+        }
+        T *operator->() const { return get(); }
+        T &operator*() const { return *get(); }
+
+        operator bool() const { return ptr != nullptr; }
+
+    private:
+        // Hand half of this ref's weight to a copy, refilling first if only one unit is left. Without room for a
+        // refill the copy gets a fresh unit of its own.
+        count_type _split() const
+        {
+            if (weight == 1)
+            {
+                if (!handler->add_strong_if_room(full_weight))
+                {
+                    handler->add_strong();
+                    return 1;
+                }
+                weight += full_weight;
+            }
+            auto half = weight / 2;
+            weight -= half;
+            return half;
+        }
+
+        void _drop()
+        {
+            if (handler && handler->drop_strong(weight))
+                ref_type::_release_last(handler, ptr);
+        }
+    };
+
+    // Token of shared_ref::pin(): holds a ref and keeps the block on its per-thread shards until it is destroyed or
+    // released.
+    template <typename T, typename HolderPolicy>
+    struct ref_pin
+    {
+        using ref_type = shared_ref<T, HolderPolicy>;
+
+        ref_pin() = default;
+        ref_pin(ref_pin &&other) noexcept : ref(std::move(other.ref)) {}
+        ref_pin &operator=(ref_pin &&other) noexcept
+        {
+            if (this != &other)
+            {
+                release();
+                ref = std::move(other.ref);
+            }
+            return *this;
+        }
+        ~ref_pin() { release(); }
+
+        // Fold the shards and drop the pin and the token's ref now.
+        void release()
+        {
+            if (!ref)
+                return;
+            if constexpr (ref_type::block_type::count_shards > 0) // only sharded blocks hand out non-empty tokens
+                ref.handler->unpin();
+            ref = nullptr;
+        }
+
+        explicit operator bool() const { return bool(ref); }
+
+    private:
+        friend ref_type;
+        explicit ref_pin(const ref_type &r) : ref(r) {}
+
+        ref_type ref;
+    };
+
+    // shared_ref with a few user bits (an edge kind, a visit mark) kept in the low alignment bits of its block
+    // pointer, so a tagged edge is as small as a plain ref. get(), ->, * and the release paths mask the tag away;
+    // copies and moves carry it, and comparisons and hashing see both the target and the tag.
+    template <typename T, typename HolderPolicy>
+    struct tagged_ref
+    {
+        using element_type = T;
+        using ref_type = shared_ref<T, HolderPolicy>;
+        using handler_type = typename ref_type::handler_type;
+        using block_type = typename ref_type::block_type;
+        // Bits free in both the handler and the weak block pointer (3 for heap blocks).
+        static constexpr unsigned tag_bits =
+            unsigned(std::min(std::countr_zero(alignof(handler_type)), std::countr_zero(alignof(block_type))));
+        static constexpr uintptr_t tag_mask = (uintptr_t(1) << tag_bits) - 1;
+        static_assert(tag_bits > 0, "the block pointer of T has no spare alignment bits");
+
+        T *ptr = nullptr;
+        uintptr_t bits = 0; // block pointer | tag
+
+        tagged_ref() = default;
+        tagged_ref(nullptr_t, uintptr_t tag = 0) : bits(_check(tag)) {}
+        // Takes over r's reference.
+        tagged_ref(ref_type r, uintptr_t tag = 0)
+            : ptr(r.ptr), bits(reinterpret_cast<uintptr_t>(r.handler) | _check(tag))
+        {
+            r.ptr = nullptr;
+            r.handler = nullptr;
+        }
+        tagged_ref(const tagged_ref &other) : ptr(other.ptr), bits(other.bits)
+        {
+            if (auto h = handler())
+                ref_type::_retain(h, ptr);
+        }
+        tagged_ref(tagged_ref &&other) noexcept
+            : ptr(std::exchange(other.ptr, nullptr)), bits(std::exchange(other.bits, 0))
+        {
+        }
+        ~tagged_ref() { _release(); }
+
+        tagged_ref &operator=(const tagged_ref &other)
+        {
+            if (this != &other)
+                *this = tagged_ref(other);
+            return *this;
+        }
+        tagged_ref &operator=(tagged_ref &&other) noexcept
+        {
+            if (this != &other)
+            {
+                _release();
+                ptr = std::exchange(other.ptr, nullptr);
+                bits = std::exchange(other.bits, 0);
+            }
+            return *this;
+        }
+
+        // Drop the reference; the tag stays.
+        void reset()
+        {
+            _release();
+            ptr = nullptr;
+            bits &= tag_mask;
+        }
+
+        uintptr_t tag() const { return bits & tag_mask; }
+        void set_tag(uintptr_t tag) { bits = (bits & ~tag_mask) | _check(tag); }
+
+        handler_type *handler() const { return reinterpret_cast<handler_type *>(bits & ~tag_mask); }
+
+        // Untagged shared_ref to the same object.
+        ref_type ref() const
+        {
+            ref_type r;
+            if (auto h = handler())
+            {
+                ref_type::_retain(h, ptr);
+                r.ptr = ptr;
+                r.handler = h;
+            }
+            return r;
+        }
+
+        T *get() const
+        {
+            if constexpr (ref_type::relocatable)
+                return handler() ? static_cast<T *>(handler()->object()) : nullptr;
+            else
+                return ptr;
+        }
+        T *operator->() const { return get(); }
+        T &operator*() const { return *get(); }
+
+        operator bool() const { return handler() != nullptr; }
+
+    private:
+        static uintptr_t _check(uintptr_t tag)
+        {
+            assert(tag <= tag_mask && "tag does not fit in the alignment bits of the block pointer");
+            return tag & tag_mask;
+        }
+
+        void _release()
+        {
+            auto h = handler();
+            ref_type::_release_handler(h, ptr);
+        }
+
+        friend struct tagged_weak_ref<T, HolderPolicy>;
+    };
+
+    // weak_ref counterpart of tagged_ref; lock() yields a tagged_ref with the same tag.
+    template <typename T, typename HolderPolicy>
+    struct tagged_weak_ref
+    {
+        using element_type = T;
+        using weak_type = weak_ref<T, HolderPolicy>;
+        using handler_type = typename weak_type::handler_type;
+        static constexpr unsigned tag_bits = tagged_ref<T, HolderPolicy>::tag_bits;
+        static constexpr uintptr_t tag_mask = tagged_ref<T, HolderPolicy>::tag_mask;
+
+        uintptr_t bits = 0; // block pointer | tag
+
+        tagged_weak_ref() = default;
+        tagged_weak_ref(nullptr_t, uintptr_t tag = 0) : bits(tagged_ref<T, HolderPolicy>::_check(tag)) {}
+        // Takes over w's weak reference.
+        tagged_weak_ref(weak_type w, uintptr_t tag = 0)
+            : bits(reinterpret_cast<uintptr_t>(std::exchange(w.handler, nullptr)) |
+                   tagged_ref<T, HolderPolicy>::_check(tag))
+        {
+        }
+        tagged_weak_ref(const tagged_ref<T, HolderPolicy> &r)
+            : tagged_weak_ref(r ? weak_type(r.ref()) : weak_type(), r.tag())
+        {
+        }
+        tagged_weak_ref(const tagged_weak_ref &other) : bits(other.bits)
+        {
+            if (auto h = handler())
+                h->add_weak();
+        }
+        tagged_weak_ref(tagged_weak_ref &&other) noexcept : bits(std::exchange(other.bits, 0)) {}
+        ~tagged_weak_ref() { _adopt(handler()); }
+
+        tagged_weak_ref &operator=(const tagged_weak_ref &other)
+        {
+            if (this != &other)
+                *this = tagged_weak_ref(other);
+            return *this;
+        }
+        tagged_weak_ref &operator=(tagged_weak_ref &&other) noexcept
+        {
+            if (this != &other)
+            {
+                _adopt(handler());
+                bits = std::exchange(other.bits, 0);
+            }
+            return *this;
+        }
+
+        uintptr_t tag() const { return bits & tag_mask; }
+        void set_tag(uintptr_t tag) { bits = (bits & ~tag_mask) | tagged_ref<T, HolderPolicy>::_check(tag); }
+
+        handler_type *handler() const { return reinterpret_cast<handler_type *>(bits & ~tag_mask); }
+
+        // A tagged_ref with this tag, empty if the object is gone.
+        tagged_ref<T, HolderPolicy> lock() const
+        {
+            auto w = _adopt(handler());
+            tagged_ref<T, HolderPolicy> r(w.lock(), tag());
+            w.handler = nullptr;
+            return r;
+        }
+
+        bool expired() const { return handler() == nullptr || handler()->expired(); }
+
+    private:
+        // A weak_ref owning the unit held in `bits`; it releases the unit when destroyed unless emptied first.
+        static weak_type _adopt(handler_type *h)
+        {
+            weak_type w;
+            w.handler = h;
+            return w;
+        }
+    };
+
+    template <typename T, typename H>
+    inline bool operator==(const tagged_ref<T, H> &x, const tagged_ref<T, H> &y) noexcept
+    {
+        return x.get() == y.get() && x.tag() == y.tag();
+    }
+
+    template <typename T, typename H>
+    inline bool operator!=(const tagged_ref<T, H> &x, const tagged_ref<T, H> &y) noexcept
+    {
+        return !(x == y);
+    }
+
+    // Ordered by target, then by tag; relocatable targets by block, as for shared_ref.
+    template <typename T, typename H>
+    inline bool operator<(const tagged_ref<T, H> &x, const tagged_ref<T, H> &y) noexcept
+    {
+        if constexpr (shared_ref<T, H>::relocatable)
+            return x.bits < y.bits;
+        else
+            return x.get() < y.get() || (x.get() == y.get() && x.tag() < y.tag());
+    }
 
-            void reset_holder()
-            {
-                if constexpr (enable_holder)
-                    this->holder = nullptr;
-                else
-                    static_assert(false, "T must inherit from enable_ref_holder to use reset_holder");
-            }
+    template <typename T, typename H>
+    inline bool operator==(const tagged_weak_ref<T, H> &x, const tagged_weak_ref<T, H> &y) noexcept
+    {
+        return x.bits == y.bits;
+    }
 
-            bool empty() const { return ptr == nullptr; }
-        };
-    } // namespace _
+    template <typename T, typename H>
+    inline bool operator!=(const tagged_weak_ref<T, H> &x, const tagged_weak_ref<T, H> &y) noexcept
+    {
+        return !(x == y);
+    }
 
-    template <typename T, typename HolderPolicy>
-    struct shared_ref
+    // Arena for groups of objects that are built together and die together (region_refs types). Objects made by
+    // make() live in the region's chunks next to immortal blocks, so refs between them neither count nor free
+    // anything. Refs leaving the region go through share(): each carries its own counted block and keeps the whole
+    // region alive. When the last of them and the creator's claim (release()) are gone, every object is destroyed
+    // and the chunks are freed at once.
+    //     auto region = ref_region::create();
+    //     auto a = region->make<Node>(), b = region->make<Node>();
+    //     a->next = b;                      // uncounted
+    //     auto out = region->share(a);      // counted, retains the region
+    //     region->release();                // the region now dies with `out` and its copies
+    // Inside the region, link objects with refs from make(): an escaped ref stored in a member of a region object
+    // keeps its own region alive. weak_refs that may outlive the region must be taken from escaped refs.
+    struct ref_region
     {
-    public:
-        using element_type = T;
-        using handler_type = _::ref_block<true>;
-        using holder_type = HolderPolicy;
+        static ref_region *create() { return new ref_region(); }
 
-        T *ptr;                // Raw pointer to managed object and pointer to the shared control block.
-        handler_type *handler; // Shared control block.
+        ref_region(const ref_region &) = delete;
+        ref_region &operator=(const ref_region &) = delete;
 
-        shared_ref() : handler(nullptr), ptr(nullptr) {}
-        shared_ref(nullptr_t) : handler(nullptr), ptr(nullptr) {}
-        shared_ref(const shared_ref &other) : shared_ref() { this->_copy_shared(other); }
-        shared_ref(T *p)
+        // Construct a T in the region. The returned ref, and every copy of it, is uncounted.
+        template <typename T, typename HolderPolicy = nullptr_t, typename... Args>
+        shared_ref<T, HolderPolicy> make(Args &&...args)
         {
-            if (p == nullptr)
-            {
-                handler = nullptr;
-                ptr = nullptr;
-                return;
-            }
-            handler = new handler_type();
-            handler->strong = 1;
-            handler->ptr = p;
-            ptr = p;
-
-            // Populate weak_from_this only if the type opted in.
+            using ref_type = shared_ref<T, HolderPolicy>;
+            using block_type = typename ref_type::block_type;
+            static_assert(block_type::region_refs, "T must opt into ref_traits<T, HolderPolicy>::region_refs");
+            auto p = new (_allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            auto block = new (_allocate(sizeof(block_type), alignof(block_type))) block_type(_::immortal_init{}, p);
+            block->region = this;
+            objects.push_back({block, p, &_destroy<T, HolderPolicy>});
             if constexpr (std::is_base_of_v<enable_shared_ref_from_this<T, HolderPolicy>, T>)
-                p->_weak_self = *this;
+                ref_type::_bind_self(p, block);
+            ref_type r;
+            r.ptr = p;
+            r.handler = block;
+            return r;
         }
 
-        ~shared_ref() { this->_destroy_ref(); }
-
-    public:
-        template <typename U>
-            requires((std::is_base_of_v<enable_ref_holder, T> && std::is_base_of_v<enable_ref_holder, U>) ||
-                     (!std::is_base_of_v<enable_ref_holder, T> && !std::is_base_of_v<enable_ref_holder, U>))
-        // Aliasing constructor used by pointer-cast helpers; keeps same control block.
-        shared_ref(const shared_ref<U, HolderPolicy> &other, T *p) noexcept
-            : ptr(p), handler(other.handler) /* only called by std::static_pointer_cast, std::dynamic_pointer_cast,
-                                              * std::reinterpret_pointer_cast, std::const_pointer_cast */
+        // Counted ref to a region object, usable anywhere like one to a heap object; it retains the region.
+        template <typename T, typename HolderPolicy>
+        shared_ref<T, HolderPolicy> share(const shared_ref<T, HolderPolicy> &inner)
         {
-            /* Note: this method should be set public, so that pybind11 can use it to cast derived types. */
-            // assume ptr==nullptr && handler==nullptr, or handler!=nullptr && ptr==handler->ptr
-            if (handler && ptr)
-                handler->strong++;
+            using block_type = typename shared_ref<T, HolderPolicy>::block_type;
+            shared_ref<T, HolderPolicy> r;
+            if (!inner)
+                return r;
+            assert(inner.handler->region == this && "ref_region::share needs a ref to an object of this region");
+            auto block = new block_type();
+            block->strong = 1;
+            if constexpr (block_type::weak_refs)
+                block->ptr = inner.ptr;
+            if constexpr (block_type::atomic_counts && block_type::weak_refs)
+                block->weak = 1;
+            block->region = this;
+            external.fetch_add(1, std::memory_order_relaxed);
+            r.ptr = inner.ptr;
+            r.handler = block;
+            return r;
         }
 
+        // Drop the creator's claim; refs from make() must not be used afterwards.
+        void release() { _::region_release(this); }
+
+        size_t size() const { return objects.size(); }
+
     private:
-        // Construct from control block when promoted from weak_ref::lock.
-        shared_ref(handler_type *h) /* only called by weak_ref::lock() */
-        {
-            if (h && h->ptr)
-            {
-                this->handler = h;
-                this->ptr = static_cast<T *>(h->ptr);
-                h->strong++;
-            }
-            else
-            {
-                this->ptr = nullptr;
-                this->handler = nullptr;
-            }
-        }
+        friend void _::region_release(ref_region *);
 
-        shared_ref(T *p, handler_type *h) : ptr(p), handler(h) /* only called by shared_ref::revive */
+        static constexpr size_t chunk_size = 64 * 1024;
+
+        // Region objects in creation order; `destroy` runs in two passes, objects first and then their blocks, so
+        // destructors may still drop refs to objects destroyed before them.
+        struct entry
         {
-            // assume h != nullptr && h->stong == 0 && h->ptr == nullptr
-            this->handler->strong = 1;
-            this->handler->ptr = p;
-        }
+            void *block;
+            void *ptr;
+            void (*destroy)(void *block, void *ptr, bool object_pass);
+        };
 
-    public:
-        shared_ref &operator=(const shared_ref &other)
+        std::atomic<size_t> external{1}; // escaped refs, plus the creator's claim
+        std::vector<entry> objects;
+        std::vector<void *> chunks;
+        std::byte *cursor = nullptr;
+        std::byte *limit = nullptr;
+
+        ref_region() = default;
+        ~ref_region()
         {
-            this->_copy_shared(other);
-            return *this;
+            for (auto it = objects.rbegin(); it != objects.rend(); ++it)
+                it->destroy(it->block, it->ptr, true);
+            for (auto it = objects.rbegin(); it != objects.rend(); ++it)
+                it->destroy(it->block, it->ptr, false);
+            for (auto chunk : chunks)
+                ::operator delete(chunk);
         }
 
-        shared_ref &operator=(nullptr_t)
+        void *_allocate(size_t size, size_t align)
         {
-            this->reset();
-            return *this;
+            auto p = reinterpret_cast<std::byte *>((reinterpret_cast<uintptr_t>(cursor) + align - 1) & ~(align - 1));
+            if (cursor == nullptr || p + size > limit)
+            {
+                auto bytes = std::max(chunk_size, size + align);
+                auto chunk = static_cast<std::byte *>(::operator new(bytes));
+                chunks.push_back(chunk);
+                limit = chunk + bytes;
+                p = reinterpret_cast<std::byte *>((reinterpret_cast<uintptr_t>(chunk) + align - 1) & ~(align - 1));
+            }
+            cursor = p + size;
+            return p;
         }
 
-    private:
-        static void _release_handler(handler_type *&handler)
+        template <typename T, typename HolderPolicy>
+        static void _destroy(void *block, void *ptr, bool object_pass)
         {
-            if (handler)
+            using ref_type = shared_ref<T, HolderPolicy>;
+            using block_type = typename ref_type::block_type;
+            auto b = static_cast<block_type *>(block);
+            if (object_pass)
             {
-                handler->strong--;
-                if (handler->strong == 0)
+                ref_type::_unhold_all(b);
+                if constexpr (block_type::weak_refs)
                 {
-                    // Object is about to be destroyed; keep control block if weak refs remain.
-                    if (handler->weak == 0)
-                    {
-                        if constexpr (std::is_same_v<handler_type, _::ref_block<true>> &&
-                                      !std::is_same_v<HolderPolicy, nullptr_t>)
-                        {
-                            if (handler->holder)
-                            {
-                                auto holder = handler->holder;
-                                handler->holder = nullptr;
-                                HolderPolicy::unhold_ref(holder, static_cast<void *>(handler));
-                            }
-                        }
-                        delete static_cast<T *>(handler->ptr);
-                        delete handler;
-                        handler = nullptr;
-                    }
-                    else
-                    {
-                        /* Note: handler->ptr should be set to nullptr first before deleting the managed object
-                         * to avoid dangling pointer in weak_ref:
-                         *  - If enable_shared_ref_from_this is used, this->_weak_self is destroyed, during which
-                         * handler is freed. As a result, handler->ptr cannot be accessed anymore, so it cannot be set
-                         * to nullptr.
-                         *  - However, if enable_shared_ref_from_this is not used, weak_ref may still access
-                         * handler->ptr to check expiration, so we need to set it to nullptr here.
-                         *  - To avoid complexity, we always set handler->ptr to nullptr here when strong count reaches
-                         * zero.
-                         */
-                        auto ptr = handler->ptr;
-                        handler->ptr = nullptr;
-                        delete static_cast<T *>(ptr);
-                    }
+                    assert(b->weak_count() == (block_type::atomic_counts ? 1 : 0) &&
+                           "weak_ref to a region object outlived its region");
+                    b->ptr = nullptr;
                 }
+                static_cast<T *>(ptr)->~T();
             }
+            else
+                b->~block_type();
         }
+    };
 
-        void _destroy_ref() { _release_handler(this->handler); }
-
-        void _copy_shared(const shared_ref<T, HolderPolicy> &other)
-        {
-            if (this->handler == other.handler)
-                return;
-            auto old_handler = this->handler;
-
-            // Point at the same control block and bump strong count before releasing previous one.
-            this->handler = other.handler;
-            this->ptr = other.ptr;
-            if (this->handler)
-                this->handler->strong++;
+    inline void _::region_release(ref_region *region)
+    {
+        if (region->external.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete region;
+    }
 
-            _release_handler(old_handler);
-        }
+    template <typename T, typename HolderPolicy>
+    struct enable_shared_ref_from_this
+    {
+    private:
+        // Uncounted: the block outlives the object, and the block's self flag records the binding.
+        _::block_for<T, HolderPolicy> *_self_block = nullptr;
+        friend struct shared_ref<T, HolderPolicy>;
 
     public:
-        static shared_ref revive(T *p, handler_type *other)
+        enable_shared_ref_from_this() = default;
+        // A copy is a different object and starts unowned.
+        enable_shared_ref_from_this(const enable_shared_ref_from_this &) {}
+        enable_shared_ref_from_this &operator=(const enable_shared_ref_from_this &) { return *this; }
+
+        // Build a shared_ref that aliases the one controlling this instance.
+        shared_ref<T, HolderPolicy> shared_from_this()
         {
-            /* Make sure
-             * 1. p != nullptr
-             * 2. other != nullptr
-             * 3. other->ptr == nullptr
-             */
-            if (p == nullptr || other == nullptr || other->ptr != nullptr || other->strong > 0)
-                throw std::runtime_error("Cannot revive due to invalid parameters");
-            return shared_ref{p, other};
+            if constexpr (shared_ref<T, HolderPolicy>::lazy_block)
+            {
+                // The object carries its own count; no self reference is stored.
+                auto self = static_cast<T *>(this);
+                if (static_cast<typename shared_ref<T, HolderPolicy>::handler_type *>(self)->strong_count() == 0)
+                    throw std::runtime_error("enable_shared_ref_from_this: object is no longer owned by a shared_ref");
+                return shared_ref<T, HolderPolicy>(self);
+            }
+            else
+            {
+                // No lock() round trip: a live object means a live block.
+                if (_self_block == nullptr || !_self_block->try_add_strong())
+                    throw std::runtime_error("enable_shared_ref_from_this: object is no longer owned by a shared_ref");
+                shared_ref<T, HolderPolicy> p;
+                p.ptr = static_cast<T *>(this);
+                p.handler = _self_block;
+                return p;
+            }
         }
 
-        void reset()
+        // shared_from_this without counting: valid while the caller's own references keep the object alive.
+        ref_view<T, HolderPolicy> view_from_this()
         {
-            this->_destroy_ref();
-            this->handler = nullptr;
-            this->ptr = nullptr;
+            auto self = static_cast<T *>(this);
+            if constexpr (shared_ref<T, HolderPolicy>::lazy_block)
+            {
+                auto header = static_cast<typename shared_ref<T, HolderPolicy>::handler_type *>(self);
+                if (header->strong_count() == 0)
+                    throw std::runtime_error("enable_shared_ref_from_this: object is no longer owned by a shared_ref");
+                return {self, header};
+            }
+            else
+            {
+                if (_self_block == nullptr || _self_block->expired())
+                    throw std::runtime_error("enable_shared_ref_from_this: object is no longer owned by a shared_ref");
+                return {self, _self_block};
+            }
         }
 
-        // Register or replace the external holder that mirrors ref-counting events.
-        auto set_holder(void *holder)
+        weak_ref<T, HolderPolicy> weak_from_this() const
         {
-            if constexpr (!std::is_same_v<HolderPolicy, nullptr_t>)
+            if constexpr (shared_ref<T, HolderPolicy>::lazy_block)
             {
-                if (!handler)
-                    throw std::runtime_error("Cannot set holder on empty shared_ref");
-                handler->holder = holder;
-                if (holder)
-                    HolderPolicy::hold_ref(holder, *this);
+                auto self = const_cast<T *>(static_cast<const T *>(this));
+                if (static_cast<typename shared_ref<T, HolderPolicy>::handler_type *>(self)->strong_count() == 0)
+                    return nullptr;
+                return shared_ref<T, HolderPolicy>(self);
             }
             else
             {
-                static_assert(false, "T must inherit from enable_ref_holder to use set_holder");
+                weak_ref<T, HolderPolicy> w;
+                if (_self_block != nullptr && !_self_block->expired())
+                    w._copy_ref(_self_block);
+                return w;
             }
         }
-        T *get() const { return static_cast<T *>(ptr); }
-        T *operator->() const { return static_cast<T *>(ptr); }
-
-        T &operator*() const { return *static_cast<T *>(ptr); }
 
-        operator bool() const { return ptr != nullptr; }
-
-        friend class weak_ref<T, HolderPolicy>;
+        ~enable_shared_ref_from_this() {}
     };
 
+    // Base for holder policies in intrusive mode (ref_traits<T, HolderPolicy>::intrusive_holder): member blocks are
+    // spliced into this list by set_holder and unlinked when they die, so hold_ref/unhold_ref hooks become optional.
+    // Destroying the holder detaches the remaining members without notification.
     template <typename T, typename HolderPolicy>
-    struct weak_ref
+    struct intrusive_ref_holder : _::intrusive_holder_base
     {
-        // Non-owning counterpart to shared_ref; keeps control block alive.
-        using element_type = T;
-        using handler_type = _::ref_block<true>;
+        using handler_type = typename shared_ref<T, HolderPolicy>::block_type;
 
-        handler_type *handler;
+        struct iterator
+        {
+            _::ref_link *node;
 
-        weak_ref() : handler(nullptr) {}
-        weak_ref(nullptr_t) : weak_ref() {}
-        weak_ref(const shared_ref<T, HolderPolicy> &other) { this->_copy_ref(other); }
-        weak_ref(const weak_ref<T, HolderPolicy> &other) { this->_copy_ref(other); }
+            handler_type *operator*() const { return static_cast<handler_type *>(node); }
+            iterator &operator++()
+            {
+                node = node->next;
+                return *this;
+            }
+            bool operator==(const iterator &other) const { return node == other.node; }
+        };
 
-        weak_ref &operator=(nullptr_t)
+        // Blocks in registration order; a block whose object died but is still weakly referenced has ptr == nullptr.
+        iterator begin() { return {members.next}; }
+        iterator end() { return {&members}; }
+
+        size_t size() const
         {
-            _destroy_ref();
-            handler = nullptr;
-            return *this;
+            size_t n = 0;
+            for (auto node = members.next; node != &members; node = node->next)
+                n++;
+            return n;
         }
-        weak_ref &operator=(const shared_ref<T, HolderPolicy> &other)
+    };
+
+    // NUMA node of the CPU the calling thread runs on; 0 without NUMA.
+    inline int current_numa_node() { return _::numa_current_node(); }
+
+    // Slot storage for types that opt into ref_traits<T, HolderPolicy>::slab_storage: make() places the block and the
+    // object side by side in one fixed-size slot carved from 2 MiB slabs, and a dead object's slot is reused by
+    // revive() while weak refs keep its block. Freed slots go to a per-thread cache that trades batches with a shared
+    // pool, so steady churn stays off the allocator and off the pool lock. In atomic_counts mode slots are padded to
+    // whole cache lines, so the counters of neighbouring objects never share one. Slabs are kept for the life of the
+    // process.
+    //
+    // There is one pool per NUMA node. A thread takes slots from the pool of the node it first allocated on, new slabs
+    // prefer that node's memory, and a slot freed by a thread on another node goes back to its home pool. Without
+    // NUMA everything runs in node 0.
+    template <typename T, typename HolderPolicy>
+    struct slab_store
+    {
+        using ref_type = shared_ref<T, HolderPolicy>;
+        using block_type = typename ref_type::block_type;
+        static_assert(ref_type::slab_storage, "T must opt into ref_traits<T, HolderPolicy>::slab_storage");
+
+        static constexpr size_t slab_bytes = 2 * 1024 * 1024;
+        static constexpr size_t slot_align =
+            std::max({block_type::atomic_counts ? size_t(64) : size_t(1), alignof(block_type), alignof(T)});
+        static constexpr size_t object_offset = (sizeof(block_type) + alignof(T) - 1) / alignof(T) * alignof(T);
+        static constexpr size_t slot_size = (object_offset + sizeof(T) + slot_align - 1) / slot_align * slot_align;
+        static constexpr size_t batch = 64; // slots moved between a thread cache and the pool at a time
+        static_assert(slot_size <= slab_bytes / 8, "T is too large for slab_storage");
+
+        // Create an object in a fresh slot.
+        template <typename... Args>
+        static ref_type make(Args &&...args)
         {
-            if (this->handler == other.handler)
-                return *this;
-            this->_copy_ref(other);
-            return *this;
+            auto slot = _take();
+            auto block = new (slot) block_type();
+            T *p;
+            try
+            {
+                p = new (slot + object_offset) T(std::forward<Args>(args)...);
+            }
+            catch (...)
+            {
+                block->~block_type();
+                _give_back(slot);
+                throw;
+            }
+            ref_type::_init_block(block, p);
+            ref_type r;
+            r.ptr = p;
+            r.handler = block;
+            return r;
         }
-        weak_ref &operator=(const weak_ref<T, HolderPolicy> &other)
+
+        // Like shared_ref::revive_with: the live object of `other`, or a new one built from `args` in the same slot.
+        template <typename... Args>
+        static ref_type revive(const weak_ref<T, HolderPolicy> &other, Args &&...args)
         {
-            if (this->handler == other.handler)
-                return *this;
-            this->_copy_ref(other);
-            return *this;
+            auto block = other.handler;
+            return ref_type::_revive_with(block, [&] {
+                return new (reinterpret_cast<std::byte *>(block) + object_offset) T(std::forward<Args>(args)...);
+            });
         }
 
-        ~weak_ref() { _destroy_ref(); }
+        // Back future slabs with transparent huge pages where the platform supports it (Linux madvise).
+        static void use_huge_pages(bool on) { _huge_pages().store(on, std::memory_order_relaxed); }
 
-        void _destroy_ref()
+        // Slabs allocated so far, over all nodes.
+        static size_t slab_count()
         {
-            if (this->handler)
-            {
-                this->handler->weak--;
-                if (this->handler->weak == 0 && this->handler->strong == 0)
+            size_t n = 0;
+            for (int node = 0; node < _::max_numa_nodes; ++node)
+                if (auto p = _pools()[node].load(std::memory_order_acquire))
                 {
-                    if constexpr (!std::is_same_v<HolderPolicy, nullptr_t>)
-                    {
-                        if (this->handler->holder)
-                        {
-                            auto holder = handler->holder;
-                            handler->holder = nullptr;
-                            HolderPolicy::unhold_ref(holder, static_cast<void *>(this->handler));
-                        }
-                    }
-                    delete this->handler;
-                    this->handler = nullptr;
+                    std::lock_guard guard(p->lock);
+                    n += p->slabs;
                 }
+            return n;
+        }
+
+        // Node whose pool the slot of `r` belongs to.
+        static int home_node(const ref_type &r) { return _header(reinterpret_cast<std::byte *>(r.handler))->node; }
+
+        // Node the memory of `r`'s block currently sits on, or -1 if the platform does not say.
+        static int node_of(const ref_type &r) { return _::numa_node_of(r.handler); }
+
+        // Move the page holding `r`'s block (and whatever else shares the page) to `node`, e.g. for a hot object that
+        // is now mostly touched from there. The slot keeps its home pool. Returns false if the move was refused.
+        static bool migrate(const ref_type &r, int node) { return _::numa_move(r.handler, node); }
+
+    private:
+        // Occupies the first slot of every slab; slabs are slab_bytes aligned, so a slot finds it by masking.
+        struct slab_header
+        {
+            int node;
+        };
+
+        struct pool
+        {
+            std::mutex lock;
+            std::vector<std::byte *> free;
+            std::byte *bump = nullptr; // uncarved rest of the newest slab
+            std::byte *bump_end = nullptr;
+            size_t slabs = 0;
+            int node = 0;
+        };
+
+        struct cache
+        {
+            int node = _::numa_current_node();
+            std::vector<std::byte *> slots;
+
+            ~cache()
+            {
+                _cache_gone() = true;
+                auto &p = _pool(node);
+                std::lock_guard guard(p.lock);
+                p.free.insert(p.free.end(), slots.begin(), slots.end());
             }
+        };
+
+        static std::atomic<pool *> *_pools()
+        {
+            static std::atomic<pool *> pools[_::max_numa_nodes];
+            return pools;
         }
 
-        shared_ref<T, HolderPolicy> lock() const
+        static pool &_pool(int node)
         {
-            if (this->expired())
-                return nullptr;
-            // Recreate a shared_ref that bumps strong count if object still exists.
-            return shared_ref<T, HolderPolicy>(handler);
+            auto &entry = _pools()[node];
+            auto p = entry.load(std::memory_order_acquire);
+            if (p == nullptr)
+            {
+                auto fresh = new pool(); // never destroyed: objects may outlive static destruction
+                fresh->node = node;
+                if (entry.compare_exchange_strong(p, fresh, std::memory_order_acq_rel, std::memory_order_acquire))
+                    p = fresh;
+                else
+                    delete fresh;
+            }
+            return *p;
         }
 
-        bool expired() const { return handler == nullptr || handler->ptr == nullptr; }
+        static std::atomic<bool> &_huge_pages()
+        {
+            static std::atomic<bool> on{false};
+            return on;
+        }
 
-    private:
-        // Helpers that attach to an existing control block and bump the weak counter.
-        void _copy_ref(const weak_ref<T, HolderPolicy> &other)
+        static cache &_cache()
         {
+            thread_local cache c;
+            return c;
+        }
 
-            handler = other.handler;
-            if (handler)
-                handler->weak++;
+        // Set once this thread's cache is destroyed; later releases on the thread go straight to the pools.
+        static bool &_cache_gone()
+        {
+            thread_local bool gone = false;
+            return gone;
         }
-        void _copy_ref(const shared_ref<T, HolderPolicy> &other)
+
+        static slab_header *_header(std::byte *slot)
         {
+            return reinterpret_cast<slab_header *>(reinterpret_cast<uintptr_t>(slot) & ~uintptr_t(slab_bytes - 1));
+        }
 
-            handler = other.handler;
-            if (handler)
-                handler->weak++;
+        static std::byte *_take()
+        {
+            if (_cache_gone())
+            {
+                auto &p = _pool(_::numa_current_node());
+                std::lock_guard guard(p.lock);
+                return _take_locked(p);
+            }
+            auto &c = _cache();
+            if (c.slots.empty())
+            {
+                auto &p = _pool(c.node);
+                std::lock_guard guard(p.lock);
+                for (size_t i = 0; i < batch; ++i)
+                    c.slots.push_back(_take_locked(p));
+            }
+            auto slot = c.slots.back();
+            c.slots.pop_back();
+            return slot;
         }
-    };
 
-    template <typename T, typename HolderPolicy>
-    struct enable_shared_ref_from_this
-    {
-    private:
-        mutable weak_ref<T, HolderPolicy> _weak_self;
-        friend struct shared_ref<T, HolderPolicy>;
+        static std::byte *_take_locked(pool &p)
+        {
+            if (!p.free.empty())
+            {
+                auto slot = p.free.back();
+                p.free.pop_back();
+                return slot;
+            }
+            if (p.bump == p.bump_end)
+            {
+                auto slab = static_cast<std::byte *>(::operator new(slab_bytes, std::align_val_t(slab_bytes)));
+                // Placement applies to pages on first touch, so set it before the header is written.
+                _::numa_prefer(slab, slab_bytes, p.node);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+                if (_huge_pages().load(std::memory_order_relaxed))
+                    madvise(slab, slab_bytes, MADV_HUGEPAGE);
+#endif
+                new (slab) slab_header{p.node};
+                p.bump = slab + slot_size;
+                p.bump_end = slab + slab_bytes / slot_size * slot_size;
+                p.slabs++;
+            }
+            auto slot = p.bump;
+            p.bump += slot_size;
+            return slot;
+        }
 
-    public:
-        // Build a shared_ref that aliases the one controlling this instance.
-        shared_ref<T, HolderPolicy> shared_from_this()
+        static void _give_back(std::byte *slot)
         {
-            if (auto p = _weak_self.lock())
+            int home = _header(slot)->node;
+            if (!_cache_gone() && _cache().node == home)
             {
-                if (this->_weak_self.handler == nullptr)
-                    throw std::runtime_error("enable_shared_ref_from_this: object is no longer owned by a shared_ref");
-                return p;
+                auto &c = _cache();
+                c.slots.push_back(slot);
+                if (c.slots.size() >= 2 * batch)
+                {
+                    auto &p = _pool(home);
+                    std::lock_guard guard(p.lock);
+                    p.free.insert(p.free.end(), c.slots.end() - batch, c.slots.end());
+                    c.slots.resize(c.slots.size() - batch);
+                }
+                return;
             }
-            throw std::runtime_error("enable_shared_ref_from_this: object is no longer owned by a shared_ref");
+            auto &p = _pool(home);
+            std::lock_guard guard(p.lock);
+            p.free.push_back(slot);
         }
 
-        weak_ref<T, HolderPolicy> weak_from_this() const noexcept { return _weak_self; }
+        // Called by shared_ref/weak_ref when the block of a slab object dies; its object is already destroyed.
+        static void _release_slot(block_type *block)
+        {
+            block->~block_type();
+            _give_back(reinterpret_cast<std::byte *>(block));
+        }
 
-        ~enable_shared_ref_from_this() {}
+        friend struct shared_ref<T, HolderPolicy>;
     };
 
 } // namespace smart_ref
@@ -491,7 +3429,11 @@ namespace smart_ref
     template <class _Tp, class _Up, class TH, class UH>
     inline bool operator<(const shared_ref<_Tp, TH> &__x, const shared_ref<_Up, UH> &__y) noexcept
     {
-        return __x.get() < __y.get();
+        // Relocatable objects may move, so they are ordered by block to keep sets valid across compaction.
+        if constexpr (shared_ref<_Tp, TH>::relocatable && shared_ref<_Up, UH>::relocatable)
+            return static_cast<const void *>(__x.handler) < static_cast<const void *>(__y.handler);
+        else
+            return __x.get() < __y.get();
     }
     template <class _Tp, class _Up, class TH, class UH>
     inline bool operator>(const shared_ref<_Tp, TH> &__x, const shared_ref<_Up, UH> &__y) noexcept
@@ -554,6 +3496,24 @@ namespace std
     template <typename T, typename H>
     struct hash<smart_ref::shared_ref<T, H>>
     {
-        size_t operator()(const smart_ref::shared_ref<T, H> &sha) const { return std::hash<T *>()(sha.get()); }
+        size_t operator()(const smart_ref::shared_ref<T, H> &sha) const
+        {
+            if constexpr (smart_ref::shared_ref<T, H>::relocatable)
+                return std::hash<const void *>()(sha.handler);
+            else
+                return std::hash<T *>()(sha.get());
+        }
+    };
+
+    template <typename T, typename H>
+    struct hash<smart_ref::tagged_ref<T, H>>
+    {
+        size_t operator()(const smart_ref::tagged_ref<T, H> &r) const
+        {
+            if constexpr (smart_ref::shared_ref<T, H>::relocatable)
+                return std::hash<uintptr_t>()(r.bits);
+            else
+                return std::hash<T *>()(r.get()) ^ r.tag();
+        }
     };
 } // namespace std
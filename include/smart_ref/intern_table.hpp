@@ -0,0 +1,455 @@
+/*
+ * Author: Bowen Xu
+ * E-mail: bowenxu.agi@gmail.com
+ *
+ * MIT License
+ *
+ * Copyright (c) 2025 Bowen Xu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include "../smart_ref.hpp"
+
+namespace smart_ref
+{
+    namespace _
+    {
+        // Epoch-based reclamation for lock-free readers: memory unlinked by a writer is freed only after every
+        // reader that may still see it has left its critical section.
+        struct epoch_domain
+        {
+            struct record
+            {
+                std::atomic<uint64_t> epoch{0}; // 0 while the thread is outside any guard
+                std::atomic<bool> in_use{false};
+                unsigned depth = 0;
+                record *next = nullptr;
+            };
+
+            // A thread's record goes back to the pool when the thread exits; records are never freed.
+            struct local_record
+            {
+                record *rec;
+                local_record() : rec(instance().acquire()) {}
+                ~local_record() { rec->in_use.store(false); }
+            };
+
+            std::atomic<uint64_t> global{1};
+            std::atomic<record *> records{nullptr};
+
+            static epoch_domain &instance()
+            {
+                static epoch_domain domain;
+                return domain;
+            }
+
+            static record &local()
+            {
+                thread_local local_record r;
+                return *r.rec;
+            }
+
+            record *acquire()
+            {
+                for (auto r = records.load(); r; r = r->next)
+                {
+                    bool expected = false;
+                    if (!r->in_use.load(std::memory_order_relaxed) && r->in_use.compare_exchange_strong(expected, true))
+                        return r;
+                }
+                auto r = new record();
+                r->in_use.store(true);
+                r->next = records.load();
+                while (!records.compare_exchange_weak(r->next, r))
+                    ;
+                return r;
+            }
+
+            void enter()
+            {
+                auto &r = local();
+                if (r.depth++ == 0)
+                {
+                    r.epoch.store(global.load());
+                    // The announcement must be visible before any shared pointer is read.
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                }
+            }
+
+            void leave()
+            {
+                auto &r = local();
+                if (--r.depth == 0)
+                    r.epoch.store(0);
+            }
+
+            // Move to the next epoch if every active reader has caught up with the current one.
+            uint64_t try_advance()
+            {
+                auto e = global.load();
+                for (auto r = records.load(); r; r = r->next)
+                {
+                    auto re = r->epoch.load();
+                    if (re != 0 && re != e)
+                        return e;
+                }
+                global.compare_exchange_strong(e, e + 1);
+                return global.load();
+            }
+        };
+
+        struct epoch_guard
+        {
+            epoch_guard() { epoch_domain::instance().enter(); }
+            ~epoch_guard() { epoch_domain::instance().leave(); }
+            epoch_guard(const epoch_guard &) = delete;
+            epoch_guard &operator=(const epoch_guard &) = delete;
+        };
+    } // namespace _
+
+    // Concurrent interning table: maps each key to at most one live object, and revives an entry whose object died
+    // while weak_refs to it remain, so those weak_refs see the new object.
+    // Lookups of live entries are lock-free. Inserts and revivals lock one of `Shards` shards, picked by key hash.
+    // The table keeps a weak unit on every entry's block; an entry is dropped once its object is dead and nothing
+    // but the table references the block (checked by shard writers when they grow, or by prune()). Memory unlinked
+    // by a writer is freed by later writers to any shard, or by prune(); a table nobody writes to keeps it until then.
+    // T must use atomic_counts (see ref_traits). Factories passed to intern() run under the shard lock and must not
+    // intern into the same table.
+    template <typename Key, typename T, typename HolderPolicy = nullptr_t, typename Hash = std::hash<Key>,
+              typename KeyEqual = std::equal_to<Key>, size_t Shards = 64>
+    struct intern_table
+    {
+        using key_type = Key;
+        using ref_type = shared_ref<T, HolderPolicy>;
+        using weak_type = weak_ref<T, HolderPolicy>;
+        static_assert(ref_type::block_type::atomic_counts,
+                      "intern_table requires ref_traits<T, HolderPolicy>::atomic_counts");
+        static_assert(Shards > 0 && Shards <= 65536 && (Shards & (Shards - 1)) == 0,
+                      "Shards must be a power of two <= 65536");
+
+    private:
+        struct node
+        {
+            size_t hash;
+            Key key;
+            weak_type ref;
+        };
+
+        struct slot_array
+        {
+            size_t mask;
+            std::unique_ptr<std::atomic<node *>[]> slots;
+
+            explicit slot_array(size_t capacity) : mask(capacity - 1), slots(new std::atomic<node *>[capacity]())
+            {
+            }
+        };
+
+        struct retired
+        {
+            uint64_t epoch;
+            void *p;
+            void (*free)(void *);
+        };
+
+        struct alignas(64) shard
+        {
+            std::mutex mutex;
+            std::atomic<slot_array *> array{nullptr};
+            std::atomic<size_t> count{0}; // entries, dead or alive
+            size_t used = 0;              // entries plus tombstones
+            std::vector<retired> limbo;
+        };
+
+        static constexpr size_t min_capacity = 16;
+
+        std::array<shard, Shards> shards;
+        std::atomic<size_t> limbo_size{0};   // retired entries across all shards
+        std::atomic<uint64_t> swept_epoch{0}; // last epoch in which a writer swept every shard
+        [[no_unique_address]] Hash hasher;
+        [[no_unique_address]] KeyEqual equal;
+
+    public:
+        intern_table() = default;
+        intern_table(const intern_table &) = delete;
+        intern_table &operator=(const intern_table &) = delete;
+
+        // Not thread-safe: no other thread may use the table while it is destroyed.
+        ~intern_table()
+        {
+            for (auto &s : shards)
+            {
+                if (auto a = s.array.load())
+                {
+                    for (size_t i = 0; i <= a->mask; ++i)
+                    {
+                        auto n = a->slots[i].load();
+                        if (n != nullptr && n != _tombstone())
+                            delete n;
+                    }
+                    delete a;
+                }
+                for (auto &r : s.limbo)
+                    r.free(r.p);
+            }
+        }
+
+        // The live object interned under `key`, or an empty ref. Never blocks.
+        ref_type find(const Key &key) const
+        {
+            auto h = _hash(key);
+            _::epoch_guard guard;
+            if (auto n = _find(_shard(h), h, key))
+                return n->ref.lock();
+            return nullptr;
+        }
+
+        // The object interned under `key`. If there is none, or it died, `make()` (returning a new T *) builds one:
+        // a dead entry is revived in place, otherwise a new entry is added.
+        template <typename F>
+        ref_type intern(const Key &key, F &&make)
+        {
+            auto h = _hash(key);
+            auto &s = _shard(h);
+            {
+                _::epoch_guard guard;
+                if (auto n = _find(s, h, key))
+                    if (auto r = n->ref.lock())
+                        return r;
+            }
+
+            std::lock_guard lock(s.mutex);
+            // Memory retired by this shard is only freed under this lock, so no guard is needed from here on.
+            if (auto n = _find(s, h, key))
+                return ref_type::revive_with(n->ref, make);
+            ref_type r(make());
+            if (!r)
+                throw std::runtime_error("intern_table: factory returned nullptr");
+            _insert(s, new node{h, key, r});
+            _reclaim(s);
+            return r;
+        }
+
+        // Stop tracking `key`. The object, if alive, is unaffected. Returns whether an entry was removed.
+        bool erase(const Key &key)
+        {
+            auto h = _hash(key);
+            auto &s = _shard(h);
+            std::lock_guard lock(s.mutex);
+            auto a = s.array.load(std::memory_order_relaxed);
+            if (a == nullptr)
+                return false;
+            for (auto i = h & a->mask;; i = (i + 1) & a->mask)
+            {
+                auto n = a->slots[i].load(std::memory_order_relaxed);
+                if (n == nullptr)
+                    return false;
+                if (n != _tombstone() && n->hash == h && equal(n->key, key))
+                {
+                    a->slots[i].store(_tombstone(), std::memory_order_release);
+                    s.count.fetch_sub(1, std::memory_order_relaxed);
+                    _retire(s, n);
+                    _reclaim(s);
+                    return true;
+                }
+            }
+        }
+
+        // Drop every entry whose object is dead and whose block nobody else references. Returns how many.
+        size_t prune()
+        {
+            size_t dropped = 0;
+            for (auto &s : shards)
+            {
+                std::lock_guard lock(s.mutex);
+                auto a = s.array.load(std::memory_order_relaxed);
+                if (a == nullptr)
+                    continue;
+                for (size_t i = 0; i <= a->mask; ++i)
+                {
+                    auto n = a->slots[i].load(std::memory_order_relaxed);
+                    if (n == nullptr || n == _tombstone() || !_unreferenced(n))
+                        continue;
+                    a->slots[i].store(_tombstone(), std::memory_order_release);
+                    s.count.fetch_sub(1, std::memory_order_relaxed);
+                    _retire(s, n);
+                    dropped++;
+                }
+                _reclaim(s);
+            }
+            return dropped;
+        }
+
+        // Number of entries, including dead ones that can still be revived. Approximate under concurrent writes.
+        size_t size() const
+        {
+            size_t n = 0;
+            for (auto &s : shards)
+                n += s.count.load(std::memory_order_relaxed);
+            return n;
+        }
+
+    private:
+        static node *_tombstone() { return reinterpret_cast<node *>(uintptr_t(1)); }
+
+        // std::hash is the identity for integers: mix it so both the shard and the probe start get good bits.
+        size_t _hash(const Key &key) const
+        {
+            return static_cast<size_t>(uint64_t(hasher(key)) * 0x9E3779B97F4A7C15ull);
+        }
+
+        // Shards take the top bits, probing starts from the low bits.
+        static size_t _shard_index(size_t h)
+        {
+            return (h >> (std::numeric_limits<size_t>::digits - 16)) & (Shards - 1);
+        }
+        shard &_shard(size_t h) { return shards[_shard_index(h)]; }
+        const shard &_shard(size_t h) const { return shards[_shard_index(h)]; }
+
+        node *_find(const shard &s, size_t h, const Key &key) const
+        {
+            auto a = s.array.load(std::memory_order_acquire);
+            if (a == nullptr)
+                return nullptr;
+            for (auto i = h & a->mask;; i = (i + 1) & a->mask)
+            {
+                auto n = a->slots[i].load(std::memory_order_acquire);
+                if (n == nullptr)
+                    return nullptr;
+                if (n != _tombstone() && n->hash == h && equal(n->key, key))
+                    return n;
+            }
+        }
+
+        // Dead, and the table's weak unit is the only one left: nobody can revive it but the table itself.
+        static bool _unreferenced(const node *n) { return n->ref.expired() && n->ref.handler->weak_count() == 1; }
+
+        static void _place(slot_array *a, node *n)
+        {
+            auto i = n->hash & a->mask;
+            while (a->slots[i].load(std::memory_order_relaxed) != nullptr)
+                i = (i + 1) & a->mask;
+            a->slots[i].store(n, std::memory_order_release);
+        }
+
+        void _insert(shard &s, node *n)
+        {
+            auto a = s.array.load(std::memory_order_relaxed);
+            if (a == nullptr || (s.used + 1) * 2 > a->mask + 1)
+                a = _rebuild(s);
+            _place(a, n);
+            s.used++;
+            s.count.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Copy the live entries into a fresh array, dropping tombstones and unreferenced dead entries on the way.
+        // Readers keep using the old array until they see the new one; both are retired through the epoch domain.
+        slot_array *_rebuild(shard &s)
+        {
+            auto old = s.array.load(std::memory_order_relaxed);
+            std::vector<node *> keep;
+            if (old)
+            {
+                for (size_t i = 0; i <= old->mask; ++i)
+                {
+                    auto n = old->slots[i].load(std::memory_order_relaxed);
+                    if (n == nullptr || n == _tombstone())
+                        continue;
+                    if (_unreferenced(n))
+                        _retire(s, n);
+                    else
+                        keep.push_back(n);
+                }
+            }
+            auto capacity = min_capacity;
+            while (capacity < (keep.size() + 1) * 4)
+                capacity *= 2;
+            auto a = new slot_array(capacity);
+            for (auto n : keep)
+                _place(a, n);
+            s.array.store(a, std::memory_order_release);
+            s.used = keep.size();
+            s.count.store(keep.size(), std::memory_order_relaxed);
+            if (old)
+            {
+                s.limbo.push_back({_::epoch_domain::instance().global.load(), old,
+                                   [](void *p) { delete static_cast<slot_array *>(p); }});
+                limbo_size.fetch_add(1, std::memory_order_relaxed);
+            }
+            return a;
+        }
+
+        void _retire(shard &s, node *n)
+        {
+            s.limbo.push_back(
+                {_::epoch_domain::instance().global.load(), n, [](void *p) { delete static_cast<node *>(p); }});
+            limbo_size.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Free what no reader can still see: anything retired two epochs ago. Once per epoch a writer also sweeps
+        // the other shards it can lock without waiting, so a shard that sees no more writes still gets its limbo
+        // freed.
+        void _reclaim(shard &s)
+        {
+            if (limbo_size.load(std::memory_order_relaxed) == 0)
+                return;
+            auto now = _::epoch_domain::instance().try_advance();
+            _free_retired(s, now);
+            auto last = swept_epoch.load(std::memory_order_relaxed);
+            if (last == now || !swept_epoch.compare_exchange_strong(last, now, std::memory_order_relaxed))
+                return;
+            for (auto &other : shards)
+            {
+                if (&other == &s)
+                    continue;
+                std::unique_lock lock(other.mutex, std::try_to_lock);
+                if (lock)
+                    _free_retired(other, now);
+            }
+        }
+
+        // Caller holds the shard's lock.
+        void _free_retired(shard &s, uint64_t now)
+        {
+            auto freed = std::erase_if(s.limbo,
+                                       [now](const retired &r)
+                                       {
+                                           if (r.epoch + 2 > now)
+                                               return false;
+                                           r.free(r.p);
+                                           return true;
+                                       });
+            limbo_size.fetch_sub(freed, std::memory_order_relaxed);
+        }
+    };
+
+} // namespace smart_ref
@@ -0,0 +1,179 @@
+/*
+ * Author: Bowen Xu
+ * E-mail: bowenxu.agi@gmail.com
+ *
+ * MIT License
+ *
+ * Copyright (c) 2025 Bowen Xu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <type_traits>
+#include <utility>
+#include "../smart_ref.hpp"
+
+namespace smart_ref
+{
+    // Checked downcasts without RTTI for single-inheritance hierarchies, in the style of LLVM's isa/dyn_cast. Every
+    // class of the hierarchy derives through ref_typed, which stamps the object with its dynamic type when it is
+    // constructed:
+    //     struct Expr : ref_typed<Expr> { ... };
+    //     struct Call : ref_typed<Call, Expr> { ... };
+    //     struct Method : ref_typed<Method, Call> { ... };
+    //     if (auto call = dyn_ref_cast<Call>(expr)) ...   // shared_ref<Call> sharing expr's block, or empty
+    // The stamp points at a static path of ancestor IDs indexed by depth, so isa<To> is one bounds check and one
+    // compare, however deep the hierarchy. All classes must use the same ref_traits blocks (the default).
+    struct ref_typed_base;
+
+    namespace _
+    {
+        struct ref_type_info
+        {
+            unsigned depth;          // 0 for the root of the hierarchy
+            const void *const *path; // path[d] is the ID of the ancestor at depth d; path[depth] is the type itself
+        };
+
+        template <typename T>
+        struct ref_type_entry
+        {
+            using parent = typename T::ref_parent_type;
+
+            static constexpr char id = 0; // its address is the type ID
+            static constexpr unsigned depth = []
+            {
+                if constexpr (std::is_same_v<parent, ref_typed_base>)
+                    return 0u;
+                else
+                    return ref_type_entry<parent>::depth + 1;
+            }();
+            static constexpr std::array<const void *, depth + 1> path = []
+            {
+                std::array<const void *, depth + 1> p{};
+                if constexpr (depth > 0)
+                    for (unsigned d = 0; d < depth; ++d)
+                        p[d] = ref_type_entry<parent>::path[d];
+                p[depth] = &id;
+                return p;
+            }();
+            static constexpr ref_type_info info{depth, path.data()};
+        };
+
+        template <typename Parent>
+        constexpr bool valid_ref_parent()
+        {
+            if constexpr (std::is_same_v<Parent, ref_typed_base>)
+                return true;
+            else
+                return std::is_same_v<typename Parent::ref_self_type, Parent>;
+        }
+    } // namespace _
+
+    struct ref_typed_base
+    {
+        const _::ref_type_info *ref_type() const { return _ref_type; }
+
+        ref_typed_base() = default;
+        // The stamp belongs to the object, not to its value: copies are stamped by their own constructors.
+        ref_typed_base(const ref_typed_base &) {}
+        ref_typed_base &operator=(const ref_typed_base &) { return *this; }
+
+    private:
+        const _::ref_type_info *_ref_type = nullptr;
+
+        template <typename Self, typename Parent>
+        friend struct ref_typed;
+    };
+
+    // Insert `Self` below `Parent` (another ref_typed class, or ref_typed_base for the root). Constructor arguments
+    // are forwarded to Parent.
+    template <typename Self, typename Parent = ref_typed_base>
+    struct ref_typed : Parent
+    {
+        static_assert(_::valid_ref_parent<Parent>(),
+                      "every class between Self and the root must derive through ref_typed");
+        using ref_parent_type = Parent;
+        using ref_self_type = Self;
+
+        template <typename... Args>
+            requires std::is_constructible_v<Parent, Args...>
+        ref_typed(Args &&...args) : Parent(std::forward<Args>(args)...)
+        {
+            _stamp();
+        }
+        ref_typed(const ref_typed &other) : Parent(other) { _stamp(); }
+        ref_typed(ref_typed &&other) : Parent(std::move(other)) { _stamp(); }
+        ref_typed &operator=(const ref_typed &) = default;
+        ref_typed &operator=(ref_typed &&) = default;
+
+    private:
+        void _stamp() { static_cast<ref_typed_base *>(this)->_ref_type = &_::ref_type_entry<Self>::info; }
+    };
+
+    // Whether `p` (not null) is a To.
+    template <typename To, typename From>
+    bool isa(const From *p)
+    {
+        static_assert(std::is_same_v<typename To::ref_self_type, To>, "To must derive through ref_typed");
+        static_assert(std::is_base_of_v<From, To> || std::is_base_of_v<To, From>, "To and From are unrelated");
+        assert(p != nullptr && "isa on a null pointer");
+        if constexpr (std::is_base_of_v<To, From>)
+            return true;
+        else
+        {
+            constexpr auto depth = _::ref_type_entry<To>::depth;
+            auto type = static_cast<const ref_typed_base *>(p)->ref_type();
+            return type->depth >= depth && type->path[depth] == &_::ref_type_entry<To>::id;
+        }
+    }
+
+    template <typename To, typename From, typename H>
+    bool isa(const shared_ref<From, H> &r)
+    {
+        return isa<To>(r.get());
+    }
+
+    // `p` as a To, or nullptr if it is not one (or is null).
+    template <typename To, typename From>
+    To *dyn_ref_cast(From *p)
+    {
+        return p != nullptr && isa<To>(p) ? static_cast<To *>(p) : nullptr;
+    }
+
+    // A ref to the same object as a To, sharing r's block through the aliasing constructor; empty if it is not one.
+    template <typename To, typename From, typename H>
+    shared_ref<To, H> dyn_ref_cast(const shared_ref<From, H> &r)
+    {
+        if (auto p = r.get(); p != nullptr && isa<To>(p))
+            return shared_ref<To, H>{r, static_cast<To *>(p)};
+        return {};
+    }
+
+    // Like dyn_ref_cast for objects known to be a To; only debug builds check.
+    template <typename To, typename From, typename H>
+    shared_ref<To, H> ref_cast(const shared_ref<From, H> &r)
+    {
+        assert((!r || isa<To>(r.get())) && "ref_cast to a type the object does not have");
+        return shared_ref<To, H>{r, static_cast<To *>(r.get())};
+    }
+} // namespace smart_ref
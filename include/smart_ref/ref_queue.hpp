@@ -0,0 +1,166 @@
+/*
+ * Author: Bowen Xu
+ * E-mail: bowenxu.agi@gmail.com
+ *
+ * MIT License
+ *
+ * Copyright (c) 2025 Bowen Xu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include "../smart_ref.hpp"
+
+namespace smart_ref
+{
+    // Bounded lock-free multi-producer/multi-consumer queue of owned references (Vyukov's array queue). Refs move
+    // through it as ref_tokens, so a hop costs two CASes on the queue and no write to the control block.
+    template <typename T, typename HolderPolicy = nullptr_t>
+    struct ref_queue
+    {
+        using ref_type = shared_ref<T, HolderPolicy>;
+        using token_type = ref_token<T, HolderPolicy>;
+
+    private:
+        struct cell
+        {
+            std::atomic<size_t> seq;
+            token_type token;
+        };
+
+        size_t mask;
+        std::unique_ptr<cell[]> cells;
+        alignas(64) std::atomic<size_t> tail{0}; // next push position
+        alignas(64) std::atomic<size_t> head{0}; // next pop position
+
+    public:
+        // Capacity is rounded up to a power of two.
+        explicit ref_queue(size_t capacity)
+        {
+            size_t n = 2;
+            while (n < capacity)
+                n *= 2;
+            mask = n - 1;
+            cells.reset(new cell[n]);
+            for (size_t i = 0; i < n; ++i)
+                cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+        ref_queue(const ref_queue &) = delete;
+        ref_queue &operator=(const ref_queue &) = delete;
+
+        // Releases the references still queued. No other thread may use the queue meanwhile.
+        ~ref_queue()
+        {
+            token_type token;
+            while (try_pop(token))
+                ref_type::adopt(token);
+        }
+
+        size_t capacity() const { return mask + 1; }
+
+        // Moves `r` into the queue; returns false, leaving `r` untouched, if the queue is full.
+        bool try_push(ref_type &&r)
+        {
+            auto c = _claim_push();
+            if (c == nullptr)
+                return false;
+            _publish_push(c, r.release_raw());
+            return true;
+        }
+
+        bool try_push(token_type token)
+        {
+            auto c = _claim_push();
+            if (c == nullptr)
+                return false;
+            _publish_push(c, token);
+            return true;
+        }
+
+        // Moves the oldest ref into `out` (releasing what `out` held); returns false if the queue is empty.
+        bool try_pop(ref_type &out)
+        {
+            token_type token;
+            if (!try_pop(token))
+                return false;
+            out = ref_type::adopt(token);
+            return true;
+        }
+
+        bool try_pop(token_type &out)
+        {
+            auto pos = head.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                auto &c = cells[pos & mask];
+                auto seq = c.seq.load(std::memory_order_acquire);
+                auto diff = intptr_t(seq) - intptr_t(pos + 1);
+                if (diff == 0)
+                {
+                    if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        out = c.token;
+                        c.seq.store(pos + mask + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                    return false;
+                else
+                    pos = head.load(std::memory_order_relaxed);
+            }
+        }
+
+    private:
+        cell *_claim_push()
+        {
+            auto pos = tail.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                auto &c = cells[pos & mask];
+                auto seq = c.seq.load(std::memory_order_acquire);
+                auto diff = intptr_t(seq) - intptr_t(pos);
+                if (diff == 0)
+                {
+                    if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        return &c;
+                }
+                else if (diff < 0)
+                    return nullptr;
+                else
+                    pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        // The cell's sequence number for a filled cell is its position + 1.
+        void _publish_push(cell *c, token_type token)
+        {
+            auto pos = c->seq.load(std::memory_order_relaxed);
+            c->token = token;
+            c->seq.store(pos + 1, std::memory_order_release);
+        }
+    };
+
+} // namespace smart_ref
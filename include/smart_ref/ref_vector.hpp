@@ -0,0 +1,371 @@
+/*
+ * Author: Bowen Xu
+ * E-mail: bowenxu.agi@gmail.com
+ *
+ * MIT License
+ *
+ * Copyright (c) 2025 Bowen Xu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "../smart_ref.hpp"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace smart_ref
+{
+    // Sequence of owning refs stored as two parallel arrays, object pointers and block pointers, so a pass over the
+    // objects reads nothing but T* (begin()/end() and operator[] hand out raw pointers, at raw-pointer speed) and
+    // counter passes touch only the blocks. Bulk append and erase fill or close the arrays first and then run one
+    // retain or release pass. Entries may be null.
+    template <typename T, typename HolderPolicy>
+    struct ref_vector
+    {
+        using ref_type = shared_ref<T, HolderPolicy>;
+        using handler_type = typename ref_type::handler_type;
+        static_assert(!ref_type::relocatable, "relocatable objects move; a cached object array would go stale");
+
+        ref_vector() = default;
+        ref_vector(const ref_vector &other) : ptrs(other.ptrs), blocks(other.blocks) { _retain(0, size()); }
+        ref_vector(ref_vector &&other) noexcept
+            : ptrs(std::exchange(other.ptrs, {})), blocks(std::exchange(other.blocks, {}))
+        {
+        }
+        ~ref_vector() { clear(); }
+
+        ref_vector &operator=(const ref_vector &other)
+        {
+            if (this != &other)
+                *this = ref_vector(other);
+            return *this;
+        }
+        ref_vector &operator=(ref_vector &&other) noexcept
+        {
+            if (this != &other)
+            {
+                clear();
+                ptrs = std::exchange(other.ptrs, {});
+                blocks = std::exchange(other.blocks, {});
+            }
+            return *this;
+        }
+
+        size_t size() const { return ptrs.size(); }
+        bool empty() const { return ptrs.empty(); }
+        void reserve(size_t n)
+        {
+            ptrs.reserve(n);
+            blocks.reserve(n);
+        }
+
+        // Uncounted access; valid while the entry stays in the vector.
+        T *operator[](size_t i) const { return ptrs[i]; }
+        T *const *begin() const { return ptrs.data(); }
+        T *const *end() const { return ptrs.data() + ptrs.size(); }
+
+        // Counted copy of entry `i`.
+        ref_type ref(size_t i) const
+        {
+            ref_type r;
+            if (blocks[i])
+            {
+                ref_type::_retain(blocks[i], ptrs[i]);
+                r.ptr = ptrs[i];
+                r.handler = blocks[i];
+            }
+            return r;
+        }
+
+        void push_back(const ref_type &r) { push_back(ref_type(r)); }
+        void push_back(ref_type &&r)
+        {
+            _make_room(1);
+            ptrs.push_back(std::exchange(r.ptr, nullptr));
+            blocks.push_back(std::exchange(r.handler, nullptr));
+        }
+
+        // Append counted copies of the refs in [first, last).
+        template <typename It>
+        void append(It first, It last)
+        {
+            auto from = size();
+            _make_room(size_t(std::distance(first, last)));
+            for (; first != last; ++first)
+            {
+                const ref_type &r = *first;
+                ptrs.push_back(r.ptr);
+                blocks.push_back(r.handler);
+            }
+            _retain(from, size());
+        }
+
+        void append(const ref_vector &other)
+        {
+            auto from = size();
+            _make_room(other.size());
+            ptrs.insert(ptrs.end(), other.ptrs.begin(), other.ptrs.end());
+            blocks.insert(blocks.end(), other.blocks.begin(), other.blocks.end());
+            _retain(from, size());
+        }
+
+        // Release entries [first, last) and close the gap.
+        void erase(size_t first, size_t last)
+        {
+            _release(first, last);
+            ptrs.erase(ptrs.begin() + first, ptrs.begin() + last);
+            blocks.erase(blocks.begin() + first, blocks.begin() + last);
+        }
+
+        // Release every entry whose object satisfies `pred(T *)`, keeping the order of the rest. Returns the number
+        // of entries removed.
+        template <typename Pred>
+        size_t erase_if(Pred pred)
+        {
+            size_t kept = 0;
+            for (size_t i = 0; i < size(); ++i)
+            {
+                if (pred(ptrs[i]))
+                    _release(i, i + 1);
+                else
+                {
+                    ptrs[kept] = ptrs[i];
+                    blocks[kept] = blocks[i];
+                    kept++;
+                }
+            }
+            auto removed = size() - kept;
+            ptrs.resize(kept);
+            blocks.resize(kept);
+            return removed;
+        }
+
+        void pop_back() { erase(size() - 1, size()); }
+
+        void clear()
+        {
+            _release(0, size());
+            ptrs.clear();
+            blocks.clear();
+        }
+
+    private:
+        std::vector<T *> ptrs;
+        std::vector<handler_type *> blocks;
+
+        // Grow both arrays together, so the push_backs that follow cannot fail halfway.
+        void _make_room(size_t n)
+        {
+            if (size() + n > blocks.capacity())
+                reserve(std::max(size() + n, 2 * blocks.capacity()));
+        }
+
+        void _retain(size_t first, size_t last)
+        {
+            for (size_t i = first; i < last; ++i)
+                if (blocks[i])
+                    ref_type::_retain(blocks[i], ptrs[i]);
+        }
+
+        void _release(size_t first, size_t last)
+        {
+            for (size_t i = first; i < last; ++i)
+            {
+                auto h = blocks[i];
+                ref_type::_release_handler(h, ptrs[i]);
+            }
+        }
+    };
+
+    // Sequence of weak refs as one dense array of block pointers, with a bulk lock and an expiry scan. For plain
+    // (non-atomic) blocks the scan gathers the blocks' object pointers four at a time with AVX2 when the build
+    // enables it, and is scalar otherwise.
+    template <typename T, typename HolderPolicy = nullptr_t>
+    struct weak_ref_vector
+    {
+        using ref_type = shared_ref<T, HolderPolicy>;
+        using weak_type = weak_ref<T, HolderPolicy>;
+        using block_type = typename weak_type::handler_type;
+
+        // Whether scan_expired gathers four blocks at a time.
+#if defined(__AVX2__)
+        static constexpr bool gather_scan = std::is_base_of_v<_::weak_counts<typename block_type::count_type>, block_type>;
+#else
+        static constexpr bool gather_scan = false;
+#endif
+
+        weak_ref_vector() = default;
+        weak_ref_vector(const weak_ref_vector &other) : blocks(other.blocks)
+        {
+            for (auto b : blocks)
+                if (b)
+                    b->add_weak();
+        }
+        weak_ref_vector(weak_ref_vector &&other) noexcept : blocks(std::exchange(other.blocks, {})) {}
+        ~weak_ref_vector() { clear(); }
+
+        weak_ref_vector &operator=(const weak_ref_vector &other)
+        {
+            if (this != &other)
+                *this = weak_ref_vector(other);
+            return *this;
+        }
+        weak_ref_vector &operator=(weak_ref_vector &&other) noexcept
+        {
+            if (this != &other)
+            {
+                clear();
+                blocks = std::exchange(other.blocks, {});
+            }
+            return *this;
+        }
+
+        size_t size() const { return blocks.size(); }
+        bool empty() const { return blocks.empty(); }
+        void reserve(size_t n) { blocks.reserve(n); }
+
+        void push_back(const ref_type &r) { push_back(weak_type(r)); }
+        void push_back(weak_type w) { blocks.push_back(std::exchange(w.handler, nullptr)); }
+
+        bool expired(size_t i) const { return blocks[i] == nullptr || blocks[i]->expired(); }
+
+        ref_type lock(size_t i) const
+        {
+            auto w = _adopt(blocks[i]);
+            auto r = w.lock();
+            w.handler = nullptr;
+            return r;
+        }
+
+        // Append a ref to every live entry to `out`; returns how many were live.
+        size_t lock_all(ref_vector<T, HolderPolicy> &out) const
+        {
+            size_t n = 0;
+            out.reserve(out.size() + size());
+            for (size_t i = 0; i < size(); ++i)
+                if (auto r = lock(i))
+                {
+                    out.push_back(std::move(r));
+                    n++;
+                }
+            return n;
+        }
+
+        // Set expired[i] to 1 for every expired (or null) entry and 0 otherwise; returns the number expired.
+        size_t scan_expired(std::vector<uint8_t> &expired) const
+        {
+            expired.resize(size());
+            _scan(blocks.data(), size(), expired.data());
+            size_t n = 0;
+            for (auto e : expired)
+                n += e;
+            return n;
+        }
+
+        // Drop the expired entries, keeping the order of the rest. Returns the number dropped. Scans a chunk at a
+        // time, so the blocks it releases are still in cache.
+        size_t compact_expired()
+        {
+            constexpr size_t chunk = 256;
+            uint8_t expired[chunk];
+            size_t kept = 0;
+            for (size_t first = 0; first < size(); first += chunk)
+            {
+                auto n = std::min(chunk, size() - first);
+                _scan(blocks.data() + first, n, expired);
+                for (size_t k = 0; k < n; ++k)
+                {
+                    if (expired[k])
+                        _adopt(blocks[first + k]);
+                    else
+                        blocks[kept++] = blocks[first + k];
+                }
+            }
+            auto removed = size() - kept;
+            blocks.resize(kept);
+            return removed;
+        }
+
+        void erase(size_t first, size_t last)
+        {
+            for (size_t i = first; i < last; ++i)
+                _adopt(blocks[i]);
+            blocks.erase(blocks.begin() + first, blocks.begin() + last);
+        }
+
+        void clear()
+        {
+            for (auto b : blocks)
+                _adopt(b);
+            blocks.clear();
+        }
+
+    private:
+        std::vector<block_type *> blocks;
+
+        // A weak_ref owning the unit held by an entry; it releases the unit when destroyed unless emptied first.
+        static weak_type _adopt(block_type *b)
+        {
+            weak_type w;
+            w.handler = b;
+            return w;
+        }
+
+        static void _scan(block_type *const *b, size_t n, uint8_t *out)
+        {
+            size_t i = 0;
+#if defined(__AVX2__)
+            // Plain blocks are expired exactly when their object pointer is null, so four of them can be tested with
+            // one gather; null entries are masked out of the gather and read as expired.
+            if constexpr (gather_scan)
+            {
+                auto first = std::find_if(b, b + n, [](auto p) { return p != nullptr; });
+                if (first != b + n)
+                {
+                    auto offset = reinterpret_cast<const std::byte *>(&(*first)->ptr) -
+                                  reinterpret_cast<const std::byte *>(*first);
+                    const auto zero = _mm256_setzero_si256();
+                    const auto shift = _mm256_set1_epi64x(offset);
+                    for (; i + 4 <= n; i += 4)
+                    {
+                        auto addrs = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+                        auto present = _mm256_xor_si256(_mm256_cmpeq_epi64(addrs, zero), _mm256_set1_epi64x(-1));
+                        auto fields_at = _mm256_add_epi64(addrs, shift);
+                        auto fields = _mm256_mask_i64gather_epi64(zero, static_cast<const long long *>(nullptr),
+                                                                  fields_at, present, 1);
+                        auto dead = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(fields, zero)));
+                        for (int k = 0; k < 4; ++k)
+                            out[i + k] = uint8_t((dead >> k) & 1);
+                    }
+                }
+            }
+#endif
+            for (; i < n; ++i)
+                out[i] = b[i] == nullptr || b[i]->expired();
+        }
+    };
+} // namespace smart_ref
@@ -0,0 +1,234 @@
+/*
+ * Author: Bowen Xu
+ * E-mail: bowenxu.agi@gmail.com
+ *
+ * MIT License
+ *
+ * Copyright (c) 2025 Bowen Xu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+#include "../smart_ref.hpp"
+
+namespace smart_ref
+{
+    // Slab heap for relocatable types (ref_traits<T, HolderPolicy>::relocatable). make() places objects in slots of
+    // large slabs; compact() moves live objects out of the emptiest slabs into the fullest ones, repointing each
+    // object's block once, and frees the slabs it emptied (on Linux slabs are mapped directly, so freeing one hands
+    // its pages back to the OS). T must be move constructible. Refs, ref_views and weighted_refs stay valid across
+    // compact(), as they dereference through the block, but raw pointers taken before it do not; run it at a point
+    // where nobody else dereferences objects of the heap. The heap must outlive its objects.
+    template <typename T, typename HolderPolicy>
+    struct relocatable_heap
+    {
+        using ref_type = shared_ref<T, HolderPolicy>;
+        using block_type = typename ref_type::block_type;
+        static_assert(ref_type::relocatable, "T must opt into ref_traits<T, HolderPolicy>::relocatable");
+
+        static constexpr size_t slab_bytes = 256 * 1024;
+
+    private:
+        using slot = _::relocation_slot<T>;
+
+        struct slab
+        {
+            static constexpr size_t capacity = std::max<size_t>(1, slab_bytes / sizeof(slot));
+
+            relocatable_heap *heap;
+            slot *slots;
+            size_t used = 0; // slots ever handed out; [used, capacity) is untouched
+            size_t live = 0;
+            _::relocation_header *free_list = nullptr; // linked through header.block
+
+            explicit slab(relocatable_heap *h) : heap(h), slots(static_cast<slot *>(_map(capacity * sizeof(slot)))) {}
+            slab(const slab &) = delete;
+            ~slab() { _unmap(slots, capacity * sizeof(slot)); }
+
+            bool full() const { return live == capacity; }
+
+            slot *take()
+            {
+                slot *s;
+                if (free_list != nullptr)
+                {
+                    s = reinterpret_cast<slot *>(free_list);
+                    free_list = static_cast<_::relocation_header *>(free_list->block);
+                }
+                else
+                    s = &slots[used++];
+                s->header = {this, nullptr, &relocatable_heap::_free};
+                live++;
+                return s;
+            }
+
+            void give_back(slot *s)
+            {
+                s->header.slab = nullptr;
+                s->header.block = free_list;
+                free_list = &s->header;
+                live--;
+            }
+        };
+
+        std::recursive_mutex lock; // destructors run under it may release more objects of this heap
+        std::vector<std::unique_ptr<slab>> slabs;
+        bool compacting = false;
+
+    public:
+        relocatable_heap() = default;
+        relocatable_heap(const relocatable_heap &) = delete;
+        relocatable_heap &operator=(const relocatable_heap &) = delete;
+        ~relocatable_heap() { assert(size() == 0 && "relocatable_heap destroyed while objects are alive"); }
+
+        template <typename... Args>
+        ref_type make(Args &&...args)
+        {
+            std::lock_guard guard(lock);
+            auto it = std::find_if(slabs.rbegin(), slabs.rend(), [](auto &s) { return !s->full(); });
+            slab *target;
+            if (it == slabs.rend())
+            {
+                slabs.push_back(std::make_unique<slab>(this));
+                target = slabs.back().get();
+            }
+            else
+                target = it->get();
+            auto s = target->take();
+            T *p;
+            try
+            {
+                p = new (s->storage) T(std::forward<Args>(args)...);
+            }
+            catch (...)
+            {
+                target->give_back(s);
+                throw;
+            }
+            auto block = new block_type();
+            s->header.block = block;
+            ref_type::_init_block(block, p);
+            ref_type r;
+            r.ptr = p;
+            r.handler = block;
+            return r;
+        }
+
+        // Move live objects into as few slabs as possible and free the rest. Returns the number of objects moved.
+        size_t compact()
+        {
+            std::lock_guard guard(lock);
+            compacting = true;
+            std::sort(slabs.begin(), slabs.end(), [](auto &a, auto &b) { return a->live > b->live; });
+            size_t moved = 0;
+            size_t dst = 0;
+            for (size_t src = slabs.size(); src-- > dst + 1;)
+            {
+                auto from = slabs[src].get();
+                for (size_t k = 0; k < from->used && from->live > 0; ++k)
+                {
+                    auto old_slot = &from->slots[k];
+                    if (old_slot->header.slab == nullptr)
+                        continue;
+                    while (dst < src && slabs[dst]->full())
+                        dst++;
+                    if (dst == src)
+                        break;
+                    auto new_slot = slabs[dst]->take();
+                    auto block = static_cast<block_type *>(old_slot->header.block);
+                    auto p = new (new_slot->storage) T(std::move(*old_slot->object()));
+                    new_slot->header.block = block;
+                    block->ptr = p;
+                    if constexpr (std::is_base_of_v<enable_shared_ref_from_this<T, HolderPolicy>, T>)
+                        ref_type::_bind_self(p, block);
+                    old_slot->object()->~T();
+                    from->give_back(old_slot);
+                    moved++;
+                }
+            }
+            compacting = false;
+            std::erase_if(slabs, [](auto &s) { return s->live == 0; });
+            return moved;
+        }
+
+        size_t size()
+        {
+            std::lock_guard guard(lock);
+            size_t n = 0;
+            for (auto &s : slabs)
+                n += s->live;
+            return n;
+        }
+
+        size_t slab_count()
+        {
+            std::lock_guard guard(lock);
+            return slabs.size();
+        }
+
+    private:
+        // A malloc'd slab of this size would usually be mapped too, but the allocator may keep it cached after free.
+        static void *_map(size_t bytes)
+        {
+#if defined(__linux__)
+            if constexpr (alignof(slot) <= 4096)
+            {
+                void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (p == MAP_FAILED)
+                    throw std::bad_alloc();
+                return p;
+            }
+#endif
+            return ::operator new(bytes, std::align_val_t(alignof(slot)));
+        }
+
+        static void _unmap(void *p, size_t bytes)
+        {
+#if defined(__linux__)
+            if constexpr (alignof(slot) <= 4096)
+            {
+                munmap(p, bytes);
+                return;
+            }
+#endif
+            (void)bytes;
+            ::operator delete(p, std::align_val_t(alignof(slot)));
+        }
+
+        static void _free(void *owner, _::relocation_header *header)
+        {
+            auto from = static_cast<slab *>(owner);
+            auto heap = from->heap;
+            std::lock_guard guard(heap->lock);
+            from->give_back(reinterpret_cast<slot *>(header));
+            // Keep one slab around so alternating make/release does not map and unmap every time.
+            if (from->live == 0 && !heap->compacting && heap->slabs.size() > 1)
+                std::erase_if(heap->slabs, [from](auto &s) { return s.get() == from; });
+        }
+    };
+
+} // namespace smart_ref
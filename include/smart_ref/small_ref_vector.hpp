@@ -0,0 +1,276 @@
+/*
+ * Author: Bowen Xu
+ * E-mail: bowenxu.agi@gmail.com
+ *
+ * MIT License
+ *
+ * Copyright (c) 2025 Bowen Xu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "../smart_ref.hpp"
+#include "ref_cast.hpp"
+
+namespace smart_ref
+{
+    namespace _
+    {
+        // The ref a visitor sees for an element of type Ref.
+        template <typename Ref>
+        struct strong_ref_of
+        {
+            using type = Ref;
+            static constexpr bool weak = false;
+        };
+
+        template <typename T, typename H>
+        struct strong_ref_of<weak_ref<T, H>>
+        {
+            using type = shared_ref<T, H>;
+            static constexpr bool weak = true;
+        };
+    } // namespace _
+
+    // Edge list of shared_refs or weak_refs that keeps its first N elements inside the owning object and moves to the
+    // heap only beyond that, so the common node with a handful of edges costs no allocation and no extra pointer
+    // chase. Growing moves the refs, which never touches their blocks.
+    template <typename Ref, size_t N>
+    struct small_ref_vector
+    {
+        static_assert(N > 0, "use ref_vector or std::vector for edge lists without inline storage");
+        using value_type = Ref;
+        using element_type = typename Ref::element_type;
+        static constexpr bool weak = _::strong_ref_of<Ref>::weak;
+        using strong_type = typename _::strong_ref_of<Ref>::type;
+
+        small_ref_vector() = default;
+        small_ref_vector(std::initializer_list<Ref> refs)
+        {
+            reserve(refs.size());
+            for (auto &r : refs)
+                push_back(r);
+        }
+        small_ref_vector(const small_ref_vector &other)
+        {
+            reserve(other.size());
+            for (auto &r : other)
+                push_back(r);
+        }
+        small_ref_vector(small_ref_vector &&other) noexcept { _take(other); }
+        ~small_ref_vector()
+        {
+            clear();
+            _free();
+        }
+
+        small_ref_vector &operator=(const small_ref_vector &other)
+        {
+            if (this != &other)
+                *this = small_ref_vector(other);
+            return *this;
+        }
+        small_ref_vector &operator=(small_ref_vector &&other) noexcept
+        {
+            if (this != &other)
+            {
+                clear();
+                _free();
+                _take(other);
+            }
+            return *this;
+        }
+
+        size_t size() const { return _size; }
+        size_t capacity() const { return _capacity; }
+        bool empty() const { return _size == 0; }
+        // Whether the elements still live in the inline buffer.
+        bool is_inline() const { return _data == _inline_data(); }
+
+        Ref &operator[](size_t i) { return _data[i]; }
+        const Ref &operator[](size_t i) const { return _data[i]; }
+        Ref *begin() { return _data; }
+        Ref *end() { return _data + _size; }
+        const Ref *begin() const { return _data; }
+        const Ref *end() const { return _data + _size; }
+
+        void reserve(size_t n)
+        {
+            if (n > _capacity)
+                _grow(n);
+        }
+
+        void push_back(const Ref &r)
+        {
+            if (_size == _capacity)
+                emplace_back(Ref(r)); // r may be one of ours, and growing moves it
+            else
+                emplace_back(r);
+        }
+        void push_back(Ref &&r) { emplace_back(std::move(r)); }
+
+        template <typename... Args>
+        Ref &emplace_back(Args &&...args)
+        {
+            if (_size == _capacity)
+                _grow(std::max<size_t>(2 * _capacity, 1));
+            auto r = new (_data + _size) Ref(std::forward<Args>(args)...);
+            _size++;
+            return *r;
+        }
+
+        void pop_back() { _data[--_size].~Ref(); }
+
+        // Remove element `i`, keeping the order of the rest.
+        void erase(size_t i)
+        {
+            std::move(_data + i + 1, _data + _size, _data + i);
+            pop_back();
+        }
+
+        // Remove every element satisfying `pred(const Ref &)`, keeping the order of the rest. Returns the number
+        // removed.
+        template <typename Pred>
+        size_t erase_if(Pred pred)
+        {
+            auto kept = std::remove_if(begin(), end(), pred);
+            auto removed = size_t(end() - kept);
+            std::destroy(kept, end());
+            _size -= uint32_t(removed);
+            return removed;
+        }
+
+        void clear()
+        {
+            std::destroy(begin(), end());
+            _size = 0;
+        }
+
+        // Drop the weak refs whose object is gone. Returns the number dropped.
+        size_t compact_expired()
+            requires weak
+        {
+            return erase_if([](const Ref &w) { return w.expired(); });
+        }
+
+        // Append a strong ref to every live element to `out` (anything with push_back); returns how many were live.
+        template <typename Out>
+        size_t lock_all(Out &out) const
+        {
+            size_t n = 0;
+            for (auto &r : *this)
+            {
+                if constexpr (weak)
+                {
+                    if (auto s = r.lock())
+                    {
+                        out.push_back(std::move(s));
+                        n++;
+                    }
+                }
+                else if (r)
+                {
+                    out.push_back(r);
+                    n++;
+                }
+            }
+            return n;
+        }
+
+        // Call `f(const strong_type &)` for every live element (weak refs are locked for the duration of the call).
+        template <typename F>
+        void visit(F &&f) const
+        {
+            for (auto &r : *this)
+            {
+                if constexpr (weak)
+                {
+                    if (auto s = r.lock())
+                        f(s);
+                }
+                else if (r)
+                    f(r);
+            }
+        }
+
+        // Per-type edge visitor: call `f(shared_ref<To, H>)` for every live element whose object is a To (see
+        // ref_cast.hpp).
+        template <typename To, typename F>
+        void visit(F &&f) const
+        {
+            visit([&](const strong_type &s) {
+                if (auto t = dyn_ref_cast<To>(s))
+                    f(t);
+            });
+        }
+
+    private:
+        Ref *_data = _inline_data();
+        uint32_t _size = 0;
+        uint32_t _capacity = N;
+        alignas(Ref) std::byte _inline[N * sizeof(Ref)];
+
+        Ref *_inline_data() const { return reinterpret_cast<Ref *>(const_cast<std::byte *>(_inline)); }
+
+        void _grow(size_t n)
+        {
+            auto fresh = static_cast<Ref *>(::operator new(n * sizeof(Ref), std::align_val_t(alignof(Ref))));
+            std::uninitialized_move(begin(), end(), fresh);
+            std::destroy(begin(), end());
+            _free();
+            _data = fresh;
+            _capacity = uint32_t(n);
+        }
+
+        void _free()
+        {
+            if (!is_inline())
+                ::operator delete(_data, std::align_val_t(alignof(Ref)));
+            _data = _inline_data();
+            _capacity = N;
+        }
+
+        // Steal other's heap buffer, or move its inline elements over; `other` is left empty and inline.
+        void _take(small_ref_vector &other)
+        {
+            if (other.is_inline())
+            {
+                std::uninitialized_move(other.begin(), other.end(), _data);
+                _size = other._size;
+                other.clear();
+            }
+            else
+            {
+                _data = std::exchange(other._data, other._inline_data());
+                _size = std::exchange(other._size, 0);
+                _capacity = std::exchange(other._capacity, uint32_t(N));
+            }
+        }
+    };
+} // namespace smart_ref
@@ -624,3 +624,2660 @@ TEST(SharedFromThis, SharedFromThisThrowsAfterReset)
 
     EXPECT_THROW(raw->shared_from_this(), std::runtime_error);
 }
+
+struct DyingSelf : enable_shared_ref_from_this<DyingSelf>
+{
+    inline static weak_ref<DyingSelf> captured;
+    ~DyingSelf() { captured = weak_from_this(); }
+};
+
+TEST(SharedFromThis, WeakFromThisInDestructorIsExpired)
+{
+    shared_ref<DyingSelf> p(new DyingSelf());
+    p.reset();
+    EXPECT_TRUE(DyingSelf::captured.expired());
+    EXPECT_FALSE(DyingSelf::captured.lock());
+    DyingSelf::captured = nullptr;
+}
+
+// A child holding a weak back pointer to its parent: the parent's destructor drops the block's last weak unit.
+template <typename P, typename H>
+struct BackChild
+{
+    weak_ref<P, H> parent;
+};
+
+struct PlainParent
+{
+    shared_ref<BackChild<PlainParent, nullptr_t>> child;
+};
+
+struct SelfParent : enable_shared_ref_from_this<SelfParent>
+{
+    shared_ref<BackChild<SelfParent, nullptr_t>> child;
+};
+
+struct HeldParent : enable_ref_holder
+{
+    shared_ref<BackChild<HeldParent, TestHolderPolicy>> child;
+};
+
+template <typename P, typename H>
+void check_weak_back_pointer(H *holder = nullptr)
+{
+    shared_ref<P, H> p(new P());
+    if constexpr (!std::is_same_v<H, nullptr_t>)
+        p.set_holder(holder);
+    p->child = shared_ref<BackChild<P, H>>(new BackChild<P, H>{p});
+    EXPECT_EQ(p->child->parent.lock(), p);
+    p.reset();
+}
+
+TEST(SharedFromThis, ParentDiesWithChildsWeakBackPointer)
+{
+    check_weak_back_pointer<PlainParent, nullptr_t>();
+    check_weak_back_pointer<SelfParent, nullptr_t>();
+    TestHolderPolicy holder;
+    check_weak_back_pointer<HeldParent>(&holder);
+    EXPECT_TRUE(holder.held_handlers.empty());
+}
+
+// ----------------------
+// 14. multiple holders
+// ----------------------
+
+TEST(HolderPolicy, TwoHoldersBothTracked)
+{
+    TestHolderPolicy h1, h2;
+    void *h = nullptr;
+    {
+        shared_ref<Obj, TestHolderPolicy> p(new Obj(1));
+        p.set_holder(&h1);
+        p.set_holder(&h2);
+        h = p.handler;
+
+        EXPECT_TRUE(h1.holds(h));
+        EXPECT_TRUE(h2.holds(h));
+        EXPECT_EQ(p.handler->holder, &h1);
+    }
+    EXPECT_FALSE(h1.holds(h));
+    EXPECT_FALSE(h2.holds(h));
+}
+
+TEST(HolderPolicy, ManyHoldersSpillAndUnhold)
+{
+    TestHolderPolicy holders[5];
+    weak_ref<Obj, TestHolderPolicy> w;
+    void *h = nullptr;
+    {
+        shared_ref<Obj, TestHolderPolicy> p(new Obj(1));
+        for (auto &holder : holders)
+            p.set_holder(&holder);
+        h = p.handler;
+        w = p;
+        for (auto &holder : holders)
+            EXPECT_TRUE(p.handler->has_holder(&holder));
+    }
+    for (auto &holder : holders)
+        EXPECT_TRUE(holder.holds(h)) << "Holders are kept while weak refs remain";
+    w = nullptr;
+    for (auto &holder : holders)
+        EXPECT_FALSE(holder.holds(h));
+}
+
+TEST(HolderPolicy, RemoveHolderSkipsUnhold)
+{
+    TestHolderPolicy h1, h2, h3;
+    void *h = nullptr;
+    {
+        shared_ref<Obj, TestHolderPolicy> p(new Obj(1));
+        p.set_holder(&h1);
+        p.set_holder(&h2);
+        p.set_holder(&h3);
+        h = p.handler;
+
+        EXPECT_TRUE(p.remove_holder(&h1));
+        EXPECT_FALSE(p.remove_holder(&h1));
+        EXPECT_EQ(p.handler->holder, &h2);
+        EXPECT_FALSE(p.handler->has_holder(&h1));
+        EXPECT_TRUE(p.handler->has_holder(&h3));
+    }
+    EXPECT_TRUE(h1.holds(h)) << "A removed holder is not notified";
+    EXPECT_FALSE(h2.holds(h));
+    EXPECT_FALSE(h3.holds(h));
+}
+
+TEST(HolderPolicy, SetHolderNullptrDetachesAll)
+{
+    TestHolderPolicy h1, h2;
+    void *h = nullptr;
+    {
+        shared_ref<Obj, TestHolderPolicy> p(new Obj(1));
+        p.set_holder(&h1);
+        p.set_holder(&h2);
+        h = p.handler;
+        p.set_holder(nullptr);
+        EXPECT_EQ(p.handler->holder, nullptr);
+    }
+    EXPECT_TRUE(h1.holds(h));
+    EXPECT_TRUE(h2.holds(h));
+}
+
+// ----------------------
+// 15. intrusive holder list
+// ----------------------
+
+struct ListObj;
+struct ListHolder;
+
+template <>
+struct smart_ref::ref_traits<ListObj, ListHolder> : smart_ref::default_ref_traits<ListObj, ListHolder>
+{
+    static constexpr bool intrusive_holder = true;
+};
+
+struct ListObj : enable_ref_holder
+{
+    int value;
+    ListObj(int v) : value(v) {}
+};
+
+struct ListHolder : intrusive_ref_holder<ListObj, ListHolder>
+{
+    int unheld = 0;
+    static void unhold_ref(void *self, void *) { static_cast<ListHolder *>(self)->unheld++; }
+};
+
+TEST(IntrusiveHolder, MembersAreLinkedInOrder)
+{
+    using Ref = shared_ref<ListObj, ListHolder>;
+    ListHolder holder;
+    Ref a(new ListObj(1)), b(new ListObj(2)), c(new ListObj(3));
+    a.set_holder(&holder);
+    b.set_holder(&holder);
+    c.set_holder(&holder);
+    b.set_holder(&holder); // already linked
+
+    std::vector<int> values;
+    for (auto *h : holder)
+        values.push_back(static_cast<ListObj *>(h->ptr)->value);
+    EXPECT_EQ(values, (std::vector<int>{1, 2, 3}));
+    EXPECT_EQ(holder.size(), 3u);
+
+    b = nullptr;
+    EXPECT_EQ(holder.size(), 2u);
+    EXPECT_EQ(holder.unheld, 1);
+    EXPECT_EQ(static_cast<ListObj *>((*holder.begin())->ptr)->value, 1);
+}
+
+TEST(IntrusiveHolder, WeakRefKeepsMembership)
+{
+    using Ref = shared_ref<ListObj, ListHolder>;
+    using WRef = weak_ref<ListObj, ListHolder>;
+    ListHolder holder;
+    WRef w;
+    {
+        Ref a(new ListObj(1));
+        a.set_holder(&holder);
+        w = a;
+    }
+    ASSERT_EQ(holder.size(), 1u);
+    EXPECT_EQ((*holder.begin())->ptr, nullptr);
+    w = nullptr;
+    EXPECT_TRUE(holder.empty());
+    EXPECT_EQ(holder.unheld, 1);
+}
+
+TEST(IntrusiveHolder, OneHolderPerBlock)
+{
+    using Ref = shared_ref<ListObj, ListHolder>;
+    ListHolder h1, h2;
+    Ref a(new ListObj(1));
+    a.set_holder(&h1);
+    EXPECT_THROW(a.set_holder(&h2), std::runtime_error);
+
+    EXPECT_TRUE(a.remove_holder(&h1));
+    EXPECT_TRUE(h1.empty());
+    a.set_holder(&h2);
+    EXPECT_EQ(h2.size(), 1u);
+    a = nullptr;
+    EXPECT_EQ(h1.unheld, 0);
+    EXPECT_EQ(h2.unheld, 1);
+}
+
+TEST(IntrusiveHolder, HolderDestructionDetachesMembers)
+{
+    using Ref = shared_ref<ListObj, ListHolder>;
+    Ref a(new ListObj(1));
+    {
+        ListHolder holder;
+        a.set_holder(&holder);
+    }
+    EXPECT_EQ(a.handler->holder, nullptr);
+    EXPECT_FALSE(a.handler->linked());
+}
+
+TEST(IntrusiveHolder, BlockGrowsOnlyForOptIn)
+{
+    EXPECT_EQ(sizeof(shared_ref<ListObj, ListHolder>::handler_type),
+              sizeof(shared_ref<Obj, TestHolderPolicy>::handler_type) + sizeof(void *));
+}
+
+// ----------------------
+// 16. control-block layouts
+// ----------------------
+
+struct SmallFanout
+{
+    int value;
+    SmallFanout(int v) : value(v) {}
+};
+
+struct StrongOnly : enable_ref_holder
+{
+    inline static int alive = 0;
+    StrongOnly() { alive++; }
+    ~StrongOnly() { alive--; }
+};
+
+template <>
+struct smart_ref::ref_traits<SmallFanout, nullptr_t> : smart_ref::default_ref_traits<SmallFanout, nullptr_t>
+{
+    using count_type = uint16_t;
+};
+
+template <typename H>
+struct smart_ref::ref_traits<StrongOnly, H> : smart_ref::default_ref_traits<StrongOnly, H>
+{
+    static constexpr bool weak_refs = false;
+};
+
+TEST(BlockLayout, NullHolderPolicyDropsHolderSlots)
+{
+    EXPECT_EQ(sizeof(shared_ref<int>::handler_type), sizeof(void *) + 2 * sizeof(uint32_t));
+    EXPECT_LT(sizeof(shared_ref<int>::handler_type), sizeof(shared_ref<Obj, TestHolderPolicy>::handler_type));
+
+    shared_ref<int> p(new int(3));
+    weak_ref<int> w = p;
+    EXPECT_EQ(p.handler->strong, 1u);
+    EXPECT_EQ(p.handler->weak, 1u);
+    p = nullptr;
+    EXPECT_TRUE(w.expired());
+}
+
+TEST(BlockLayout, SixteenBitCounters)
+{
+    using Ref = shared_ref<SmallFanout>;
+    static_assert(std::is_same_v<Ref::handler_type::count_type, uint16_t>);
+
+    Ref p(new SmallFanout(1));
+    std::vector<Ref> copies(1000, p);
+    EXPECT_EQ(p.handler->strong, 1001);
+    copies.clear();
+    weak_ref<SmallFanout> w = p;
+    EXPECT_EQ(p.handler->weak, 1);
+    EXPECT_EQ(w.lock()->value, 1);
+}
+
+TEST(BlockLayoutDeathTest, SixteenBitOverflowAborts)
+{
+    auto overflow = []
+    {
+        shared_ref<SmallFanout> p(new SmallFanout(1));
+        std::vector<shared_ref<SmallFanout>> copies(40000, p);
+    };
+    EXPECT_DEATH(overflow(), "reference count overflow");
+}
+
+TEST(BlockLayout, StrongOnlyBlock)
+{
+    using Ref = shared_ref<StrongOnly>;
+    EXPECT_EQ(sizeof(Ref::handler_type), sizeof(uint32_t));
+    {
+        Ref p(new StrongOnly());
+        Ref q = p;
+        EXPECT_EQ(p.handler->strong, 2u);
+        EXPECT_EQ(StrongOnly::alive, 1);
+    }
+    EXPECT_EQ(StrongOnly::alive, 0);
+}
+
+TEST(BlockLayout, StrongOnlyBlockKeepsHolders)
+{
+    using Ref = shared_ref<StrongOnly, TestHolderPolicy>;
+    EXPECT_EQ(sizeof(Ref::handler_type), 3 * sizeof(void *));
+    TestHolderPolicy holder;
+    void *h = nullptr;
+    {
+        Ref p(new StrongOnly());
+        p.set_holder(&holder);
+        h = p.handler;
+        EXPECT_TRUE(holder.holds(h));
+    }
+    EXPECT_FALSE(holder.holds(h));
+    EXPECT_EQ(StrongOnly::alive, 0);
+}
+
+struct LeftBase
+{
+    int l = 1;
+    virtual ~LeftBase() = default;
+};
+
+struct RightBase
+{
+    inline static int destroyed = 0;
+    int r = 2;
+    virtual ~RightBase() { destroyed++; }
+};
+
+struct BothBases : LeftBase, RightBase
+{
+};
+
+TEST(BlockLayout, LastRefThroughOffsetBaseDeletesWholeObject)
+{
+    shared_ref<RightBase> right;
+    {
+        shared_ref<BothBases> both(new BothBases());
+        right = std::static_pointer_cast<RightBase>(both);
+        ASSERT_NE(static_cast<void *>(right.get()), static_cast<void *>(both.get()));
+    }
+    EXPECT_EQ(RightBase::destroyed, 0);
+    right = nullptr;
+    EXPECT_EQ(RightBase::destroyed, 1);
+}
+
+TEST(SmartRefWeak, ReassignReleasesPreviousBlock)
+{
+    shared_ref<Obj, TestHolderPolicy> a(new Obj(1)), b(new Obj(2));
+    weak_ref<Obj, TestHolderPolicy> w = a;
+    EXPECT_EQ(a.handler->weak, 1u);
+    w = b;
+    EXPECT_EQ(a.handler->weak, 0u);
+    EXPECT_EQ(b.handler->weak, 1u);
+}
+
+// ----------------------
+// 17. lazily allocated control block
+// ----------------------
+
+struct LazyObj;
+struct LazySelf;
+
+template <typename H>
+struct smart_ref::ref_traits<LazyObj, H> : smart_ref::default_ref_traits<LazyObj, H>
+{
+    static constexpr bool lazy_block = true;
+};
+
+template <>
+struct smart_ref::ref_traits<LazySelf, nullptr_t> : smart_ref::default_ref_traits<LazySelf, nullptr_t>
+{
+    static constexpr bool lazy_block = true;
+};
+
+struct LazyObj : enable_lazy_ref_block<LazyObj, TestHolderPolicy>, enable_ref_holder
+{
+    inline static int alive = 0;
+    int value;
+    LazyObj(int v) : value(v) { alive++; }
+    ~LazyObj() { alive--; }
+};
+
+struct LazySelf : enable_lazy_ref_block<LazySelf>, enable_shared_ref_from_this<LazySelf>
+{
+    int value = 7;
+};
+
+// Lazy blocks are tracked by their side block, which set_holder allocates before calling hold_ref.
+struct LazyHolderPolicy : TestHolderPolicy
+{
+    static void hold_ref(void *self, const shared_ref<LazyObj, LazyHolderPolicy> &x)
+    {
+        static_cast<LazyHolderPolicy *>(self)->held_handlers.insert(x.handler->side());
+    }
+};
+
+TEST(LazyBlock, StrongRefsNeedNoBlock)
+{
+    using Ref = shared_ref<LazyObj, TestHolderPolicy>;
+    static_assert(sizeof(Ref::handler_type) == sizeof(uintptr_t));
+    {
+        Ref a(new LazyObj(1));
+        Ref b = a;
+        EXPECT_EQ(a.handler, static_cast<Ref::handler_type *>(a.get()));
+        EXPECT_EQ(a.handler->side(), nullptr);
+        EXPECT_EQ(a.handler->strong_count(), 2u);
+        b = nullptr;
+        EXPECT_EQ(a.handler->strong_count(), 1u);
+    }
+    EXPECT_EQ(LazyObj::alive, 0);
+}
+
+TEST(LazyBlock, RawPointerReacquiresSameOwner)
+{
+    using Ref = shared_ref<LazyObj, TestHolderPolicy>;
+    Ref a(new LazyObj(1));
+    Ref b(a.get());
+    EXPECT_EQ(a.handler->strong_count(), 2u);
+}
+
+TEST(LazyBlock, WeakRefAllocatesSideBlock)
+{
+    using Ref = shared_ref<LazyObj, TestHolderPolicy>;
+    using WRef = weak_ref<LazyObj, TestHolderPolicy>;
+    WRef w;
+    {
+        Ref a(new LazyObj(5));
+        Ref b = a;
+        w = a;
+        auto side = a.handler->side();
+        ASSERT_NE(side, nullptr);
+        EXPECT_EQ(w.handler, side);
+        EXPECT_EQ(side->strong, 2u);
+        EXPECT_EQ(side->weak, 1u);
+
+        auto c = w.lock();
+        EXPECT_EQ(c.handler, a.handler);
+        EXPECT_EQ(c->value, 5);
+        EXPECT_EQ(side->strong, 3u);
+    }
+    EXPECT_EQ(LazyObj::alive, 0);
+    EXPECT_TRUE(w.expired());
+    EXPECT_FALSE(w.lock());
+}
+
+TEST(LazyBlock, ReviveAttachesSideBlock)
+{
+    using Ref = shared_ref<LazyObj, TestHolderPolicy>;
+    using WRef = weak_ref<LazyObj, TestHolderPolicy>;
+    Ref a(new LazyObj(1));
+    WRef w = a;
+    a = nullptr;
+    ASSERT_TRUE(w.expired());
+
+    auto r = Ref::revive(new LazyObj(2), w.handler);
+    EXPECT_EQ(r.handler->side(), w.handler);
+    EXPECT_EQ(w.lock()->value, 2);
+    r = nullptr;
+    EXPECT_EQ(LazyObj::alive, 0);
+}
+
+TEST(LazyBlock, SetHolderAllocatesSideBlock)
+{
+    using Ref = shared_ref<LazyObj, LazyHolderPolicy>;
+    LazyHolderPolicy holder;
+    void *side = nullptr;
+    {
+        Ref a(new LazyObj(1));
+        a.set_holder(&holder);
+        side = a.handler->side();
+        ASSERT_NE(side, nullptr);
+        EXPECT_TRUE(holder.holds(side));
+        EXPECT_EQ(a.handler->side()->holder, &holder);
+    }
+    EXPECT_FALSE(holder.holds(side));
+    EXPECT_EQ(LazyObj::alive, 0);
+}
+
+TEST(LazyBlock, SharedFromThisWithoutSelfReference)
+{
+    shared_ref<LazySelf> a(new LazySelf());
+    auto b = a->shared_from_this();
+    EXPECT_EQ(a.handler, b.handler);
+    EXPECT_EQ(a.handler->strong_count(), 2u);
+    EXPECT_EQ(a.handler->side(), nullptr);
+
+    auto w = a->weak_from_this();
+    EXPECT_NE(a.handler->side(), nullptr);
+    EXPECT_EQ(w.lock()->value, 7);
+
+    LazySelf unowned;
+    EXPECT_THROW(unowned.shared_from_this(), std::runtime_error);
+    EXPECT_TRUE(unowned.weak_from_this().expired());
+}
+
+// ----------------------
+// 18. uncounted self reference
+// ----------------------
+
+TEST(SharedFromThis, SelfReferenceIsAFlagNotAWeakCount)
+{
+    auto p = shared_ref<SelfObj, TestHolderPolicy>(new SelfObj(1));
+    EXPECT_TRUE(p.handler->has_self());
+    EXPECT_EQ(p.handler->weak_count(), 0u);
+
+    auto w = p->weak_from_this();
+    EXPECT_EQ(p.handler->weak_count(), 1u);
+    w = nullptr;
+    EXPECT_EQ(p.handler->weak_count(), 0u);
+
+    auto q = p->shared_from_this();
+    EXPECT_EQ(p.handler->strong, 2u);
+}
+
+TEST(SharedFromThis, DeathWithWeakRefsClearsSelfFlag)
+{
+    TestHolderPolicy holder;
+    weak_ref<SelfObj, TestHolderPolicy> w;
+    void *h = nullptr;
+    {
+        auto p = shared_ref<SelfObj, TestHolderPolicy>(new SelfObj(1));
+        p.set_holder(&holder);
+        w = p->weak_from_this();
+        h = p.handler;
+    }
+    ASSERT_TRUE(w.expired());
+    EXPECT_FALSE(w.handler->has_self());
+    EXPECT_EQ(w.handler->weak, 1u);
+    EXPECT_TRUE(holder.holds(h));
+    w = nullptr;
+    EXPECT_FALSE(holder.holds(h));
+}
+
+TEST(SharedFromThis, DeathWithoutWeakRefsUnholdsImmediately)
+{
+    TestHolderPolicy holder;
+    void *h = nullptr;
+    {
+        auto p = shared_ref<SelfObj, TestHolderPolicy>(new SelfObj(1));
+        p.set_holder(&holder);
+        h = p.handler;
+    }
+    EXPECT_FALSE(holder.holds(h));
+}
+
+TEST(SharedFromThis, CopiedObjectStartsUnowned)
+{
+    auto p = shared_ref<SelfObj, TestHolderPolicy>(new SelfObj(3));
+    SelfObj copy = *p;
+    EXPECT_THROW(copy.shared_from_this(), std::runtime_error);
+    EXPECT_TRUE(copy.weak_from_this().expired());
+}
+
+// ----------------------
+// 19. revive with enable_shared_ref_from_this
+// ----------------------
+
+struct CountedSelf : enable_shared_ref_from_this<CountedSelf, TestHolderPolicy>, enable_ref_holder
+{
+    inline static int alive = 0;
+    int x;
+    CountedSelf(int x) : x(x) { alive++; }
+    ~CountedSelf() { alive--; }
+};
+
+TEST(SmartRefRevive, RevivedObjectCanShareFromThis)
+{
+    using Ref = shared_ref<CountedSelf, TestHolderPolicy>;
+    Ref r(new CountedSelf(0));
+    weak_ref<CountedSelf, TestHolderPolicy> w = r;
+    r = nullptr;
+
+    auto revived = Ref::revive(new CountedSelf(1), w);
+    EXPECT_TRUE(w.handler->has_self());
+    auto self = revived->shared_from_this();
+    EXPECT_EQ(self.handler, w.handler);
+    EXPECT_EQ(self->x, 1);
+    EXPECT_EQ(revived->weak_from_this().handler, w.handler);
+}
+
+TEST(SmartRefRevive, ReviveLoopDoesNotLeak)
+{
+    using Ref = shared_ref<CountedSelf, TestHolderPolicy>;
+    TestHolderPolicy holder;
+    weak_ref<CountedSelf, TestHolderPolicy> w;
+    {
+        Ref r(new CountedSelf(0));
+        r.set_holder(&holder);
+        w = r;
+    }
+    auto *block = w.handler;
+    for (int i = 1; i <= 1000; ++i)
+    {
+        auto r = Ref::revive(new CountedSelf(i), w);
+        auto self = r->shared_from_this();
+        ASSERT_EQ(self->x, i);
+        ASSERT_EQ(block->strong, 2u);
+        ASSERT_EQ(block->weak_count(), 1u);
+        ASSERT_EQ(CountedSelf::alive, 1);
+        r = nullptr;
+        self = nullptr;
+        ASSERT_EQ(CountedSelf::alive, 0);
+        ASSERT_EQ(w.handler, block);
+        ASSERT_TRUE(w.expired());
+        ASSERT_FALSE(block->has_self());
+    }
+    EXPECT_TRUE(holder.holds(block));
+    w = nullptr;
+    EXPECT_FALSE(holder.holds(block));
+}
+
+// ----------------------
+// 20. atomic counts and concurrent revive
+// ----------------------
+
+#include <atomic>
+#include <thread>
+
+struct AtomicObj;
+struct AtomicSelf;
+
+template <typename H>
+struct smart_ref::ref_traits<AtomicObj, H> : smart_ref::default_ref_traits<AtomicObj, H>
+{
+    static constexpr bool atomic_counts = true;
+};
+
+template <>
+struct smart_ref::ref_traits<AtomicSelf, nullptr_t> : smart_ref::default_ref_traits<AtomicSelf, nullptr_t>
+{
+    static constexpr bool atomic_counts = true;
+};
+
+struct AtomicObj : enable_ref_holder
+{
+    static constexpr int magic = 0x5eed;
+    inline static std::atomic<int> alive = 0;
+    int check = magic;
+    int value;
+    AtomicObj(int v) : value(v) { alive++; }
+    ~AtomicObj()
+    {
+        check = 0;
+        alive--;
+    }
+};
+
+struct AtomicSelf : enable_shared_ref_from_this<AtomicSelf>
+{
+};
+
+TEST(AtomicRevive, ReviveOfLiveBlockReturnsExistingObject)
+{
+    using Ref = shared_ref<AtomicObj, TestHolderPolicy>;
+    Ref r(new AtomicObj(1));
+    weak_ref<AtomicObj, TestHolderPolicy> w = r;
+
+    auto again = Ref::revive(new AtomicObj(2), w);
+    EXPECT_EQ(again.get(), r.get());
+    EXPECT_EQ(again->value, 1);
+    EXPECT_EQ(AtomicObj::alive, 1);
+
+    r = nullptr;
+    again = nullptr;
+    EXPECT_TRUE(w.expired());
+    EXPECT_EQ(AtomicObj::alive, 0);
+
+    int calls = 0;
+    auto revived = Ref::revive_with(w,
+                                    [&]
+                                    {
+                                        calls++;
+                                        return new AtomicObj(3);
+                                    });
+    auto other = Ref::revive_with(w,
+                                  [&]
+                                  {
+                                      calls++;
+                                      return new AtomicObj(4);
+                                  });
+    EXPECT_EQ(calls, 1);
+    EXPECT_EQ(other.get(), revived.get());
+    EXPECT_EQ(w.lock()->value, 3);
+}
+
+TEST(AtomicRevive, FailedFactoryLeavesBlockRevivable)
+{
+    using Ref = shared_ref<AtomicObj, TestHolderPolicy>;
+    Ref r(new AtomicObj(1));
+    weak_ref<AtomicObj, TestHolderPolicy> w = r;
+    r = nullptr;
+
+    EXPECT_THROW(Ref::revive_with(w, []() -> AtomicObj * { throw std::runtime_error("no"); }), std::runtime_error);
+    EXPECT_THROW(Ref::revive_with(w, []() -> AtomicObj * { return nullptr; }), std::runtime_error);
+    EXPECT_TRUE(w.expired());
+    EXPECT_EQ(Ref::revive(new AtomicObj(2), w)->value, 2);
+}
+
+TEST(AtomicRevive, SelfReferenceSurvivesRevive)
+{
+    using Ref = shared_ref<AtomicSelf>;
+    Ref r(new AtomicSelf());
+    weak_ref<AtomicSelf> w = r;
+    r = nullptr;
+    auto revived = Ref::revive(new AtomicSelf(), w);
+    EXPECT_EQ(revived->shared_from_this().handler, w.handler);
+    EXPECT_EQ(revived->weak_from_this().handler, w.handler);
+}
+
+TEST(AtomicRevive, RacingRevivesAgreeOnOneObject)
+{
+    using Ref = shared_ref<AtomicObj, TestHolderPolicy>;
+    weak_ref<AtomicObj, TestHolderPolicy> w = Ref(new AtomicObj(0));
+    ASSERT_TRUE(w.expired());
+
+    constexpr int threads = 8;
+    std::vector<Ref> results(threads);
+    std::atomic<bool> go = false;
+    std::vector<std::thread> pool;
+    for (int i = 0; i < threads; ++i)
+        pool.emplace_back(
+            [&, i]
+            {
+                while (!go)
+                    std::this_thread::yield();
+                results[i] = Ref::revive(new AtomicObj(i + 1), w);
+            });
+    go = true;
+    for (auto &t : pool)
+        t.join();
+
+    for (auto &r : results)
+    {
+        ASSERT_TRUE(r);
+        EXPECT_EQ(r.get(), results[0].get());
+    }
+    EXPECT_EQ(AtomicObj::alive, 1);
+    results.clear();
+    EXPECT_EQ(AtomicObj::alive, 0);
+}
+
+TEST(AtomicRevive, ReviveRacesWithLockAndRelease)
+{
+    using Ref = shared_ref<AtomicObj, TestHolderPolicy>;
+    weak_ref<AtomicObj, TestHolderPolicy> w = Ref(new AtomicObj(0));
+    std::atomic<int> torn = 0;
+
+    std::vector<std::thread> pool;
+    for (int i = 0; i < 4; ++i)
+        pool.emplace_back(
+            [&, i]
+            {
+                for (int n = 0; n < 2000; ++n)
+                {
+                    if (auto r = (n + i) % 2 ? w.lock() : Ref::revive_with(w, [n] { return new AtomicObj(n); }))
+                    {
+                        if (r->check != AtomicObj::magic)
+                            torn++;
+                    }
+                }
+            });
+    for (auto &t : pool)
+        t.join();
+
+    EXPECT_EQ(torn, 0);
+    EXPECT_TRUE(w.expired());
+    EXPECT_EQ(AtomicObj::alive, 0);
+}
+
+// ----------------------
+// 21. intern_table
+// ----------------------
+
+#include <smart_ref/intern_table.hpp>
+
+using AtomicTable = intern_table<int, AtomicObj, TestHolderPolicy>;
+
+TEST(InternTable, InternReturnsTheSameLiveObject)
+{
+    AtomicTable table;
+    int calls = 0;
+    auto make = [&]
+    {
+        calls++;
+        return new AtomicObj(7);
+    };
+    auto a = table.intern(7, make);
+    auto b = table.intern(7, make);
+    EXPECT_EQ(a.get(), b.get());
+    EXPECT_EQ(calls, 1);
+    EXPECT_EQ(table.find(7).get(), a.get());
+    EXPECT_FALSE(table.find(8));
+    EXPECT_EQ(table.size(), 1u);
+}
+
+TEST(InternTable, DeadEntryIsRevivedForExistingWeakRefs)
+{
+    AtomicTable table;
+    auto a = table.intern(1, [] { return new AtomicObj(1); });
+    weak_ref<AtomicObj, TestHolderPolicy> w = a;
+    auto block = a.handler;
+    a = nullptr;
+    EXPECT_FALSE(table.find(1));
+    EXPECT_EQ(AtomicObj::alive, 0);
+
+    auto b = table.intern(1, [] { return new AtomicObj(2); });
+    EXPECT_EQ(b.handler, block);
+    EXPECT_EQ(w.lock()->value, 2);
+}
+
+TEST(InternTable, PruneDropsUnreferencedDeadEntries)
+{
+    AtomicTable table;
+    auto kept = table.intern(1, [] { return new AtomicObj(1); });
+    weak_ref<AtomicObj, TestHolderPolicy> w = table.intern(2, [] { return new AtomicObj(2); });
+    table.intern(3, [] { return new AtomicObj(3); });
+    EXPECT_EQ(table.size(), 3u);
+
+    EXPECT_EQ(table.prune(), 1u); // 2 is still weakly referenced
+    EXPECT_EQ(table.size(), 2u);
+    EXPECT_TRUE(table.erase(2));
+    EXPECT_FALSE(table.erase(2));
+    EXPECT_EQ(table.size(), 1u);
+    EXPECT_EQ(table.find(1).get(), kept.get());
+}
+
+TEST(InternTable, ManyKeysSurviveGrowth)
+{
+    AtomicTable table;
+    std::vector<AtomicTable::ref_type> refs;
+    for (int i = 0; i < 5000; ++i)
+        refs.push_back(table.intern(i, [i] { return new AtomicObj(i); }));
+    for (int i = 0; i < 5000; ++i)
+        ASSERT_EQ(table.find(i).get(), refs[i].get());
+    refs.clear();
+    EXPECT_EQ(AtomicObj::alive, 0);
+    EXPECT_EQ(table.prune(), 5000u);
+}
+
+TEST(InternTable, ConcurrentInternAgreesOnOneObjectPerKey)
+{
+    AtomicTable table;
+    constexpr int threads = 8, keys = 200;
+    std::vector<std::vector<AtomicTable::ref_type>> seen(threads);
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; ++t)
+        pool.emplace_back(
+            [&, t]
+            {
+                for (int round = 0; round < 3; ++round)
+                {
+                    std::vector<AtomicTable::ref_type> held;
+                    for (int k = 0; k < keys; ++k)
+                        held.push_back(table.intern((k * 7 + t) % keys, [k] { return new AtomicObj(k); }));
+                    if (round == 2)
+                        seen[t] = held;
+                }
+            });
+    for (auto &th : pool)
+        th.join();
+
+    for (int t = 0; t < threads; ++t)
+        for (int k = 0; k < keys; ++k)
+            EXPECT_EQ(seen[t][k].get(), table.find((k * 7 + t) % keys).get());
+    seen.clear();
+    EXPECT_EQ(AtomicObj::alive, 0);
+}
+
+// Keys that share a token, so a test can tell when the table has freed its copy.
+struct TokenKey
+{
+    std::shared_ptr<int> token;
+};
+struct TokenHash
+{
+    size_t operator()(const TokenKey &k) const { return std::hash<int>()(*k.token); }
+};
+struct TokenEqual
+{
+    bool operator()(const TokenKey &a, const TokenKey &b) const { return *a.token == *b.token; }
+};
+
+TEST(InternTable, WritersToOtherShardsFreeRetiredEntries)
+{
+    intern_table<TokenKey, AtomicObj, TestHolderPolicy, TokenHash, TokenEqual> table;
+    auto token = std::make_shared<int>(0);
+    table.intern(TokenKey{token}, [] { return new AtomicObj(0); });
+    EXPECT_TRUE(table.erase(TokenKey{token}));
+    EXPECT_GT(token.use_count(), 1); // retired, not freed yet
+
+    // Key 0 hashes to shard 0 (shards take the top 16 bits of the mixed hash); write only to the others.
+    int writes = 0;
+    for (int i = 1; writes < 8; ++i)
+    {
+        if (((uint64_t(std::hash<int>()(i)) * 0x9E3779B97F4A7C15ull) >> 48) % 64 == 0)
+            continue;
+        table.intern(TokenKey{std::make_shared<int>(i)}, [i] { return new AtomicObj(i); });
+        writes++;
+    }
+    EXPECT_EQ(token.use_count(), 1);
+}
+
+// ----------------------
+// 22. lock fast path
+// ----------------------
+
+TEST(WeakRefLock, FailedLockLeavesCountsUntouched)
+{
+    shared_ref<int> p(new int(1));
+    weak_ref<int> w = p;
+    auto block = w.handler;
+    p = nullptr;
+    auto weak_before = block->weak;
+    EXPECT_FALSE(w.lock());
+    EXPECT_EQ(block->strong, 0u);
+    EXPECT_EQ(block->weak, weak_before);
+}
+
+TEST(WeakRefLock, TryLockIntoReusesTheTargetRef)
+{
+    shared_ref<int> a(new int(1));
+    shared_ref<int> b(new int(2));
+    weak_ref<int> wa = a;
+    weak_ref<int> wb = b;
+
+    shared_ref<int> out = b;
+    EXPECT_TRUE(wa.try_lock_into(out));
+    EXPECT_EQ(*out, 1);
+    EXPECT_EQ(a.handler->strong, 2u);
+    EXPECT_EQ(b.handler->strong, 1u);
+
+    EXPECT_TRUE(wa.try_lock_into(out)); // already there: no counter change
+    EXPECT_EQ(a.handler->strong, 2u);
+
+    b = nullptr;
+    EXPECT_FALSE(wb.try_lock_into(out));
+    EXPECT_EQ(*out, 1);
+    EXPECT_FALSE(weak_ref<int>().try_lock_into(out));
+    EXPECT_EQ(*out, 1);
+}
+
+TEST(WeakRefLock, TryLockIntoLazyBlock)
+{
+    shared_ref<LazyObj, TestHolderPolicy> a(new LazyObj(1));
+    weak_ref<LazyObj, TestHolderPolicy> w = a;
+    shared_ref<LazyObj, TestHolderPolicy> out;
+    EXPECT_TRUE(w.try_lock_into(out));
+    EXPECT_EQ(out.get(), a.get());
+    EXPECT_EQ(a.handler->strong_count(), 2u);
+    EXPECT_TRUE(w.try_lock_into(out));
+    EXPECT_EQ(a.handler->strong_count(), 2u);
+    out = nullptr;
+    a = nullptr;
+    EXPECT_FALSE(w.try_lock_into(out));
+    EXPECT_EQ(LazyObj::alive, 0);
+}
+
+TEST(WeakRefLock, LockRacesWithLastRelease)
+{
+    using Ref = shared_ref<AtomicObj, TestHolderPolicy>;
+    for (int round = 0; round < 200; ++round)
+    {
+        Ref owner(new AtomicObj(round));
+        weak_ref<AtomicObj, TestHolderPolicy> w = owner;
+        std::atomic<int> torn = 0;
+        std::thread locker(
+            [&]
+            {
+                Ref cur;
+                for (int i = 0; i < 100; ++i)
+                    if (w.try_lock_into(cur) && cur->check != AtomicObj::magic)
+                        torn++;
+            });
+        owner = nullptr;
+        locker.join();
+        EXPECT_EQ(torn, 0);
+        EXPECT_TRUE(w.expired());
+    }
+    EXPECT_EQ(AtomicObj::alive, 0);
+}
+
+// ----------------------
+// 23. ref_view
+// ----------------------
+
+using ObjView = ref_view<Obj, TestHolderPolicy>;
+
+static int read_through_view(ObjView v) { return v->value; }
+
+TEST(RefView, BorrowsWithoutCounting)
+{
+    shared_ref<Obj, TestHolderPolicy> p(new Obj(5));
+    ObjView v = p;
+    EXPECT_EQ(p.handler->strong, 1u);
+    EXPECT_EQ(read_through_view(p), 5);
+    EXPECT_EQ(v.get(), p.get());
+    EXPECT_EQ((*v).value, 5);
+    EXPECT_TRUE(v);
+    EXPECT_FALSE(ObjView());
+    if (ObjView::checked)
+        EXPECT_EQ(p.handler->weak_count(), 1u);
+    else
+        EXPECT_EQ(sizeof(v), 2 * sizeof(void *));
+}
+
+TEST(RefView, PromoteRetains)
+{
+    shared_ref<Obj, TestHolderPolicy> kept;
+    {
+        shared_ref<Obj, TestHolderPolicy> p(new Obj(6));
+        ObjView v = p;
+        kept = v.promote();
+        EXPECT_EQ(p.handler->strong, 2u);
+    }
+    EXPECT_EQ(kept->value, 6);
+    EXPECT_EQ(kept.handler->strong, 1u);
+    EXPECT_FALSE(ObjView().promote());
+}
+
+TEST(RefView, ViewFromThis)
+{
+    shared_ref<SelfObj, TestHolderPolicy> p(new SelfObj(1));
+    auto v = p->view_from_this();
+    EXPECT_EQ(v.get(), p.get());
+    EXPECT_EQ(p.handler->strong, 1u);
+    EXPECT_EQ(v.promote().handler, p.handler);
+
+    shared_ref<LazySelf> lazy(new LazySelf());
+    auto lv = lazy->view_from_this();
+    EXPECT_EQ(lv.get(), lazy.get());
+    EXPECT_EQ(lazy.handler->strong_count(), 1u);
+
+    SelfObj unowned(2);
+    EXPECT_THROW(unowned.view_from_this(), std::runtime_error);
+}
+
+#if SMART_REF_DEBUG_VIEWS
+TEST(RefViewDeathTest, UseAfterObjectDeathAsserts)
+{
+    auto use_after_death = []
+    {
+        shared_ref<Obj, TestHolderPolicy> p(new Obj(1));
+        ObjView v = p;
+        p = nullptr;
+        return v->value;
+    };
+    EXPECT_DEATH(use_after_death(), "ref_view used after its object died");
+}
+#endif
+
+// ----------------------
+// 24. immortal refs
+// ----------------------
+
+using ObjRef = shared_ref<Obj, TestHolderPolicy>;
+using ObjWeak = weak_ref<Obj, TestHolderPolicy>;
+
+static Obj static_obj(42);
+constinit static_ref_block<Obj, TestHolderPolicy> static_obj_block{&static_obj};
+constinit ObjRef static_obj_ref{&static_obj, static_obj_block};
+
+TEST(ImmortalRef, StaticRefNeedsNoHeapBlock)
+{
+    EXPECT_TRUE(static_obj_ref.immortal());
+    EXPECT_EQ(static_obj_ref->value, 42);
+    auto strong = static_obj_block.strong;
+    {
+        auto copy = static_obj_ref;
+        ObjRef other;
+        other = copy;
+        EXPECT_EQ(static_obj_block.strong, strong);
+    }
+    EXPECT_EQ(static_obj_block.strong, strong);
+
+    ObjWeak w = static_obj_ref;
+    EXPECT_EQ(w.lock().get(), &static_obj);
+    w = nullptr;
+    EXPECT_FALSE(ObjWeak(static_obj_ref).expired());
+}
+
+TEST(ImmortalRef, MakeImmortalStopsCounting)
+{
+    auto *obj = new Obj(1);
+    ObjWeak w;
+    {
+        ObjRef p(obj);
+        w = p;
+        EXPECT_FALSE(p.immortal());
+        p.make_immortal();
+        EXPECT_TRUE(p.immortal());
+        auto strong = p.handler->strong;
+        auto q = p;
+        q = nullptr;
+        EXPECT_EQ(p.handler->strong, strong);
+    }
+    EXPECT_FALSE(w.expired());
+    EXPECT_EQ(w.lock()->value, 1);
+    EXPECT_THROW(ObjRef().make_immortal(), std::runtime_error);
+
+    // Immortal objects are never destroyed; free them by hand to keep leak checkers quiet.
+    auto block = w.handler;
+    w = nullptr;
+    delete obj;
+    delete block;
+}
+
+TEST(ImmortalRef, AtomicCopiesAcrossThreads)
+{
+    shared_ref<AtomicObj, TestHolderPolicy> root(new AtomicObj(0));
+    root.make_immortal();
+    auto strong = root.handler->strong.load();
+    std::vector<std::thread> pool;
+    for (int t = 0; t < 4; ++t)
+        pool.emplace_back(
+            [&]
+            {
+                weak_ref<AtomicObj, TestHolderPolicy> w = root;
+                for (int i = 0; i < 10000; ++i)
+                {
+                    auto copy = root;
+                    ASSERT_TRUE(w.lock());
+                }
+            });
+    for (auto &t : pool)
+        t.join();
+    EXPECT_EQ(root.handler->strong.load(), strong);
+    EXPECT_FALSE(root.handler->expired());
+
+    auto block = root.handler;
+    auto obj = root.get();
+    root.handler = nullptr;
+    delete obj;
+    delete block;
+}
+
+// ----------------------
+// 25. sharded strong counters
+// ----------------------
+
+struct HotObj;
+
+template <typename H>
+struct smart_ref::ref_traits<HotObj, H> : smart_ref::default_ref_traits<HotObj, H>
+{
+    static constexpr bool atomic_counts = true;
+    static constexpr unsigned count_shards = 8;
+};
+
+struct HotObj : enable_shared_ref_from_this<HotObj, TestHolderPolicy>, enable_ref_holder
+{
+    inline static std::atomic<int> alive = 0;
+    HotObj() { alive++; }
+    ~HotObj() { alive--; }
+};
+
+TEST(ShardedCounts, PinKeepsTheObjectUntilReleased)
+{
+    using Ref = shared_ref<HotObj, TestHolderPolicy>;
+    using Block = Ref::block_type;
+    weak_ref<HotObj, TestHolderPolicy> w;
+    ref_pin<HotObj, TestHolderPolicy> pin;
+    {
+        Ref owner(new HotObj());
+        EXPECT_FALSE(owner.handler->pinned());
+        w = owner;
+        pin = owner.pin();
+        ASSERT_TRUE(pin);
+        EXPECT_TRUE(owner.handler->pinned());
+        EXPECT_FALSE(owner.pin()); // already pinned
+        auto copy = owner;
+        EXPECT_EQ(owner.handler->strong, Block::fold_bias + 1); // creating ref + pin; copies count in shards
+    }
+    EXPECT_EQ(HotObj::alive, 1);
+    auto again = w.lock();
+    ASSERT_TRUE(again);
+    pin.release();
+    EXPECT_FALSE(again.handler->pinned());
+    EXPECT_EQ(again.handler->strong, 1u);
+    pin.release(); // no-op
+    EXPECT_EQ(HotObj::alive, 1);
+    again = nullptr;
+    EXPECT_EQ(HotObj::alive, 0);
+    EXPECT_TRUE(w.expired());
+}
+
+TEST(ShardedCounts, UnpinnedObjectDiesWithItsLastRef)
+{
+    using Ref = shared_ref<HotObj, TestHolderPolicy>;
+    weak_ref<HotObj, TestHolderPolicy> w;
+    {
+        Ref owner(new HotObj());
+        w = owner;
+        auto copy = owner;
+        {
+            auto pin = copy.pin();
+            auto hot = owner;
+        }
+        EXPECT_EQ(owner.handler->strong, 2u);
+    }
+    EXPECT_EQ(HotObj::alive, 0);
+    EXPECT_TRUE(w.expired());
+}
+
+TEST(ShardedCounts, UnpinRacesWithRetainAndRelease)
+{
+    using Ref = shared_ref<HotObj, TestHolderPolicy>;
+    for (int round = 0; round < 50; ++round)
+    {
+        Ref owner(new HotObj());
+        std::atomic<bool> go = false;
+        std::vector<std::thread> pool;
+        for (int t = 0; t < 4; ++t)
+            pool.emplace_back(
+                [&, local = owner]
+                {
+                    while (!go)
+                        std::this_thread::yield();
+                    for (int i = 0; i < 500; ++i)
+                    {
+                        auto copy = local;
+                        auto self = copy->shared_from_this();
+                    }
+                });
+        go = true;
+        for (int k = 0; k < 3; ++k)
+        {
+            auto pin = owner.pin();
+            std::this_thread::yield();
+        }
+        owner = nullptr;
+        for (auto &t : pool)
+            t.join();
+        EXPECT_EQ(HotObj::alive, 0);
+    }
+}
+
+TEST(ShardedCounts, PinAndReleaseRaceAcrossThreads)
+{
+    using Ref = shared_ref<HotObj, TestHolderPolicy>;
+    for (int round = 0; round < 20; ++round)
+    {
+        Ref owner(new HotObj());
+        std::atomic<bool> go = false;
+        std::vector<std::thread> pool;
+        for (int t = 0; t < 4; ++t)
+            pool.emplace_back(
+                [&, local = owner]
+                {
+                    while (!go)
+                        std::this_thread::yield();
+                    for (int i = 0; i < 300; ++i)
+                    {
+                        auto pin = local.pin(); // empty while another thread's pin is live
+                        auto copy = local;
+                        pin.release();
+                        auto self = copy->shared_from_this();
+                    }
+                });
+        go = true;
+        for (auto &t : pool)
+            t.join();
+        EXPECT_FALSE(owner.handler->pinned());
+        EXPECT_EQ(owner.handler->strong, 1u); // no count lost or left over in a shard
+        owner = nullptr;
+        EXPECT_EQ(HotObj::alive, 0);
+    }
+}
+
+// ----------------------
+// 26. deferred count changes
+// ----------------------
+
+struct DeferredObj;
+
+template <typename H>
+struct smart_ref::ref_traits<DeferredObj, H> : smart_ref::default_ref_traits<DeferredObj, H>
+{
+    static constexpr bool deferred_counts = true;
+};
+
+struct DeferredObj : enable_ref_holder
+{
+    inline static int alive = 0;
+    shared_ref<DeferredObj, TestHolderPolicy> child;
+    DeferredObj() { alive++; }
+    ~DeferredObj() { alive--; }
+};
+
+using DeferredRef = shared_ref<DeferredObj, TestHolderPolicy>;
+
+TEST(DeferredCounts, CopiesAndReleasesApplyAtFlush)
+{
+    TestHolderPolicy holder;
+    weak_ref<DeferredObj, TestHolderPolicy> w;
+    void *block = nullptr;
+    {
+        DeferredRef p(new DeferredObj());
+        p.set_holder(&holder);
+        w = p;
+        block = p.handler;
+        for (int i = 0; i < 1000; ++i)
+        {
+            DeferredRef copy = p;
+            DeferredRef other;
+            other = copy;
+        }
+        EXPECT_EQ(p.handler->strong, 1u);
+    }
+    // The last release is only logged: the object lives until the safepoint.
+    EXPECT_EQ(DeferredObj::alive, 1);
+    EXPECT_FALSE(w.expired());
+    flush_deferred();
+    EXPECT_EQ(DeferredObj::alive, 0);
+    EXPECT_TRUE(w.expired());
+    w = nullptr;
+    EXPECT_FALSE(holder.holds(block));
+}
+
+TEST(DeferredCounts, LockAfterLoggedReleaseKeepsObject)
+{
+    weak_ref<DeferredObj, TestHolderPolicy> w;
+    {
+        DeferredRef p(new DeferredObj());
+        w = p;
+    }
+    auto again = w.lock();
+    flush_deferred();
+    EXPECT_EQ(DeferredObj::alive, 1);
+    again = nullptr;
+    flush_deferred();
+    EXPECT_EQ(DeferredObj::alive, 0);
+}
+
+TEST(DeferredCounts, FlushDestroysWholeChains)
+{
+    {
+        DeferredRef head(new DeferredObj());
+        auto cur = head;
+        for (int i = 0; i < 10; ++i)
+        {
+            cur->child = DeferredRef(new DeferredObj());
+            cur = cur->child;
+        }
+    }
+    EXPECT_EQ(DeferredObj::alive, 11);
+    flush_deferred();
+    EXPECT_EQ(DeferredObj::alive, 0);
+}
+
+TEST(DeferredCounts, FullBufferFlushesItself)
+{
+    for (int i = 0; i < 1000; ++i)
+        DeferredRef(new DeferredObj());
+    EXPECT_LT(DeferredObj::alive, 256);
+    flush_deferred();
+    EXPECT_EQ(DeferredObj::alive, 0);
+}
+
+// ----------------------
+// 27. ownership transfer tokens and ref_queue
+// ----------------------
+
+#include <smart_ref/ref_queue.hpp>
+
+TEST(OwnershipTransfer, MoveLeavesCountsAlone)
+{
+    auto p = shared_ref<Obj>(new Obj(1));
+    auto block = p.handler;
+    auto q = std::move(p);
+    EXPECT_EQ(p.handler, nullptr);
+    EXPECT_EQ(q.handler, block);
+    EXPECT_EQ(block->strong, 1u);
+
+    auto r = shared_ref<Obj>(new Obj(2));
+    r = std::move(q);
+    EXPECT_EQ(r.handler, block);
+    EXPECT_EQ(block->strong, 1u);
+    EXPECT_EQ(r->value, 1);
+}
+
+TEST(OwnershipTransfer, ReleaseRawThenAdopt)
+{
+    auto p = shared_ref<Obj>(new Obj(7));
+    auto block = p.handler;
+    weak_ref<Obj> w = p;
+    auto token = p.release_raw();
+    EXPECT_TRUE(token);
+    EXPECT_EQ(p.handler, nullptr);
+    EXPECT_EQ(block->strong, 1u);
+    EXPECT_FALSE(w.expired());
+
+    auto q = shared_ref<Obj>::adopt(token);
+    EXPECT_EQ(q.handler, block);
+    EXPECT_EQ(q->value, 7);
+    EXPECT_EQ(block->strong, 1u);
+    q = nullptr;
+    EXPECT_TRUE(w.expired());
+}
+
+TEST(RefQueue, FifoFullAndEmpty)
+{
+    ref_queue<Obj> queue(3);
+    EXPECT_EQ(queue.capacity(), 4u);
+    for (int i = 0; i < 4; ++i)
+        EXPECT_TRUE(queue.try_push(shared_ref<Obj>(new Obj(i))));
+
+    auto extra = shared_ref<Obj>(new Obj(4));
+    EXPECT_FALSE(queue.try_push(std::move(extra)));
+    EXPECT_NE(extra.handler, nullptr);
+
+    shared_ref<Obj> out;
+    for (int i = 0; i < 4; ++i)
+    {
+        ASSERT_TRUE(queue.try_pop(out));
+        EXPECT_EQ(out->value, i);
+        EXPECT_EQ(out.handler->strong, 1u);
+    }
+    EXPECT_FALSE(queue.try_pop(out));
+}
+
+TEST(RefQueue, DestructorReleasesQueuedRefs)
+{
+    weak_ref<AtomicObj> w;
+    {
+        ref_queue<AtomicObj> queue(8);
+        auto p = shared_ref<AtomicObj>(new AtomicObj(1));
+        w = p;
+        queue.try_push(std::move(p));
+        EXPECT_FALSE(w.expired());
+    }
+    EXPECT_TRUE(w.expired());
+    EXPECT_EQ(AtomicObj::alive, 0);
+}
+
+TEST(RefQueue, ConcurrentProducersAndConsumers)
+{
+    constexpr int producers = 2, consumers = 2, per_producer = 20000;
+    ref_queue<AtomicObj> queue(64);
+    std::atomic<long> sum = 0;
+    std::atomic<int> received = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < producers; ++t)
+        threads.emplace_back(
+            [&]
+            {
+                for (int i = 0; i < per_producer; ++i)
+                {
+                    auto p = shared_ref<AtomicObj>(new AtomicObj(i));
+                    while (!queue.try_push(std::move(p)))
+                        std::this_thread::yield();
+                }
+            });
+    for (int t = 0; t < consumers; ++t)
+        threads.emplace_back(
+            [&]
+            {
+                shared_ref<AtomicObj> out;
+                while (received.load() < producers * per_producer)
+                {
+                    if (!queue.try_pop(out))
+                    {
+                        std::this_thread::yield();
+                        continue;
+                    }
+                    EXPECT_EQ(out->check, AtomicObj::magic);
+                    EXPECT_EQ(out.handler->strong.load(), 1u);
+                    sum += out->value;
+                    received++;
+                    out = nullptr;
+                }
+            });
+    for (auto &t : threads)
+        t.join();
+    EXPECT_EQ(sum.load(), long(producers) * per_producer * (per_producer - 1) / 2);
+    EXPECT_EQ(AtomicObj::alive, 0);
+}
+
+// ----------------------
+// 28. weighted references
+// ----------------------
+
+TEST(WeightedRef, CopiesSplitWeightWithoutTouchingBlock)
+{
+    using WRef = weighted_ref<Obj>;
+    WRef root(new Obj(5));
+    auto block = root.handler;
+    EXPECT_EQ(root.weight, WRef::full_weight);
+    EXPECT_EQ(block->strong, WRef::full_weight);
+
+    std::vector<WRef> copies;
+    for (int i = 0; i < 10; ++i)
+        copies.push_back(root);
+    EXPECT_EQ(block->strong, WRef::full_weight);
+    EXPECT_EQ(copies[9]->value, 5);
+
+    copies.clear();
+    EXPECT_EQ(block->strong, root.weight);
+}
+
+TEST(WeightedRef, ExhaustedWeightRefills)
+{
+    using WRef = weighted_ref<Obj>;
+    weak_ref<Obj> w;
+    {
+        WRef root(new Obj(1));
+        w = root.share();
+        std::vector<WRef> copies;
+        for (int i = 0; i < 40; ++i)
+            copies.push_back(root);
+        EXPECT_GT(root.handler->strong, WRef::full_weight);
+        EXPECT_FALSE(w.expired());
+    }
+    EXPECT_TRUE(w.expired());
+}
+
+TEST(WeightedRef, MixesWithPlainRefs)
+{
+    auto p = shared_ref<Obj>(new Obj(3));
+    weak_ref<Obj> w = p;
+    weighted_ref<Obj> weighted = p;
+    auto q = weighted.share();
+    EXPECT_EQ(q.handler, p.handler);
+    p = nullptr;
+    weighted = nullptr;
+    EXPECT_FALSE(w.expired());
+    EXPECT_EQ(q->value, 3);
+    q = nullptr;
+    EXPECT_TRUE(w.expired());
+}
+
+TEST(WeightedRef, NarrowCountersFallBackToPlainUnits)
+{
+    using WRef = weighted_ref<SmallFanout>;
+    shared_ref<SmallFanout> p(new SmallFanout(7));
+    auto block = p.handler;
+    std::vector<WRef> refs;
+    for (int i = 0; i < 2000; ++i)
+        refs.emplace_back(p);
+    for (int i = 0; i < 4000; ++i)
+        refs.push_back(refs[i % 100]);
+    EXPECT_LT(block->strong, 1u << 15);
+    size_t total = 1;
+    for (auto &r : refs)
+        total += r.weight;
+    EXPECT_EQ(block->strong, total);
+    EXPECT_EQ(refs.back()->value, 7);
+
+    weak_ref<SmallFanout> w = p;
+    p = nullptr;
+    refs.clear();
+    EXPECT_TRUE(w.expired());
+}
+
+TEST(WeightedRef, ConcurrentReleaseOfFannedOutCopies)
+{
+    using WRef = weighted_ref<AtomicObj>;
+    weak_ref<AtomicObj> w;
+    std::vector<std::thread> threads;
+    {
+        WRef root(new AtomicObj(9));
+        w = root.share();
+        for (int t = 0; t < 4; ++t)
+        {
+            WRef copy = root;
+            threads.emplace_back(
+                [copy = std::move(copy)]() mutable
+                {
+                    for (int i = 0; i < 1000; ++i)
+                    {
+                        WRef local = copy;
+                        EXPECT_EQ(local->check, AtomicObj::magic);
+                    }
+                    copy = nullptr;
+                });
+        }
+    }
+    for (auto &t : threads)
+        t.join();
+    EXPECT_TRUE(w.expired());
+    EXPECT_EQ(AtomicObj::alive, 0);
+}
+
+// ----------------------
+// 29. parallel teardown
+// ----------------------
+
+struct TreeNode;
+
+template <typename H>
+struct smart_ref::ref_traits<TreeNode, H> : smart_ref::default_ref_traits<TreeNode, H>
+{
+    static constexpr bool atomic_counts = true;
+    static constexpr bool parallel_teardown = true;
+};
+
+struct TreeNode : enable_ref_holder
+{
+    inline static std::atomic<int> alive = 0;
+    std::vector<shared_ref<TreeNode, TestHolderPolicy>> children;
+    TreeNode() { alive++; }
+    ~TreeNode() { alive--; }
+};
+
+using TreeRef = shared_ref<TreeNode, TestHolderPolicy>;
+
+static TreeRef build_tree(int depth, int fanout, TestHolderPolicy *holder)
+{
+    TreeRef node(new TreeNode());
+    node.set_holder(holder);
+    if (depth > 0)
+        for (int i = 0; i < fanout; ++i)
+            node->children.push_back(build_tree(depth - 1, fanout, holder));
+    return node;
+}
+
+TEST(ParallelTeardown, QueuedUntilScopeEnds)
+{
+    TestHolderPolicy holder;
+    weak_ref<TreeNode, TestHolderPolicy> w;
+    {
+        parallel_teardown_scope scope(2);
+        auto root = build_tree(2, 3, &holder);
+        w = root;
+        root = nullptr;
+        EXPECT_TRUE(w.expired());
+        EXPECT_EQ(TreeNode::alive, 13);
+    }
+    EXPECT_EQ(TreeNode::alive, 0);
+    w = nullptr;
+    EXPECT_TRUE(holder.held_handlers.empty());
+}
+
+TEST(ParallelTeardown, LargeTreeOnFourThreads)
+{
+    TestHolderPolicy holder;
+    auto root = build_tree(6, 4, &holder);
+    EXPECT_EQ(TreeNode::alive, 5461);
+    EXPECT_EQ(holder.held_handlers.size(), 5461u);
+    {
+        parallel_teardown_scope scope(4);
+        root = nullptr;
+    }
+    EXPECT_EQ(TreeNode::alive, 0);
+    EXPECT_TRUE(holder.held_handlers.empty());
+}
+
+#include <unordered_map>
+
+struct Companion;
+
+// Keeps one companion ref per tracked block and drops it from unhold_ref, so holder notifications nest.
+struct CompanionHolder
+{
+    std::unordered_map<void *, shared_ref<Companion, CompanionHolder>> companions;
+
+    static void hold_ref(void *, const auto &) {}
+    static void unhold_ref(void *self, void *h)
+    {
+        auto &companions = static_cast<CompanionHolder *>(self)->companions;
+        auto it = companions.find(h);
+        if (it == companions.end())
+            return;
+        auto keep = std::move(it->second);
+        companions.erase(it);
+    }
+};
+
+struct Companion : enable_ref_holder
+{
+    inline static std::atomic<int> alive = 0;
+    Companion() { alive++; }
+    ~Companion() { alive--; }
+};
+
+TEST(ParallelTeardown, HolderMayReleaseRefsWhileNotified)
+{
+    using NodeRef = shared_ref<TreeNode, CompanionHolder>;
+    using CompanionRef = shared_ref<Companion, CompanionHolder>;
+    CompanionHolder holder;
+    {
+        parallel_teardown_scope scope(2);
+        for (int i = 0; i < 16; ++i)
+        {
+            NodeRef node(new TreeNode());
+            node.set_holder(&holder);
+            CompanionRef companion(new Companion());
+            companion.set_holder(&holder);
+            holder.companions.emplace(node.handler, std::move(companion));
+        }
+        EXPECT_EQ(TreeNode::alive, 16);
+    }
+    EXPECT_EQ(TreeNode::alive, 0);
+    EXPECT_EQ(Companion::alive, 0);
+    EXPECT_TRUE(holder.companions.empty());
+}
+
+TEST(ParallelTeardown, ReviveInsideScopeRunsTheQueuedTeardown)
+{
+    using Ref = shared_ref<TreeNode, TestHolderPolicy>;
+    parallel_teardown_scope scope(2);
+    Ref node(new TreeNode());
+    weak_ref<TreeNode, TestHolderPolicy> w = node;
+    node = nullptr;
+    EXPECT_EQ(TreeNode::alive, 1); // queued until the scope ends
+    auto again = Ref::revive_with(w, [] { return new TreeNode(); });
+    EXPECT_EQ(TreeNode::alive, 1);
+    EXPECT_EQ(again.handler, w.handler);
+    EXPECT_EQ(w.lock(), again);
+}
+
+struct PlainLeaf
+{
+    inline static int alive = 0;
+    PlainLeaf() { alive++; }
+    ~PlainLeaf() { alive--; }
+};
+
+struct SharingNode;
+
+template <typename H>
+struct smart_ref::ref_traits<SharingNode, H> : smart_ref::default_ref_traits<SharingNode, H>
+{
+    static constexpr bool atomic_counts = true;
+    static constexpr bool parallel_teardown = true;
+};
+
+// Reclaimers destroy many of these at once, and each releases the same non-atomic leaf.
+struct SharingNode
+{
+    shared_ref<PlainLeaf> leaf;
+    weak_ref<PlainLeaf> peek;
+};
+
+TEST(ParallelTeardown, NonAtomicChildrenAreReleasedOneAtATime)
+{
+    std::vector<shared_ref<SharingNode>> nodes;
+    {
+        shared_ref<PlainLeaf> leaf(new PlainLeaf());
+        for (int i = 0; i < 20000; ++i)
+            nodes.emplace_back(new SharingNode{leaf, leaf});
+    }
+    {
+        parallel_teardown_scope scope(4);
+        nodes.clear();
+    }
+    EXPECT_EQ(PlainLeaf::alive, 0);
+}
+
+TEST(ParallelTeardown, OutsideScopeReleasesInline)
+{
+    auto root = build_tree(3, 2, nullptr);
+    root = nullptr;
+    EXPECT_EQ(TreeNode::alive, 0);
+}
+
+// ----------------------
+// 30. ref_region
+// ----------------------
+
+struct RegionNode;
+
+template <typename H>
+struct smart_ref::ref_traits<RegionNode, H> : smart_ref::default_ref_traits<RegionNode, H>
+{
+    static constexpr bool region_refs = true;
+};
+
+struct RegionNode : enable_ref_holder
+{
+    inline static int alive = 0;
+    int value;
+    shared_ref<RegionNode, TestHolderPolicy> next;
+    shared_ref<Obj> outside;
+    RegionNode(int v) : value(v) { alive++; }
+    ~RegionNode() { alive--; }
+};
+
+using RegionRef = shared_ref<RegionNode, TestHolderPolicy>;
+
+TEST(RefRegion, IntraRegionRefsAreUncounted)
+{
+    auto region = ref_region::create();
+    auto a = region->make<RegionNode, TestHolderPolicy>(1);
+    auto b = region->make<RegionNode, TestHolderPolicy>(2);
+    auto strong = a.handler->strong;
+    a->next = b;
+    b->next = a; // cycles inside a region are fine
+    {
+        RegionRef copy = a;
+        EXPECT_EQ(copy->next->value, 2);
+    }
+    EXPECT_EQ(a.handler->strong, strong);
+    EXPECT_EQ(region->size(), 2u);
+    a = nullptr;
+    b = nullptr;
+    EXPECT_EQ(RegionNode::alive, 2);
+    region->release();
+    EXPECT_EQ(RegionNode::alive, 0);
+}
+
+TEST(RefRegion, EscapedRefsKeepRegionAlive)
+{
+    TestHolderPolicy holder;
+    weak_ref<RegionNode, TestHolderPolicy> w;
+    weak_ref<Obj> outside;
+    RegionRef out;
+    {
+        auto region = ref_region::create();
+        auto a = region->make<RegionNode, TestHolderPolicy>(1);
+        a.set_holder(&holder);
+        a->next = region->make<RegionNode, TestHolderPolicy>(2);
+        a->outside = shared_ref<Obj>(new Obj(3));
+        outside = a->outside;
+        out = region->share(a->next);
+        w = out;
+        region->release();
+    }
+    EXPECT_EQ(RegionNode::alive, 2);
+    EXPECT_EQ(out->value, 2);
+    EXPECT_EQ(w.lock()->value, 2);
+    EXPECT_EQ(holder.held_handlers.size(), 1u);
+
+    auto copy = out;
+    out = nullptr;
+    EXPECT_EQ(RegionNode::alive, 2);
+    copy = nullptr;
+    EXPECT_EQ(RegionNode::alive, 0);
+    EXPECT_TRUE(w.expired());
+    EXPECT_TRUE(outside.expired());
+    EXPECT_TRUE(holder.held_handlers.empty());
+}
+
+TEST(RefRegion, ManyObjectsSpanChunks)
+{
+    auto region = ref_region::create();
+    auto head = region->make<RegionNode, TestHolderPolicy>(0);
+    auto cur = head;
+    for (int i = 1; i < 10000; ++i)
+    {
+        cur->next = region->make<RegionNode, TestHolderPolicy>(i);
+        cur = cur->next;
+    }
+    auto out = region->share(head);
+    region->release();
+    head = nullptr;
+    cur = nullptr;
+    int sum = 0;
+    for (auto p = out.get(); p; p = p->next.get())
+        sum += p->value;
+    EXPECT_EQ(sum, 9999 * 10000 / 2);
+    out = nullptr;
+    EXPECT_EQ(RegionNode::alive, 0);
+}
+
+// ----------------------
+// 31. ownership domains
+// ----------------------
+
+struct DomainNode;
+
+template <>
+struct smart_ref::ref_traits<DomainNode, nullptr_t> : smart_ref::default_ref_traits<DomainNode, nullptr_t>
+{
+    static constexpr bool weak_refs = false;
+    static constexpr bool domain_counts = true;
+};
+
+struct DomainNode
+{
+    inline static std::atomic<int> alive = 0;
+    int value;
+    DomainNode(int v) : value(v) { alive++; }
+    ~DomainNode() { alive--; }
+};
+
+TEST(RefDomain, OwnerCountsLocally)
+{
+    ref_domain domain;
+    ref_domain::scope scope(domain);
+    auto p = shared_ref<DomainNode>(new DomainNode(1));
+    EXPECT_EQ(p.handler->domain, &domain);
+    {
+        auto q = p;
+        EXPECT_EQ(p.handler->strong, 2u);
+        EXPECT_EQ(p.handler->remote.load(), 0u);
+    }
+    p = nullptr;
+    EXPECT_EQ(DomainNode::alive, 0);
+}
+
+TEST(RefDomain, RemoteReleasesWaitForDrain)
+{
+    ref_domain domain;
+    ref_domain::scope scope(domain);
+    auto p = shared_ref<DomainNode>(new DomainNode(2));
+    auto handed = p; // counted by the owner, released by the worker
+    std::thread worker(
+        [&domain, handed = std::move(handed)]() mutable
+        {
+            for (int i = 0; i < 1000; ++i)
+            {
+                auto copy = handed;
+                EXPECT_EQ(copy->value, 2);
+            }
+            EXPECT_EQ(handed.handler->remote.load(), 1000u);
+            handed = nullptr;
+            ref_domain::flush_outbox();
+        });
+    worker.join();
+    p = nullptr;
+    // The worker's releases are still in the inbox.
+    EXPECT_EQ(DomainNode::alive, 1);
+    EXPECT_EQ(domain.drain(), 1001u);
+    EXPECT_EQ(DomainNode::alive, 0);
+}
+
+TEST(RefDomain, RefsCrossBetweenDomains)
+{
+    ref_domain left, right;
+    shared_ref<DomainNode> from_left;
+    {
+        ref_domain::scope scope(left);
+        from_left = shared_ref<DomainNode>(new DomainNode(3));
+    }
+    std::thread worker(
+        [&]
+        {
+            ref_domain::scope scope(right);
+            auto local = shared_ref<DomainNode>(new DomainNode(4));
+            auto remote = from_left;
+            EXPECT_EQ(remote->value, 3);
+            EXPECT_EQ(local.handler->domain, &right);
+            local = nullptr;
+            EXPECT_EQ(DomainNode::alive, 1);
+        });
+    worker.join();
+    ref_domain::scope scope(left);
+    from_left = nullptr;
+    EXPECT_EQ(DomainNode::alive, 1);
+    left.drain();
+    EXPECT_EQ(DomainNode::alive, 0);
+}
+
+// ----------------------
+// 32. relocatable objects
+// ----------------------
+
+#include <smart_ref/relocatable_heap.hpp>
+#include <set>
+
+struct MovableNode;
+
+template <typename H>
+struct smart_ref::ref_traits<MovableNode, H> : smart_ref::default_ref_traits<MovableNode, H>
+{
+    static constexpr bool relocatable = true;
+};
+
+struct MovableNode : enable_shared_ref_from_this<MovableNode>
+{
+    inline static int alive = 0;
+    int value;
+    shared_ref<MovableNode> next;
+    MovableNode(int v) : value(v) { alive++; }
+    MovableNode(MovableNode &&other) : value(other.value), next(std::move(other.next)) { alive++; }
+    ~MovableNode() { alive--; }
+};
+
+TEST(RelocatableHeap, CompactMovesObjectsAndKeepsRefs)
+{
+    relocatable_heap<MovableNode> heap;
+    std::vector<shared_ref<MovableNode>> keep;
+    std::set<shared_ref<MovableNode>> ordered;
+    weak_ref<MovableNode> w;
+    {
+        std::vector<shared_ref<MovableNode>> all;
+        for (int i = 0; i < 20000; ++i)
+            all.push_back(heap.make(i));
+        for (int i = 0; i < 20000; i += 100)
+        {
+            all[i]->next = all[i + 1];
+            keep.push_back(all[i]);
+            ordered.insert(all[i]);
+        }
+        w = keep.back();
+    }
+    EXPECT_EQ(MovableNode::alive, 400);
+    auto before = heap.slab_count();
+    EXPECT_GT(heap.compact(), 0u);
+    EXPECT_LT(heap.slab_count(), before);
+    EXPECT_EQ(heap.slab_count(), 1u);
+    EXPECT_EQ(MovableNode::alive, 400);
+    EXPECT_NE(keep.back().get(), nullptr);
+
+    for (size_t k = 0; k < keep.size(); ++k)
+    {
+        EXPECT_EQ(keep[k]->value, int(k * 100));
+        EXPECT_EQ(keep[k]->next->value, int(k * 100 + 1));
+        EXPECT_EQ(keep[k]->shared_from_this(), keep[k]);
+        EXPECT_TRUE(ordered.count(keep[k]));
+    }
+    EXPECT_EQ(w.lock()->value, 19900);
+
+    keep.clear();
+    ordered.clear();
+    EXPECT_EQ(MovableNode::alive, 0);
+    EXPECT_TRUE(w.expired());
+    EXPECT_EQ(heap.size(), 0u);
+}
+
+TEST(RelocatableHeap, EmptySlabsAreReleased)
+{
+    relocatable_heap<MovableNode> heap;
+    std::vector<shared_ref<MovableNode>> all;
+    for (int i = 0; i < 30000; ++i)
+        all.push_back(heap.make(i));
+    EXPECT_GT(heap.slab_count(), 2u);
+    all.clear();
+    EXPECT_EQ(heap.slab_count(), 1u);
+    EXPECT_EQ(heap.size(), 0u);
+}
+
+TEST(RelocatableHeap, ViewsAndWeightedRefsFollowCompaction)
+{
+    relocatable_heap<MovableNode> heap;
+    std::vector<shared_ref<MovableNode>> keep;
+    {
+        std::vector<shared_ref<MovableNode>> all;
+        for (int i = 0; i < 20000; ++i)
+            all.push_back(heap.make(i));
+        for (int i = 0; i < 20000; i += 100)
+            keep.push_back(all[i]);
+    }
+    std::vector<ref_view<MovableNode>> views(keep.begin(), keep.end());
+    std::vector<weighted_ref<MovableNode>> weighted(keep.begin(), keep.end());
+    std::vector<MovableNode *> addresses;
+    for (auto &r : keep)
+        addresses.push_back(r.get());
+    EXPECT_GT(heap.compact(), 0u);
+
+    size_t moved = 0;
+    for (size_t k = 0; k < keep.size(); ++k)
+    {
+        moved += keep[k].get() != addresses[k];
+        EXPECT_EQ(views[k].get(), keep[k].get());
+        EXPECT_EQ(views[k]->value, int(k * 100));
+        EXPECT_EQ(views[k].promote()->value, int(k * 100));
+        EXPECT_EQ(weighted[k].get(), keep[k].get());
+        EXPECT_EQ((*weighted[k]).value, int(k * 100));
+        EXPECT_EQ(weighted[k].share()->value, int(k * 100));
+    }
+    EXPECT_GT(moved, 0u);
+
+    views.clear();
+    weighted.clear();
+    keep.clear();
+    EXPECT_EQ(MovableNode::alive, 0);
+    EXPECT_EQ(heap.size(), 0u);
+}
+
+#if defined(__linux__)
+#include <fstream>
+#include <unistd.h>
+
+static size_t resident_bytes()
+{
+    size_t total = 0, resident = 0;
+    std::ifstream("/proc/self/statm") >> total >> resident;
+    return resident * size_t(sysconf(_SC_PAGESIZE));
+}
+
+TEST(RelocatableHeap, CompactReturnsSlabPagesToTheOS)
+{
+    relocatable_heap<MovableNode> heap;
+    std::vector<shared_ref<MovableNode>> keep;
+    {
+        std::vector<shared_ref<MovableNode>> all;
+        for (int i = 0; i < 200000; ++i)
+            all.push_back(heap.make(i));
+        for (int i = 0; i < 200000; i += 1000)
+            keep.push_back(all[i]);
+    }
+    auto slabs = heap.slab_count();
+    auto before = resident_bytes();
+    heap.compact();
+    auto after = resident_bytes();
+    EXPECT_EQ(heap.slab_count(), 1u);
+    EXPECT_GE(before - std::min(before, after), (slabs - 1) * relocatable_heap<MovableNode>::slab_bytes / 2);
+    keep.clear();
+}
+#endif
+
+struct HotMovable;
+
+template <typename H>
+struct smart_ref::ref_traits<HotMovable, H> : smart_ref::default_ref_traits<HotMovable, H>
+{
+    static constexpr bool relocatable = true;
+    static constexpr bool atomic_counts = true;
+    static constexpr unsigned count_shards = 4;
+};
+
+struct HotMovable
+{
+    inline static int alive = 0;
+    HotMovable() { alive++; }
+    HotMovable(HotMovable &&) { alive++; }
+    ~HotMovable() { alive--; }
+};
+
+TEST(RelocatableHeap, ShardedObjectsArePinned)
+{
+    relocatable_heap<HotMovable> heap;
+    auto owner = heap.make();
+    EXPECT_FALSE(owner.handler->pinned());
+    auto pin = owner.pin();
+    auto copy = owner;
+    pin.release();
+    owner = nullptr;
+    EXPECT_EQ(HotMovable::alive, 1);
+    copy = nullptr;
+    EXPECT_EQ(HotMovable::alive, 0);
+    EXPECT_EQ(heap.size(), 0u);
+}
+
+// ----------------------
+// 33. slab storage
+// ----------------------
+
+struct SlabNode;
+struct AtomicSlabNode;
+
+template <typename H>
+struct smart_ref::ref_traits<SlabNode, H> : smart_ref::default_ref_traits<SlabNode, H>
+{
+    static constexpr bool slab_storage = true;
+};
+
+template <typename H>
+struct smart_ref::ref_traits<AtomicSlabNode, H> : smart_ref::default_ref_traits<AtomicSlabNode, H>
+{
+    static constexpr bool slab_storage = true;
+    static constexpr bool atomic_counts = true;
+};
+
+struct SlabNode : enable_shared_ref_from_this<SlabNode>
+{
+    inline static int alive = 0;
+    int value;
+    SlabNode(int v) : value(v) { alive++; }
+    ~SlabNode() { alive--; }
+};
+
+struct AtomicSlabNode
+{
+    int value;
+    AtomicSlabNode(int v) : value(v) {}
+};
+
+TEST(SlabStore, FreedSlotsAreReused)
+{
+    auto a = slab_store<SlabNode>::make(1);
+    auto slot = a.get();
+    EXPECT_EQ(a->value, 1);
+    EXPECT_EQ(a->shared_from_this(), a);
+    a = nullptr;
+    EXPECT_EQ(SlabNode::alive, 0);
+
+    auto b = slab_store<SlabNode>::make(2);
+    EXPECT_EQ(b.get(), slot);
+    EXPECT_EQ(b->value, 2);
+}
+
+TEST(SlabStore, ReviveReusesTheSlot)
+{
+    auto a = slab_store<SlabNode>::make(1);
+    auto slot = a.get();
+    weak_ref<SlabNode> w = a;
+    EXPECT_EQ(slab_store<SlabNode>::revive(w, 5)->value, 1); // still alive
+
+    a = nullptr;
+    EXPECT_TRUE(w.expired());
+    auto b = slab_store<SlabNode>::revive(w, 7);
+    EXPECT_EQ(b.get(), slot);
+    EXPECT_EQ(b->value, 7);
+    EXPECT_EQ(w.lock(), b);
+    EXPECT_EQ(SlabNode::alive, 1);
+    b = nullptr;
+    w = nullptr;
+    EXPECT_EQ(SlabNode::alive, 0);
+}
+
+TEST(SlabStore, AtomicSlotsDoNotShareCacheLines)
+{
+    static_assert(slab_store<AtomicSlabNode>::slot_size % 64 == 0);
+    std::vector<shared_ref<AtomicSlabNode>> all;
+    for (int i = 0; i < 1000; ++i)
+        all.push_back(slab_store<AtomicSlabNode>::make(i));
+    std::set<uintptr_t> lines;
+    for (auto &r : all)
+    {
+        auto line = reinterpret_cast<uintptr_t>(r.handler) / 64;
+        EXPECT_TRUE(lines.insert(line).second);
+    }
+}
+
+TEST(SlabStore, ChurnAcrossThreads)
+{
+    std::vector<shared_ref<AtomicSlabNode>> handoff;
+    for (int i = 0; i < 10000; ++i)
+        handoff.push_back(slab_store<AtomicSlabNode>::make(i));
+    auto slabs = slab_store<AtomicSlabNode>::slab_count();
+
+    std::thread releaser([&] { handoff.clear(); });
+    std::thread maker([] {
+        for (int round = 0; round < 100; ++round)
+        {
+            std::vector<shared_ref<AtomicSlabNode>> local;
+            for (int i = 0; i < 100; ++i)
+                local.push_back(slab_store<AtomicSlabNode>::make(i));
+        }
+    });
+    releaser.join();
+    maker.join();
+
+    for (int round = 0; round < 10; ++round)
+    {
+        std::vector<shared_ref<AtomicSlabNode>> local;
+        for (int i = 0; i < 10000; ++i)
+            local.push_back(slab_store<AtomicSlabNode>::make(i));
+    }
+    EXPECT_LE(slab_store<AtomicSlabNode>::slab_count(), slabs + 1);
+}
+
+TEST(SlabStore, SlotsLiveOnTheCreatingThreadsNode)
+{
+    std::thread worker([] {
+        int node = current_numa_node();
+        auto r = slab_store<SlabNode>::make(1);
+        EXPECT_EQ(slab_store<SlabNode>::home_node(r), node);
+        auto actual = slab_store<SlabNode>::node_of(r);
+        EXPECT_TRUE(actual == -1 || actual == node);
+        if (slab_store<SlabNode>::migrate(r, node))
+        {
+            EXPECT_EQ(slab_store<SlabNode>::node_of(r), node);
+        }
+        EXPECT_EQ(r->value, 1);
+    });
+    worker.join();
+    EXPECT_EQ(SlabNode::alive, 0);
+}
+
+// ----------------------
+// 34. tagged refs
+// ----------------------
+
+#include <unordered_set>
+
+struct Edge
+{
+    inline static int alive = 0;
+    int value;
+    Edge(int v) : value(v) { alive++; }
+    ~Edge() { alive--; }
+};
+
+TEST(TaggedRef, TagTravelsWithCopiesAndIsMaskedOnAccess)
+{
+    static_assert(sizeof(tagged_ref<Edge>) == sizeof(shared_ref<Edge>));
+    static_assert(sizeof(tagged_weak_ref<Edge>) == sizeof(weak_ref<Edge>));
+    static_assert(tagged_ref<Edge>::tag_bits >= 3);
+    {
+        shared_ref<Edge> target(new Edge(7));
+        tagged_ref<Edge> a(target, 5);
+        EXPECT_EQ(a.tag(), 5u);
+        EXPECT_EQ(a.get(), target.get());
+        EXPECT_EQ(a->value, 7);
+        EXPECT_EQ(target.handler->strong, 2u);
+
+        auto b = a;
+        EXPECT_EQ(b.tag(), 5u);
+        EXPECT_EQ(target.handler->strong, 3u);
+        b.set_tag(2);
+        EXPECT_EQ(b.tag(), 2u);
+        EXPECT_EQ(b->value, 7);
+        EXPECT_EQ(a.tag(), 5u);
+
+        auto c = std::move(b);
+        EXPECT_FALSE(b);
+        EXPECT_EQ(c.tag(), 2u);
+        EXPECT_EQ(c.ref(), target);
+        c.reset();
+        EXPECT_FALSE(c);
+        EXPECT_EQ(c.tag(), 2u);
+        EXPECT_EQ(target.handler->strong, 2u);
+    }
+    EXPECT_EQ(Edge::alive, 0);
+
+    tagged_ref<Edge> null_edge(nullptr, 3);
+    EXPECT_FALSE(null_edge);
+    EXPECT_EQ(null_edge.tag(), 3u);
+}
+
+TEST(TaggedRef, ComparisonAndHashingIncludeTheTag)
+{
+    shared_ref<Edge> target(new Edge(1));
+    tagged_ref<Edge> plain(target, 0), marked(target, 1), again(target, 1);
+    EXPECT_EQ(marked, again);
+    EXPECT_NE(plain, marked);
+    EXPECT_TRUE(plain < marked);
+    EXPECT_FALSE(marked < plain);
+
+    std::unordered_set<tagged_ref<Edge>> edges{plain, marked, again};
+    EXPECT_EQ(edges.size(), 2u);
+    std::set<tagged_ref<Edge>> ordered{marked, plain};
+    EXPECT_EQ(ordered.begin()->tag(), 0u);
+}
+
+TEST(TaggedRef, WeakKeepsTheTagAcrossLock)
+{
+    tagged_weak_ref<Edge> w;
+    {
+        tagged_ref<Edge> edge(shared_ref<Edge>(new Edge(3)), 6);
+        w = edge;
+        EXPECT_EQ(w.tag(), 6u);
+        auto copy = w;
+        auto locked = copy.lock();
+        EXPECT_EQ(locked, edge);
+        EXPECT_EQ(locked.tag(), 6u);
+        EXPECT_EQ(locked->value, 3);
+    }
+    EXPECT_EQ(Edge::alive, 0);
+    EXPECT_TRUE(w.expired());
+    auto dead = w.lock();
+    EXPECT_FALSE(dead);
+    EXPECT_EQ(dead.tag(), 6u);
+}
+
+// ----------------------
+// 35. type-tag casts
+// ----------------------
+
+#include <smart_ref/ref_cast.hpp>
+
+struct Expr : ref_typed<Expr>
+{
+    inline static int alive = 0;
+    int value;
+    Expr(int v) : value(v) { alive++; }
+    Expr(const Expr &other) : ref_typed(other), value(other.value) { alive++; }
+    virtual ~Expr() { alive--; }
+};
+
+struct Literal : ref_typed<Literal, Expr>
+{
+    using ref_typed::ref_typed;
+};
+
+struct Call : ref_typed<Call, Expr>
+{
+    int args = 0;
+    Call(int v, int n) : ref_typed(v), args(n) {}
+};
+
+struct Method : ref_typed<Method, Call>
+{
+    Method(int v) : ref_typed(v, 1) {}
+};
+
+TEST(RefCast, IsaFollowsTheDynamicType)
+{
+    shared_ref<Expr> lit(new Literal(1)), call(new Call(2, 3)), method(new Method(4));
+    EXPECT_TRUE(isa<Expr>(lit));
+    EXPECT_TRUE(isa<Literal>(lit));
+    EXPECT_FALSE(isa<Call>(lit));
+    EXPECT_TRUE(isa<Call>(call));
+    EXPECT_FALSE(isa<Method>(call));
+    EXPECT_TRUE(isa<Call>(method));
+    EXPECT_TRUE(isa<Method>(method));
+    EXPECT_FALSE(isa<Literal>(method));
+
+    // A copy is stamped with its own type, not the source's.
+    Expr sliced = *method;
+    EXPECT_FALSE(isa<Call>(&sliced));
+}
+
+TEST(RefCast, DynRefCastSharesTheBlock)
+{
+    {
+        shared_ref<Expr> method(new Method(4));
+        auto call = dyn_ref_cast<Call>(method);
+        ASSERT_TRUE(call);
+        EXPECT_EQ(call.handler, method.handler);
+        EXPECT_EQ(call->args, 1);
+        EXPECT_EQ(method.handler->strong, 2u);
+        EXPECT_FALSE(dyn_ref_cast<Literal>(method));
+        EXPECT_FALSE(dyn_ref_cast<Call>(shared_ref<Expr>()));
+        EXPECT_EQ(dyn_ref_cast<Method>(method.get()), static_cast<Method *>(call.get()));
+
+        auto back = ref_cast<Method>(call);
+        EXPECT_EQ(back->value, 4);
+        method = nullptr;
+        call = nullptr;
+        EXPECT_EQ(Expr::alive, 1);
+    }
+    EXPECT_EQ(Expr::alive, 0);
+}
+
+// ----------------------
+// 36. ref_vector
+// ----------------------
+
+#include <smart_ref/ref_vector.hpp>
+
+struct Item
+{
+    inline static int alive = 0;
+    int value;
+    Item(int v) : value(v) { alive++; }
+    ~Item() { alive--; }
+};
+
+struct AtomicItem
+{
+    int value;
+    AtomicItem(int v) : value(v) {}
+};
+
+template <typename H>
+struct smart_ref::ref_traits<AtomicItem, H> : smart_ref::default_ref_traits<AtomicItem, H>
+{
+    static constexpr bool atomic_counts = true;
+};
+
+TEST(RefVector, BulkAppendAndEraseCountOnce)
+{
+    std::vector<shared_ref<Item>> source;
+    for (int i = 0; i < 10; ++i)
+        source.emplace_back(new Item(i));
+    {
+        ref_vector<Item> v;
+        v.append(source.begin(), source.end());
+        v.push_back(shared_ref<Item>());
+        EXPECT_EQ(v.size(), 11u);
+        EXPECT_EQ(source[3].handler->strong, 2u);
+        EXPECT_EQ(v[3], source[3].get());
+        EXPECT_EQ(v[10], nullptr);
+
+        int sum = 0;
+        for (Item *p : v)
+            sum += p ? p->value : 0;
+        EXPECT_EQ(sum, 45);
+
+        auto copy = v;
+        EXPECT_EQ(source[3].handler->strong, 3u);
+        copy.erase(0, 5);
+        EXPECT_EQ(copy.size(), 6u);
+        EXPECT_EQ(copy[0]->value, 5);
+        EXPECT_EQ(source[3].handler->strong, 2u);
+        EXPECT_EQ(source[5].handler->strong, 3u);
+
+        EXPECT_EQ(v.erase_if([](Item *p) { return p == nullptr || p->value % 2 == 1; }), 6u);
+        EXPECT_EQ(v.size(), 5u);
+        EXPECT_EQ(v[4]->value, 8);
+        EXPECT_EQ(v.ref(4), source[8]);
+        EXPECT_EQ(source[7].handler->strong, 2u); // only copy still holds the odd ones it kept
+    }
+    EXPECT_EQ(source[7].handler->strong, 1u);
+    source.clear();
+    EXPECT_EQ(Item::alive, 0);
+}
+
+TEST(RefVector, LastEntryDestroysTheObject)
+{
+    ref_vector<Item> v;
+    v.push_back(shared_ref<Item>(new Item(1)));
+    v.push_back(shared_ref<Item>(new Item(2)));
+    EXPECT_EQ(Item::alive, 2);
+    v.pop_back();
+    EXPECT_EQ(Item::alive, 1);
+    ref_vector<Item> moved = std::move(v);
+    EXPECT_TRUE(v.empty());
+    moved.clear();
+    EXPECT_EQ(Item::alive, 0);
+}
+
+template <typename T>
+void check_weak_scan()
+{
+    std::vector<shared_ref<T>> live;
+    weak_ref_vector<T> w;
+    for (int i = 0; i < 103; ++i)
+    {
+        shared_ref<T> r(new T(i));
+        w.push_back(r);
+        if (i % 3 == 0)
+            live.push_back(r);
+    }
+    w.push_back(weak_ref<T>());
+
+    std::vector<uint8_t> expired;
+    EXPECT_EQ(w.scan_expired(expired), 103u - live.size() + 1);
+    for (size_t i = 0; i < 103; ++i)
+        EXPECT_EQ(expired[i], i % 3 != 0) << i;
+    EXPECT_EQ(expired[103], 1);
+
+    ref_vector<T> locked;
+    EXPECT_EQ(w.lock_all(locked), live.size());
+    EXPECT_EQ(locked[1], live[1].get());
+
+    EXPECT_EQ(w.compact_expired(), 103u - live.size() + 1);
+    EXPECT_EQ(w.size(), live.size());
+    for (size_t i = 0; i < w.size(); ++i)
+        EXPECT_EQ(w.lock(i), live[i]);
+    EXPECT_EQ(w.compact_expired(), 0u);
+}
+
+TEST(RefVector, WeakScanAndCompactExpired)
+{
+    check_weak_scan<Item>();
+    EXPECT_EQ(Item::alive, 0);
+    check_weak_scan<AtomicItem>();
+}
+
+// Build with -mavx2 (xmake target test_smart_ref_avx2) to check the gathered scan against the per-entry one.
+TEST(RefVector, WeakScanMatchesPerEntryCheck)
+{
+#if defined(__AVX2__)
+    static_assert(weak_ref_vector<Item>::gather_scan);
+#endif
+    uint32_t seed = 7;
+    auto next = [&] { return (seed = seed * 1664525u + 1013904223u) >> 16; };
+    for (size_t n = 0; n < 40; ++n)
+        for (int round = 0; round < 8; ++round)
+        {
+            std::vector<shared_ref<Item>> live;
+            weak_ref_vector<Item> w;
+            for (size_t i = 0; i < n; ++i)
+            {
+                // Round 0 starts with a run of nulls, round 1 is all nulls, the rest mix null, dead and live.
+                auto kind = round == 1 || (round == 0 && i < 5) ? 0 : next() % 3;
+                if (kind == 0)
+                    w.push_back(weak_ref<Item>());
+                else
+                {
+                    shared_ref<Item> r(new Item(int(i)));
+                    w.push_back(r);
+                    if (kind == 2)
+                        live.push_back(r);
+                }
+            }
+            std::vector<uint8_t> expired;
+            size_t count = w.scan_expired(expired);
+            size_t expected = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+                EXPECT_EQ(expired[i], w.expired(i)) << n << " " << round << " " << i;
+                expected += w.expired(i);
+            }
+            EXPECT_EQ(count, expected);
+        }
+    EXPECT_EQ(Item::alive, 0);
+}
+
+// ----------------------
+// 37. small_ref_vector
+// ----------------------
+
+#include <smart_ref/small_ref_vector.hpp>
+
+TEST(SmallRefVector, StaysInlineUpToN)
+{
+    shared_ref<Item> a(new Item(1)), b(new Item(2)), c(new Item(3));
+    small_ref_vector<weak_ref<Item>, 2> edges{a, b};
+    static_assert(sizeof(edges) == sizeof(void *) + 8 + 2 * sizeof(weak_ref<Item>));
+    EXPECT_TRUE(edges.is_inline());
+    EXPECT_EQ(edges[1].lock(), b);
+
+    edges.push_back(c);
+    EXPECT_FALSE(edges.is_inline());
+    EXPECT_EQ(edges.size(), 3u);
+    EXPECT_EQ(edges[0].lock(), a);
+    EXPECT_EQ(edges[2].lock(), c);
+    EXPECT_EQ(a.handler->weak, 1u);
+
+    edges.push_back(edges[0]); // grows while copying one of its own elements
+    EXPECT_EQ(edges[3].lock(), a);
+
+    auto moved = std::move(edges);
+    EXPECT_TRUE(edges.empty());
+    EXPECT_TRUE(edges.is_inline());
+    EXPECT_EQ(moved.size(), 4u);
+    moved.erase(0);
+    EXPECT_EQ(moved[0].lock(), b);
+    EXPECT_EQ(a.handler->weak, 1u);
+}
+
+TEST(SmallRefVector, LockAllAndCompactExpired)
+{
+    shared_ref<Item> a(new Item(1)), c(new Item(3));
+    small_ref_vector<weak_ref<Item>, 4> edges;
+    edges.push_back(a);
+    {
+        shared_ref<Item> b(new Item(2));
+        edges.push_back(b);
+    }
+    edges.push_back(c);
+
+    small_ref_vector<shared_ref<Item>, 4> locked;
+    EXPECT_EQ(edges.lock_all(locked), 2u);
+    EXPECT_EQ(locked[1], c);
+
+    int sum = 0;
+    locked.visit([&](const shared_ref<Item> &r) { sum += r->value; });
+    EXPECT_EQ(sum, 4);
+
+    EXPECT_EQ(edges.compact_expired(), 1u);
+    EXPECT_EQ(edges.size(), 2u);
+    EXPECT_EQ(edges[1].lock(), c);
+
+    auto copy = edges;
+    EXPECT_EQ(a.handler->weak, 2u);
+    copy.clear();
+    EXPECT_EQ(a.handler->weak, 1u);
+}
+
+TEST(SmallRefVector, PerTypeVisitor)
+{
+    shared_ref<Expr> call(new Call(1, 2)), lit(new Literal(3)), method(new Method(4));
+    small_ref_vector<weak_ref<Expr>, 4> edges{call, lit, method};
+    int calls = 0, args = 0;
+    edges.visit<Call>([&](const shared_ref<Call> &c) {
+        calls++;
+        args += c->args;
+    });
+    EXPECT_EQ(calls, 2);
+    EXPECT_EQ(args, 3);
+}
@@ -20,3 +20,14 @@ target("test_smart_ref")
     add_files("tests/*.cpp")
 
     set_targetdir(".")
+
+-- The same tests with AVX2 enabled, so the gathered expiry scan of weak_ref_vector is built and checked.
+target("test_smart_ref_avx2")
+    set_default(false)
+    set_kind("binary")
+    add_packages("pybind11", "gtest")
+    add_deps("smart_ref")
+    add_files("tests/*.cpp")
+    add_vectorexts("avx2")
+
+    set_targetdir(".")